@@ -0,0 +1,100 @@
+#include "arena.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+enum {
+    HUGE_PAGE_SIZE = 2 * 1024 * 1024,
+    ARENA_ALIGN = 16,
+};
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    /** Size of the whole mapping including this header. */
+    size_t size;
+    size_t used;
+};
+
+static size_t
+align_up(size_t size, size_t align)
+{
+    return (size + align - 1) & ~(align - 1);
+}
+
+static struct arena_chunk *
+arena_chunk_new(size_t size)
+{
+    size = align_up(size, HUGE_PAGE_SIZE);
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (mem == MAP_FAILED) {
+        /* No reserved huge pages - ask for transparent ones. */
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            perror("mmap");
+            exit(EXIT_FAILURE);
+        }
+        madvise(mem, size, MADV_HUGEPAGE);
+    }
+    struct arena_chunk *c = mem;
+    c->next = NULL;
+    c->size = size;
+    c->used = align_up(sizeof(*c), ARENA_ALIGN);
+    return c;
+}
+
+void
+arena_create(struct arena *a, size_t chunk_size)
+{
+    a->chunks = NULL;
+    a->chunk_size = chunk_size;
+    a->chunk_count = 0;
+}
+
+void *
+arena_alloc(struct arena *a, size_t size)
+{
+    size = align_up(size, ARENA_ALIGN);
+    struct arena_chunk *c = a->chunks;
+    if (c == NULL || c->size - c->used < size) {
+        size_t need = size + align_up(sizeof(*c), ARENA_ALIGN);
+        c = arena_chunk_new(need > a->chunk_size ? need : a->chunk_size);
+        c->next = a->chunks;
+        a->chunks = c;
+        ++a->chunk_count;
+    }
+    void *res = (char *)c + c->used;
+    c->used += size;
+    return res;
+}
+
+void
+arena_reset(struct arena *a)
+{
+    if (a->chunks == NULL)
+        return;
+    struct arena_chunk *c = a->chunks->next;
+    while (c != NULL) {
+        struct arena_chunk *next = c->next;
+        munmap(c, c->size);
+        c = next;
+    }
+    a->chunks->next = NULL;
+    a->chunks->used = align_up(sizeof(*a->chunks), ARENA_ALIGN);
+    a->chunk_count = 1;
+}
+
+void
+arena_destroy(struct arena *a)
+{
+    struct arena_chunk *c = a->chunks;
+    while (c != NULL) {
+        struct arena_chunk *next = c->next;
+        munmap(c, c->size);
+        c = next;
+    }
+    a->chunks = NULL;
+    a->chunk_count = 0;
+}
@@ -0,0 +1,35 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+struct arena_chunk;
+
+/**
+ * Bump allocator for data living until the end of the run. Memory
+ * comes in big mmaped chunks, backed by huge pages when the system
+ * has them, and is never freed piece by piece.
+ */
+struct arena {
+    struct arena_chunk *chunks;
+    /** Minimal size of a new chunk. */
+    size_t chunk_size;
+    /** How many chunks were mapped, for statistics. */
+    int chunk_count;
+};
+
+void
+arena_create(struct arena *a, size_t chunk_size);
+
+/** Allocate @a size bytes aligned by 16. Never fails. */
+void *
+arena_alloc(struct arena *a, size_t size);
+
+/** Forget all allocations. The first chunk is kept for reuse. */
+void
+arena_reset(struct arena *a);
+
+void
+arena_destroy(struct arena *a);
+
+#endif /* ARENA_H */
@@ -0,0 +1,68 @@
+import argparse
+import csv
+import os
+import re
+import subprocess
+
+parser = argparse.ArgumentParser(description = "Sweep latency and coroutine "\
+					       "count of the sorter and "\
+					       "save timings to CSV")
+parser.add_argument('-e', type=str, default='./a.out', help='sorter executable')
+parser.add_argument('-g', type=str, default='./generator',
+		    help='native generator executable')
+parser.add_argument('-o', type=str, default='bench.csv', help='output CSV')
+parser.add_argument('-l', type=str, default='0,10,100,1000',
+		    help='comma separated target latencies, microseconds')
+parser.add_argument('-n', type=str, default='1,2,4,8',
+		    help='comma separated coroutine counts')
+parser.add_argument('-d', type=str, default='uniform',
+		    help='comma separated generator distributions')
+parser.add_argument('-f', type=int, default=6, help='file count')
+parser.add_argument('-c', type=int, default=100000, help='numbers per file')
+parser.add_argument('-m', type=int, default=1000000, help='maximal number')
+parser.add_argument('-r', type=int, default=3, help='repeats per point')
+parser.add_argument('--dir', type=str, default='bench_data',
+		    help='directory for generated files')
+args = parser.parse_args()
+
+os.makedirs(args.dir, exist_ok=True)
+
+total_re = re.compile(r'^Total work time: (\d+) ns$', re.M)
+switch_re = re.compile(r'^Switch count (\d+)$', re.M)
+coro_re = re.compile(r'^coro_\d+: work time (\d+) ns$', re.M)
+
+out = open(args.o, 'w', newline='')
+writer = csv.writer(out)
+writer.writerow(['distribution', 'files', 'count', 'latency_us',
+		 'coroutines', 'repeat', 'total_ns', 'max_coro_ns',
+		 'switches'])
+
+for dist in args.d.split(','):
+	files = []
+	for i in range(args.f):
+		path = os.path.join(args.dir, '{}_{}.txt'.format(dist, i))
+		subprocess.run([args.g, '-f', path, '-c', str(args.c),
+				'-m', str(args.m), '-d', dist, '-s', str(i)],
+			       check=True)
+		files.append(path)
+	for latency in args.l.split(','):
+		for coros in args.n.split(','):
+			for rep in range(args.r):
+				res = subprocess.run([args.e, latency, coros]
+						     + files, check=True,
+						     capture_output=True,
+						     text=True).stdout
+				total = int(total_re.search(res).group(1))
+				switches = sum(int(v) for v in
+					       switch_re.findall(res))
+				coro_ns = [int(v) for v in coro_re.findall(res)]
+				writer.writerow([dist, args.f, args.c, latency,
+						 coros, rep, total,
+						 max(coro_ns, default=0),
+						 switches])
+				out.flush()
+				print('{} l={} n={} #{}: {} ns, {} switches'.format(
+					dist, latency, coros, rep, total,
+					switches))
+
+out.close()
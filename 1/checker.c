@@ -0,0 +1,307 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Native replacement for checker.py. The file is mmaped and split
+ * into chunks on whitespace boundaries, each chunk is parsed and
+ * checked in its own thread. Chunk edges are stitched afterwards.
+ *
+ * Besides the order the checker can prove that the output is a
+ * permutation of the inputs. For that every number is hashed and
+ * the hashes are summed - the sum doesn't depend on the order, so
+ * the inputs and the output can be hashed independently and in
+ * parallel.
+ */
+
+enum {
+    /** Numbers are parsed in batches and the batch is checked with vector compares. */
+    BATCH_SIZE = 1024,
+    MAX_THREADS = 256,
+};
+
+typedef long long v4ll __attribute__((vector_size(32)));
+
+struct multiset_hash {
+    uint64_t count;
+    uint64_t sum1;
+    uint64_t sum2;
+};
+
+struct chunk {
+    /* Input. */
+    const char *begin;
+    const char *end;
+    bool check_order;
+
+    /* Output. */
+    struct multiset_hash hash;
+    bool is_empty;
+    long long first;
+    long long last;
+    /** Set when a decreasing pair is found inside the chunk. */
+    bool is_broken;
+    long long bad_prev;
+    long long bad_next;
+};
+
+static uint64_t
+mix64(uint64_t z)
+{
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static void
+multiset_hash_add(struct multiset_hash *h, long long value)
+{
+    ++h->count;
+    h->sum1 += mix64((uint64_t)value);
+    h->sum2 += mix64((uint64_t)value ^ 0x9e3779b97f4a7c15ULL);
+}
+
+static void
+multiset_hash_merge(struct multiset_hash *dst, const struct multiset_hash *src)
+{
+    dst->count += src->count;
+    dst->sum1 += src->sum1;
+    dst->sum2 += src->sum2;
+}
+
+static bool
+is_space(char c)
+{
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+/** Index of the first i with v[i] > v[i + 1], or -1. */
+static int
+batch_find_decrease(const long long *v, int size)
+{
+    int i = 0;
+    for (; i + 4 < size; i += 4) {
+        v4ll a, b;
+        memcpy(&a, v + i, sizeof(a));
+        memcpy(&b, v + i + 1, sizeof(b));
+        v4ll gt = a > b;
+        if ((gt[0] | gt[1] | gt[2] | gt[3]) != 0)
+            break;
+    }
+    for (; i + 1 < size; ++i) {
+        if (v[i] > v[i + 1])
+            return i;
+    }
+    return -1;
+}
+
+static void
+chunk_flush_batch(struct chunk *c, const long long *batch, int size)
+{
+    if (size == 0)
+        return;
+    for (int i = 0; i < size; ++i)
+        multiset_hash_add(&c->hash, batch[i]);
+    if (!c->check_order)
+        return;
+    if (c->is_empty) {
+        c->first = batch[0];
+    } else if (!c->is_broken && c->last > batch[0]) {
+        c->is_broken = true;
+        c->bad_prev = c->last;
+        c->bad_next = batch[0];
+    }
+    int bad = c->is_broken ? -1 : batch_find_decrease(batch, size);
+    if (bad >= 0) {
+        c->is_broken = true;
+        c->bad_prev = batch[bad];
+        c->bad_next = batch[bad + 1];
+    }
+    c->last = batch[size - 1];
+    c->is_empty = false;
+}
+
+static void *
+chunk_scan(void *arg)
+{
+    struct chunk *c = arg;
+    long long batch[BATCH_SIZE];
+    int size = 0;
+    const char *pos = c->begin;
+    c->is_empty = true;
+    while (pos < c->end) {
+        while (pos < c->end && is_space(*pos))
+            ++pos;
+        if (pos == c->end)
+            break;
+        bool is_negative = false;
+        if (*pos == '-' || *pos == '+') {
+            is_negative = *pos == '-';
+            ++pos;
+        }
+        long long value = 0;
+        bool is_number = false;
+        while (pos < c->end && *pos >= '0' && *pos <= '9') {
+            value = value * 10 + (*pos++ - '0');
+            is_number = true;
+        }
+        /* Skip garbage like checker.py does. */
+        while (pos < c->end && !is_space(*pos)) {
+            ++pos;
+            is_number = false;
+        }
+        if (!is_number)
+            continue;
+        batch[size++] = is_negative ? -value : value;
+        if (size == BATCH_SIZE) {
+            chunk_flush_batch(c, batch, size);
+            size = 0;
+        }
+    }
+    chunk_flush_batch(c, batch, size);
+    return NULL;
+}
+
+/**
+ * Scan the whole file with @a thread_count threads. Returns -1 on
+ * an IO error, 1 if the order is broken and 0 otherwise.
+ */
+static int
+scan_file(const char *path, int thread_count, bool check_order, struct multiset_hash *hash)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror(path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    size_t size = st.st_size;
+    if (size == 0) {
+        close(fd);
+        return 0;
+    }
+    const char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    madvise((void *)data, size, MADV_SEQUENTIAL);
+
+    struct chunk chunks[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    const char *end = data + size;
+    const char *pos = data;
+    for (int i = 0; i < thread_count; ++i) {
+        const char *chunk_end = data + size / thread_count * (i + 1);
+        if (i == thread_count - 1 || chunk_end > end)
+            chunk_end = end;
+        if (chunk_end < pos)
+            chunk_end = pos;
+        /* Never cut a number in two. */
+        while (chunk_end < end && !is_space(*chunk_end))
+            ++chunk_end;
+        memset(&chunks[i], 0, sizeof(chunks[i]));
+        chunks[i].begin = pos;
+        chunks[i].end = chunk_end;
+        chunks[i].check_order = check_order;
+        pos = chunk_end;
+    }
+    for (int i = 1; i < thread_count; ++i)
+        pthread_create(&threads[i], NULL, chunk_scan, &chunks[i]);
+    chunk_scan(&chunks[0]);
+    for (int i = 1; i < thread_count; ++i)
+        pthread_join(threads[i], NULL);
+
+    int rc = 0;
+    const struct chunk *prev = NULL;
+    for (int i = 0; i < thread_count; ++i) {
+        const struct chunk *c = &chunks[i];
+        multiset_hash_merge(hash, &c->hash);
+        if (!check_order || rc != 0 || c->is_empty)
+            continue;
+        if (prev != NULL && prev->last > c->first) {
+            printf("Error on numbers %lld %lld\n", prev->last, c->first);
+            rc = 1;
+        } else if (c->is_broken) {
+            printf("Error on numbers %lld %lld\n", c->bad_prev, c->bad_next);
+            rc = 1;
+        }
+        prev = c;
+    }
+    munmap((void *)data, size);
+    return rc;
+}
+
+static void
+usage(const char *prog)
+{
+    printf("Usage: %s -f <sorted file> [-j <threads>] [<input file>...]\n"
+           "With input files also checks that the output is their permutation.\n", prog);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *path = NULL;
+    long thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    while ((opt = getopt(argc, argv, "f:j:")) != -1) {
+        switch (opt) {
+        case 'f':
+            path = optarg;
+            break;
+        case 'j':
+            thread_count = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (path == NULL) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (thread_count < 1)
+        thread_count = 1;
+    if (thread_count > MAX_THREADS)
+        thread_count = MAX_THREADS;
+
+    struct multiset_hash out_hash = {0, 0, 0};
+    int rc = scan_file(path, thread_count, true, &out_hash);
+    if (rc != 0)
+        return EXIT_FAILURE;
+
+    if (optind < argc) {
+        struct multiset_hash in_hash = {0, 0, 0};
+        for (int i = optind; i < argc; ++i) {
+            if (scan_file(argv[i], thread_count, false, &in_hash) != 0)
+                return EXIT_FAILURE;
+        }
+        if (in_hash.count != out_hash.count) {
+            printf("Error: %llu numbers in the inputs, %llu in the output\n",
+                   (unsigned long long)in_hash.count, (unsigned long long)out_hash.count);
+            return EXIT_FAILURE;
+        }
+        if (in_hash.sum1 != out_hash.sum1 || in_hash.sum2 != out_hash.sum2) {
+            printf("Error: the output is not a permutation of the inputs\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    printf("All is ok\n");
+    return 0;
+}
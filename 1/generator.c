@@ -0,0 +1,239 @@
+#include <fcntl.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Native replacement for generator.py. Numbers are formatted into a
+ * big buffer and flushed with write(), so the generation runs at
+ * disk speed instead of one f.write() per number.
+ */
+
+enum distribution {
+    DIST_UNIFORM,
+    DIST_SORTED,
+    DIST_REVERSE,
+    DIST_FEW_UNIQUE,
+    DIST_ZIPF,
+    DIST_ORGAN_PIPE,
+};
+
+static const char *distribution_names[] = {
+    "uniform", "sorted", "reverse", "few-unique", "zipf", "organ-pipe",
+};
+
+enum {
+    OUT_BUF_SIZE = 1 << 20,
+    /** Max number of distinct ranks in the Zipf table. */
+    ZIPF_MAX_RANKS = 1 << 20,
+};
+
+struct out_buf {
+    int fd;
+    size_t size;
+    char data[OUT_BUF_SIZE];
+};
+
+static void
+out_buf_flush(struct out_buf *b)
+{
+    size_t done = 0;
+    while (done < b->size) {
+        ssize_t rc = write(b->fd, b->data + done, b->size - done);
+        if (rc == -1) {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        done += rc;
+    }
+    b->size = 0;
+}
+
+static void
+out_buf_put_number(struct out_buf *b, long long value, bool need_space)
+{
+    if (b->size + 24 > OUT_BUF_SIZE)
+        out_buf_flush(b);
+    if (need_space)
+        b->data[b->size++] = ' ';
+    char tmp[24];
+    int len = 0;
+    unsigned long long u = value < 0 ? -(unsigned long long)value : (unsigned long long)value;
+    do {
+        tmp[len++] = '0' + u % 10;
+        u /= 10;
+    } while (u != 0);
+    if (value < 0)
+        b->data[b->size++] = '-';
+    while (len > 0)
+        b->data[b->size++] = tmp[--len];
+}
+
+/** splitmix64 - tiny, fast and good enough for test data. */
+static uint64_t
+rand_next(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/** Uniform in [0, bound]. */
+static long long
+rand_range(uint64_t *state, long long bound)
+{
+    return rand_next(state) % ((uint64_t)bound + 1);
+}
+
+static double
+rand_unit(uint64_t *state)
+{
+    return (rand_next(state) >> 11) * (1.0 / (1ULL << 53));
+}
+
+static void
+usage(const char *prog)
+{
+    printf("Usage: %s -f <file> -c <count> [-m <max>] [-d <distribution>] [-u <unique>] [-z <exponent>] [-s <seed>]\n"
+           "Distributions:", prog);
+    for (size_t i = 0; i < sizeof(distribution_names) / sizeof(distribution_names[0]); ++i)
+        printf(" %s", distribution_names[i]);
+    printf("\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *path = NULL;
+    long long count = -1;
+    long long max = 1LL << 31;
+    enum distribution dist = DIST_UNIFORM;
+    long long unique = 16;
+    double zipf_s = 1.1;
+    uint64_t seed = time(NULL) ^ ((uint64_t)getpid() << 32);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "f:c:m:d:u:z:s:")) != -1) {
+        switch (opt) {
+        case 'f':
+            path = optarg;
+            break;
+        case 'c':
+            count = atoll(optarg);
+            break;
+        case 'm':
+            max = atoll(optarg);
+            break;
+        case 'd': {
+            size_t n = sizeof(distribution_names) / sizeof(distribution_names[0]);
+            size_t i = 0;
+            while (i < n && strcmp(optarg, distribution_names[i]) != 0)
+                ++i;
+            if (i == n) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            dist = i;
+            break;
+        }
+        case 'u':
+            unique = atoll(optarg);
+            break;
+        case 'z':
+            zipf_s = atof(optarg);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (path == NULL || count < 0 || max < 0 || unique <= 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct out_buf *b = malloc(sizeof(*b));
+    b->size = 0;
+    b->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (b->fd == -1) {
+        perror("open");
+        free(b);
+        return EXIT_FAILURE;
+    }
+
+    long long *pool = NULL;
+    if (dist == DIST_FEW_UNIQUE) {
+        pool = malloc(unique * sizeof(*pool));
+        for (long long i = 0; i < unique; ++i)
+            pool[i] = rand_range(&seed, max);
+    }
+    /* Zipf ranks are drawn by a binary search over the CDF. */
+    double *zipf_cdf = NULL;
+    long long zipf_ranks = max + 1 < ZIPF_MAX_RANKS ? max + 1 : ZIPF_MAX_RANKS;
+    if (dist == DIST_ZIPF) {
+        zipf_cdf = malloc(zipf_ranks * sizeof(*zipf_cdf));
+        double sum = 0;
+        for (long long i = 0; i < zipf_ranks; ++i) {
+            sum += 1.0 / pow(i + 1, zipf_s);
+            zipf_cdf[i] = sum;
+        }
+        for (long long i = 0; i < zipf_ranks; ++i)
+            zipf_cdf[i] /= sum;
+    }
+
+    long long half = count / 2 > 0 ? count / 2 : 1;
+    for (long long i = 0; i < count; ++i) {
+        long long value;
+        switch (dist) {
+        case DIST_SORTED:
+            value = (long long)((double)i * max / count);
+            break;
+        case DIST_REVERSE:
+            value = (long long)((double)(count - 1 - i) * max / count);
+            break;
+        case DIST_FEW_UNIQUE:
+            value = pool[rand_next(&seed) % unique];
+            break;
+        case DIST_ZIPF: {
+            double u = rand_unit(&seed);
+            long long l = 0, r = zipf_ranks - 1;
+            while (l < r) {
+                long long m = l + (r - l) / 2;
+                if (zipf_cdf[m] < u)
+                    l = m + 1;
+                else
+                    r = m;
+            }
+            value = l;
+            break;
+        }
+        case DIST_ORGAN_PIPE:
+            if (i < half)
+                value = (long long)((double)i * max / half);
+            else
+                value = (long long)((double)(count - 1 - i) * max / half);
+            break;
+        case DIST_UNIFORM:
+        default:
+            value = rand_range(&seed, max);
+            break;
+        }
+        out_buf_put_number(b, value, i != 0);
+    }
+    out_buf_flush(b);
+
+    close(b->fd);
+    free(b);
+    free(pool);
+    free(zipf_cdf);
+    return 0;
+}
@@ -0,0 +1,220 @@
+#include "record.h"
+
+#include "arena.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static bool
+is_blank(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+/** Find the key field inside the line [line, end). */
+static void
+record_key_find(const char *line, const char *end,
+                const struct record_key_spec *spec,
+                const char **key_begin, const char **key_end)
+{
+    const char *pos = line;
+    for (int i = 1;; ++i) {
+        if (spec->delim == 0) {
+            while (pos < end && is_blank(*pos))
+                ++pos;
+        }
+        const char *field_end = pos;
+        if (spec->delim != 0) {
+            field_end = memchr(pos, spec->delim, end - pos);
+            if (field_end == NULL)
+                field_end = end;
+        } else {
+            while (field_end < end && !is_blank(*field_end))
+                ++field_end;
+        }
+        if (i == spec->field) {
+            *key_begin = pos;
+            *key_end = field_end;
+            return;
+        }
+        if (field_end == end) {
+            /* Not enough fields - the key is empty. */
+            *key_begin = end;
+            *key_end = end;
+            return;
+        }
+        pos = spec->delim != 0 ? field_end + 1 : field_end;
+    }
+}
+
+/**
+ * Digits of a numeric key, without the sign and the leading zeros.
+ * A key with no digits is 0.
+ */
+static void
+record_key_digits(const char *begin, const char *end, bool *is_negative,
+                  const char **digits_begin, const char **digits_end)
+{
+    while (begin < end && is_blank(*begin))
+        ++begin;
+    *is_negative = false;
+    if (begin < end && (*begin == '-' || *begin == '+')) {
+        *is_negative = *begin == '-';
+        ++begin;
+    }
+    while (begin < end && *begin == '0')
+        ++begin;
+    *digits_begin = begin;
+    while (begin < end && *begin >= '0' && *begin <= '9')
+        ++begin;
+    *digits_end = begin;
+}
+
+static uint64_t
+record_key_image(const char *begin, const char *end,
+                 const struct record_key_spec *spec)
+{
+    if (spec->is_numeric) {
+        bool is_negative;
+        record_key_digits(begin, end, &is_negative, &begin, &end);
+        /*
+         * Saturate at the int64_t bounds. The keys beyond them share
+         * the extreme images and are told apart by record_compare().
+         */
+        uint64_t limit = is_negative ? 1ULL << 63 : INT64_MAX;
+        uint64_t value = 0;
+        for (; begin < end; ++begin) {
+            uint64_t digit = *begin - '0';
+            if (value > (limit - digit) / 10) {
+                value = limit;
+                break;
+            }
+            value = value * 10 + digit;
+        }
+        if (is_negative)
+            value = -value;
+        /* Flip the sign bit so that unsigned order == signed order. */
+        return value ^ (1ULL << 63);
+    }
+    uint64_t image = 0;
+    for (int i = 0; i < 8; ++i) {
+        image <<= 8;
+        if (begin < end)
+            image |= (unsigned char)*begin++;
+    }
+    return image;
+}
+
+static const char *
+record_line_end(const struct record_file *f, const struct record *r)
+{
+    const char *begin = f->data + r->offset;
+    const char *end = f->data + f->data_size;
+    const char *nl = memchr(begin, '\n', end - begin);
+    return nl != NULL ? nl : end;
+}
+
+int
+record_file_load(struct record_file *f, const char *path,
+                 const struct record_key_spec *spec, struct arena *arena)
+{
+    memset(f, 0, sizeof(*f));
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    f->data = arena_alloc(arena, st.st_size + 1);
+    size_t done = 0;
+    while (done < (size_t)st.st_size) {
+        ssize_t rc = read(fd, f->data + done, st.st_size - done);
+        if (rc == -1 && errno == EINTR)
+            continue;
+        if (rc <= 0) {
+            /*
+             * A failed read, or a short one if the file shrank since
+             * fstat(). Fail rather than sort a part of the file.
+             */
+            int err = rc == 0 ? EIO : errno;
+            close(fd);
+            errno = err;
+            return -1;
+        }
+        done += rc;
+    }
+    close(fd);
+    f->data_size = done;
+
+    int line_count = 0;
+    const char *pos = f->data;
+    const char *end = f->data + f->data_size;
+    while (pos < end) {
+        const char *nl = memchr(pos, '\n', end - pos);
+        ++line_count;
+        pos = nl != NULL ? nl + 1 : end;
+    }
+
+    f->records = arena_alloc(arena, (line_count + 1) * sizeof(*f->records));
+    pos = f->data;
+    while (pos < end) {
+        const char *nl = memchr(pos, '\n', end - pos);
+        const char *line_end = nl != NULL ? nl : end;
+        const char *key_begin, *key_end;
+        record_key_find(pos, line_end, spec, &key_begin, &key_end);
+        struct record *r = &f->records[f->size++];
+        r->key = record_key_image(key_begin, key_end, spec);
+        r->offset = pos - f->data;
+        pos = nl != NULL ? nl + 1 : end;
+    }
+    return 0;
+}
+
+int
+record_compare(const struct record_key_spec *spec,
+               const struct record_file *fa, const struct record *a,
+               const struct record_file *fb, const struct record *b)
+{
+    if (a->key != b->key)
+        return a->key < b->key ? -1 : 1;
+    /* Numeric images are whole keys unless saturated. */
+    if (spec->is_numeric && a->key != 0 && a->key != UINT64_MAX)
+        return 0;
+    const char *a_begin, *a_end, *b_begin, *b_end;
+    record_key_find(fa->data + a->offset, record_line_end(fa, a), spec,
+                    &a_begin, &a_end);
+    record_key_find(fb->data + b->offset, record_line_end(fb, b), spec,
+                    &b_begin, &b_end);
+    if (spec->is_numeric) {
+        /* Same sign, so the longer digit string is the bigger one. */
+        bool is_negative;
+        record_key_digits(a_begin, a_end, &is_negative, &a_begin, &a_end);
+        record_key_digits(b_begin, b_end, &is_negative, &b_begin, &b_end);
+        size_t a_len = a_end - a_begin;
+        size_t b_len = b_end - b_begin;
+        int rc = a_len != b_len ? (a_len < b_len ? -1 : 1) :
+                 memcmp(a_begin, b_begin, a_len);
+        return is_negative ? -rc : rc;
+    }
+    size_t a_len = a_end - a_begin;
+    size_t b_len = b_end - b_begin;
+    /* The first 8 bytes are already known to be equal. */
+    if (a_len <= 8 || b_len <= 8)
+        return a_len < b_len ? -1 : a_len > b_len;
+    size_t len = a_len < b_len ? a_len : b_len;
+    int rc = memcmp(a_begin + 8, b_begin + 8, len - 8);
+    if (rc != 0)
+        return rc;
+    return a_len < b_len ? -1 : a_len > b_len;
+}
+
+size_t
+record_line_len(const struct record_file *f, const struct record *r)
+{
+    return record_line_end(f, r) - (f->data + r->offset);
+}
@@ -0,0 +1,67 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct arena;
+
+/** How to extract a sort key from a text line. */
+struct record_key_spec {
+    /** 1-based index of the key field. */
+    int field;
+    /** Field delimiter. 0 means runs of blanks, like sort(1). */
+    char delim;
+    /** Compare keys as integers instead of byte strings. */
+    bool is_numeric;
+};
+
+/**
+ * Compact sort item. The line itself stays in the file buffer and
+ * is never moved, only these 16 bytes are.
+ */
+struct record {
+    /**
+     * Order-preserving key image, compared as unsigned. For
+     * numeric keys it is the whole key saturated to int64_t, for
+     * string keys - its first 8 bytes in big-endian order.
+     */
+    uint64_t key;
+    /** Offset of the line start in the file buffer. */
+    uint64_t offset;
+};
+
+/**
+ * A whole input file together with its records. All the memory is
+ * taken from an arena and goes away with it.
+ */
+struct record_file {
+    char *data;
+    size_t data_size;
+    struct record *records;
+    int size;
+};
+
+/**
+ * Read the file at @a path and build a record per line. Returns -1
+ * with errno set if the file can't be opened or read in full.
+ */
+int
+record_file_load(struct record_file *f, const char *path,
+                 const struct record_key_spec *spec, struct arena *arena);
+
+/**
+ * Three-way comparison of two records, possibly from different
+ * files. Full keys are looked at only when the prefixes are equal.
+ */
+int
+record_compare(const struct record_key_spec *spec,
+               const struct record_file *fa, const struct record *a,
+               const struct record_file *fb, const struct record *b);
+
+/** Length of the line @a r points at, without the trailing '\n'. */
+size_t
+record_line_len(const struct record_file *f, const struct record *r);
+
+#endif /* RECORD_H */
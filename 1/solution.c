@@ -1,9 +1,14 @@
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "libcoro.h"
 
+#include "arena.h"
+#include "record.h"
 #include "vector.h"
 
 static void
@@ -41,6 +46,11 @@ struct my_context {
     char **filepaths;
     bool *is_file_taken;
     struct vector *vectors;
+    /** Not NULL in the record mode, then record_files are used instead of vectors. */
+    const struct record_key_spec *spec;
+    struct record_file *record_files;
+    /** Shared by all coroutines, it's safe since they never yield inside an allocation. */
+    struct arena *arena;
     long timer_nsec;
     struct timespec prev_ts;
     long time_slice;
@@ -88,8 +98,74 @@ quicksort(struct vector *v, int l, int r, struct my_context *ctx)
     }
 }
 
+static void
+record_swap(struct record *lhs, struct record *rhs)
+{
+    struct record tmp = *lhs;
+    *lhs = *rhs;
+    *rhs = tmp;
+}
+
+enum {
+    /** Ranges not longer than that are finished by insertion sort. */
+    RECORD_INSERTION_SORT_MAX = 16,
+};
+
+static void
+record_insertion_sort(struct record_file *f, const struct record_key_spec *spec, int l, int r)
+{
+    for (int i = l + 1; i <= r; ++i) {
+        struct record cur = f->records[i];
+        int j = i - 1;
+        while (j >= l && record_compare(spec, f, &f->records[j], f, &cur) > 0) {
+            f->records[j + 1] = f->records[j];
+            --j;
+        }
+        f->records[j + 1] = cur;
+    }
+}
+
+/**
+ * Sort only the compact (key, offset) array - the lines stay where
+ * they are. Partitioning is three-way, so repeated keys, which are
+ * common in real logs, don't degrade it to O(N^2).
+ */
+static void
+record_quicksort(struct record_file *f, const struct record_key_spec *spec, int l, int r, struct my_context *ctx)
+{
+    while (r - l + 1 > RECORD_INSERTION_SORT_MAX) {
+        struct record pivot = f->records[l + (r - l) / 2];
+        int lt = l, i = l, gt = r;
+        while (i <= gt) {
+            int rc = record_compare(spec, f, &f->records[i], f, &pivot);
+            if (rc < 0)
+                record_swap(&f->records[lt++], &f->records[i++]);
+            else if (rc > 0)
+                record_swap(&f->records[i], &f->records[gt--]);
+            else
+                ++i;
+        }
+        /* Recurse into the smaller part to bound the stack depth. */
+        if (lt - l < r - gt) {
+            record_quicksort(f, spec, l, lt - 1, ctx);
+            l = gt + 1;
+        } else {
+            record_quicksort(f, spec, gt + 1, r, ctx);
+            r = lt - 1;
+        }
+        if (is_time_quantum_over(ctx)) {
+            stop_timer(ctx);
+            coro_yield();
+            start_timer(ctx);
+        }
+    }
+    record_insertion_sort(f, spec, l, r);
+}
+
 static struct my_context *
-my_context_new(const char *name, int num_files, char **filepaths, bool *is_file_taken, struct vector *vectors, long time_slice)
+my_context_new(const char *name, int num_files, char **filepaths, bool *is_file_taken, struct vector *vectors,
+               const struct record_key_spec *spec, struct record_file *record_files, struct arena *arena,
+               long time_slice)
 {
     struct my_context *ctx = malloc(sizeof(*ctx));
     ctx->name = strdup(name);
@@ -97,6 +173,9 @@ my_context_new(const char *name, int num_files, char **filepaths, bool *is_file_
     ctx->filepaths = filepaths;
     ctx->is_file_taken = is_file_taken;
     ctx->vectors = vectors;
+    ctx->spec = spec;
+    ctx->record_files = record_files;
+    ctx->arena = arena;
     memset(&ctx->timer_nsec, 0, sizeof(ctx->timer_nsec));
     memset(&ctx->prev_ts, 0, sizeof(ctx->prev_ts));
     ctx->time_slice = time_slice;
@@ -110,6 +189,47 @@ my_context_delete(struct my_context *ctx)
     free(ctx);
 }
 
+/**
+ * Guess how many numbers the file has: its size divided by the
+ * average token width measured on the file head. The slack covers
+ * the usual variation of the width, so in most cases the vector
+ * is allocated exactly once. The guess is capped at size / 2 and
+ * INT_MAX.
+ */
+static int
+estimate_number_count(FILE *fin)
+{
+    struct stat st;
+    if (fstat(fileno(fin), &st) != 0 || st.st_size == 0) {
+        return 16;
+    }
+    char sample[4096];
+    ssize_t sample_size = pread(fileno(fin), sample, sizeof(sample), 0);
+    int tokens = 0;
+    bool in_token = false;
+    for (ssize_t i = 0; i < sample_size; ++i) {
+        bool is_space = sample[i] == ' ' || sample[i] == '\n' || sample[i] == '\t' || sample[i] == '\r';
+        if (!is_space && !in_token) {
+            ++tokens;
+        }
+        in_token = !is_space;
+    }
+    if (tokens == 0) {
+        return 16;
+    }
+    double width = (double)sample_size / tokens;
+    double count = st.st_size / width * 1.125 + 16;
+    /*
+     * A sample of mostly blanks gives a huge guess. A number and its
+     * separator take 2 bytes at least, which bounds the real count.
+     */
+    double max_count = st.st_size / 2 + 16;
+    if (max_count > INT_MAX) {
+        max_count = INT_MAX;
+    }
+    return count < max_count ? (int)count : (int)max_count;
+}
+
 static int
 coroutine_func_f(void *context)
 {
@@ -138,20 +258,30 @@ coroutine_func_f(void *context)
             break;
         }
 
+        if (ctx->spec != NULL) {
+            struct record_file *f = &ctx->record_files[current_file];
+            if (record_file_load(f, filepaths[current_file], ctx->spec, ctx->arena) != 0) {
+                printf("%s\n", filepaths[current_file]);
+                return -1;
+            }
+            record_quicksort(f, ctx->spec, 0, f->size - 1, ctx);
+            continue;
+        }
+
         FILE *fin = fopen(filepaths[current_file], "r");
         if (!fin) {
             printf("%s\n", filepaths[current_file]);
             return -1;
         }
 
-        vector_init(&vectors[current_file]);
-        while (!feof(fin)) {
-            int num;
-            fscanf(fin, "%d", &num);
-            vector_push_back(&vectors[current_file], num);
+        struct vector *v = &vectors[current_file];
+        vector_init_arena(v, ctx->arena);
+        vector_reserve(v, estimate_number_count(fin));
+        int num;
+        while (fscanf(fin, "%d", &num) == 1) {
+            vector_push_back(v, num);
         }
         fclose(fin);
-        vector_shrink_to_fit(&vectors[current_file]);
 
         quicksort(&vectors[current_file], 0, vectors[current_file].size - 1, ctx);
     }
@@ -164,42 +294,12 @@ coroutine_func_f(void *context)
     return 0;
 }
 
-int
-main(int argc, char **argv)
+static void
+merge_vectors(struct vector *vectors, int num_files, FILE *fout)
 {
-    struct timespec ts1;
-    clock_gettime(CLOCK_MONOTONIC, &ts1);
-
-    coro_sched_init();
-
-    long target_latency = atol(argv[1]) * 1e3;
-    long num_coroutines = atol(argv[2]);
-    int num_files = argc - 3;
-    struct vector *vectors = malloc(num_files * sizeof(struct vector));
-    bool *is_file_taken = calloc(num_files, sizeof(bool));
-
-    for (int i = 0; i < num_coroutines; ++i) {
-        char name[16];
-        sprintf(name, "coro_%d", i);
-        coro_new(coroutine_func_f, my_context_new(name, num_files, &argv[3], is_file_taken, vectors, target_latency / num_files));
-    }
-
-    struct coro *c;
-    while ((c = coro_sched_wait()) != NULL) {
-        printf("Finished %d\n", coro_status(c));
-        printf("Switch count %lld\n", coro_switch_count(c));
-        coro_delete(c);
-    }
-
-    // Merge
     int *pos = malloc(num_files * sizeof(int));
     memset(pos, 0, num_files * sizeof(int));
 
-    FILE *fout = fopen("out.txt", "w");
-    if (!fout) {
-        return -1;
-    }
-
     while (true) {
         int min;
         int *min_pos = NULL;
@@ -228,14 +328,130 @@ main(int argc, char **argv)
         fprintf(fout, "%d ", min);
     }
     fprintf(fout, "\n");
+    free(pos);
+}
+
+/** Stream the original lines straight from the file buffers in the merged order. */
+static void
+merge_records(struct record_file *files, int num_files, const struct record_key_spec *spec, FILE *fout)
+{
+    int *pos = calloc(num_files, sizeof(int));
+
+    while (true) {
+        int min_file = -1;
+        for (int i = 0; i < num_files; ++i) {
+            if (pos[i] >= files[i].size) {
+                continue;
+            }
+            if (min_file == -1 ||
+                record_compare(spec, &files[i], &files[i].records[pos[i]],
+                               &files[min_file], &files[min_file].records[pos[min_file]]) < 0) {
+                min_file = i;
+            }
+        }
+        if (min_file == -1) {
+            break;
+        }
+
+        const struct record_file *f = &files[min_file];
+        const struct record *r = &f->records[pos[min_file]++];
+        fwrite(f->data + r->offset, 1, record_line_len(f, r), fout);
+        fputc('\n', fout);
+    }
+    free(pos);
+}
+
+enum {
+    /** Address space is reserved lazily, so a big chunk costs nothing until touched. */
+    ARENA_CHUNK_SIZE = 64 * 1024 * 1024,
+};
+
+static void
+usage(const char *prog)
+{
+    printf("Usage: %s [-k field [-t delim] [-n]] <latency us> <coroutine count> <file>...\n"
+           "  -k field  sort whole lines by the given 1-based key field\n"
+           "  -t delim  field delimiter, blanks by default\n"
+           "  -n        compare keys as integers, not as strings\n", prog);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct timespec ts1;
+    clock_gettime(CLOCK_MONOTONIC, &ts1);
+
+    struct record_key_spec spec = {0, 0, false};
+    int opt;
+    while ((opt = getopt(argc, argv, "k:t:n")) != -1) {
+        switch (opt) {
+        case 'k':
+            spec.field = atoi(optarg);
+            break;
+        case 't':
+            spec.delim = optarg[0];
+            break;
+        case 'n':
+            spec.is_numeric = true;
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (argc - optind < 2 || (spec.field <= 0 && (spec.delim != 0 || spec.is_numeric))) {
+        usage(argv[0]);
+        return -1;
+    }
+    const struct record_key_spec *record_spec = spec.field > 0 ? &spec : NULL;
+
+    coro_sched_init();
+
+    long target_latency = atol(argv[optind]) * 1e3;
+    long num_coroutines = atol(argv[optind + 1]);
+    char **filepaths = &argv[optind + 2];
+    int num_files = argc - optind - 2;
+    struct vector *vectors = calloc(num_files, sizeof(struct vector));
+    struct record_file *record_files = calloc(num_files, sizeof(struct record_file));
+    bool *is_file_taken = calloc(num_files, sizeof(bool));
+    struct arena arena;
+    arena_create(&arena, ARENA_CHUNK_SIZE);
+
+    for (int i = 0; i < num_coroutines; ++i) {
+        char name[16];
+        sprintf(name, "coro_%d", i);
+        coro_new(coroutine_func_f, my_context_new(name, num_files, filepaths, is_file_taken, vectors,
+                                                  record_spec, record_files, &arena,
+                                                  target_latency / num_files));
+    }
+
+    struct coro *c;
+    while ((c = coro_sched_wait()) != NULL) {
+        printf("Finished %d\n", coro_status(c));
+        printf("Switch count %lld\n", coro_switch_count(c));
+        coro_delete(c);
+    }
+
+    // Merge
+    FILE *fout = fopen("out.txt", "w");
+    if (!fout) {
+        return -1;
+    }
+
+    if (record_spec != NULL) {
+        merge_records(record_files, num_files, record_spec, fout);
+    } else {
+        merge_vectors(vectors, num_files, fout);
+    }
 
     // Destroy
     fclose(fout);
-    free(pos);
     for (int i = 0; i < num_files; ++i) {
         vector_destroy(&vectors[i]);
     }
+    arena_destroy(&arena);
     free(vectors);
+    free(record_files);
     free(is_file_taken);
 
     struct timespec ts2;
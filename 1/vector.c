@@ -1,6 +1,9 @@
 #include "vector.h"
 
+#include "arena.h"
+
 #include <stdlib.h>
+#include <string.h>
 
 void
 vector_init(struct vector *v)
@@ -8,14 +11,49 @@ vector_init(struct vector *v)
     v->size = 0;
     v->capacity = 2;
     v->data = malloc(v->capacity * sizeof(int));
+    v->arena = NULL;
+}
+
+void
+vector_init_arena(struct vector *v, struct arena *a)
+{
+    v->size = 0;
+    v->capacity = 0;
+    v->data = NULL;
+    v->arena = a;
+}
+
+void
+vector_reserve(struct vector *v, int capacity)
+{
+    if (capacity <= v->capacity)
+        return;
+    if (v->arena == NULL) {
+        v->data = realloc(v->data, capacity * sizeof(int));
+    } else {
+        /* The old space is abandoned, it goes away with the arena. */
+        int *data = arena_alloc(v->arena, capacity * sizeof(int));
+        if (v->size > 0)
+            memcpy(data, v->data, v->size * sizeof(int));
+        v->data = data;
+    }
+    v->capacity = capacity;
+}
+
+void
+vector_reset(struct vector *v)
+{
+    v->size = 0;
 }
 
 void
 vector_push_back(struct vector *v, int number)
 {
     if (v->size >= v->capacity) {
-        v->capacity *= 1.5;
-        v->data = realloc(v->data, v->capacity * sizeof(int));
+        int capacity = v->capacity * 1.5;
+        if (capacity <= v->capacity)
+            capacity = v->capacity + 2;
+        vector_reserve(v, capacity);
     }
     v->data[v->size++] = number;
 }
@@ -23,6 +61,9 @@ vector_push_back(struct vector *v, int number)
 void
 vector_shrink_to_fit(struct vector *v)
 {
+    /* Arena memory can't be given back partially. */
+    if (v->arena != NULL || v->size == 0)
+        return;
     v->capacity = v->size;
     v->data = realloc(v->data, v->capacity * sizeof(int));
 }
@@ -30,5 +71,9 @@ vector_shrink_to_fit(struct vector *v)
 void
 vector_destroy(struct vector *v)
 {
-    free(v->data);
+    if (v->arena == NULL)
+        free(v->data);
+    v->data = NULL;
+    v->size = 0;
+    v->capacity = 0;
 }
@@ -1,15 +1,34 @@
 #ifndef VECTOR_H
 #define VECTOR_H
 
+struct arena;
+
 struct vector {
     int size;
     int capacity;
     int *data;
+    /** Where data is allocated from. NULL means the heap. */
+    struct arena *arena;
 };
 
 void
 vector_init(struct vector *v);
 
+/**
+ * Create a vector taking memory from @a a. Such a vector is not
+ * freed by itself, only together with the arena.
+ */
+void
+vector_init_arena(struct vector *v, struct arena *a);
+
+/** Make sure at least @a capacity numbers fit without a reallocation. */
+void
+vector_reserve(struct vector *v, int capacity);
+
+/** Drop all the numbers but keep the memory. */
+void
+vector_reset(struct vector *v);
+
 void
 vector_push_back(struct vector *v, int number);
 
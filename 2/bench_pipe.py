@@ -0,0 +1,54 @@
+import argparse
+import os
+import subprocess
+import tempfile
+import time
+
+# GB/s through a multi-stage pipeline run by the shell. External
+# /bin/cat stages copy every byte through user space twice, the
+# builtin cat and tee move pipe pages with splice() and tee().
+# SHELL_PIPE_SIZE sets the capacity of the pipes between the stages.
+
+parser = argparse.ArgumentParser(description='Pipeline throughput benchmark')
+parser.add_argument('-e', type=str, default='./a.out', help='shell executable')
+parser.add_argument('-m', type=int, default=512, help='MB to push through')
+parser.add_argument('-s', type=int, default=4, help='stages in the pipeline')
+parser.add_argument('-p', type=str, default='0,256K,1M',
+                    help='comma separated pipe sizes, 0 is the default')
+parser.add_argument('-r', type=int, default=3, help='runs, the best is taken')
+args = parser.parse_args()
+
+def pipeline(cat, tee, src, dst):
+	stages = ['{} {}'.format(cat, src)]
+	stages += [cat] * (args.s - 2)
+	if tee is not None:
+		stages[-1] = '{} {}'.format(tee, dst)
+	stages.append('{} > /dev/null'.format(cat))
+	return ' | '.join(stages)
+
+with tempfile.TemporaryDirectory() as tmp:
+	src = os.path.join(tmp, 'src')
+	dst = os.path.join(tmp, 'dst')
+	with open(src, 'wb') as f:
+		chunk = os.urandom(1 << 20)
+		for i in range(args.m):
+			f.write(chunk)
+	cases = [
+		('/bin/cat', pipeline('/bin/cat', None, src, dst)),
+		('cat', pipeline('cat', None, src, dst)),
+		('/bin/tee', pipeline('/bin/cat', '/usr/bin/tee', src, dst)),
+		('tee', pipeline('cat', 'tee', src, dst)),
+	]
+	print('{:>10} {:>8} {:>10} {:>8}'.format('command', 'pipe', 'seconds', 'GB/s'))
+	for name, line in cases:
+		for size in args.p.split(','):
+			env = dict(os.environ, SHELL_PIPE_SIZE=size)
+			best = None
+			for i in range(args.r):
+				start = time.monotonic()
+				subprocess.run([args.e], input=(line + '\n').encode(), env=env,
+					       check=True)
+				elapsed = time.monotonic() - start
+				best = elapsed if best is None else min(best, elapsed)
+			print('{:>10} {:>8} {:>10.3f} {:>8.2f}'.format(
+				name, size, best, args.m / 1024 / best))
@@ -0,0 +1,45 @@
+import argparse
+import subprocess
+import tempfile
+import time
+
+# Lines per second of a script fed to the shell through stdin. The
+# lines are builtins, so the time is mostly reading and parsing.
+
+parser = argparse.ArgumentParser(description='Script execution benchmark')
+parser.add_argument('-e', type=str, default='./a.out', help='shell executable')
+parser.add_argument('-n', type=str, default='100000,1000000',
+                    help='comma separated line counts')
+parser.add_argument('-w', type=int, default=0,
+                    help='use `true xxx...` lines of this width instead')
+parser.add_argument('--pipe', action='store_true',
+                    help='feed the script through a pipe, not a file')
+args = parser.parse_args()
+
+lines = [
+	'true',
+	'test a = a && true',
+	'false || true',
+	"echo 'some quoted \"argument\"' > /dev/null",
+]
+
+print('{:>10} {:>10} {:>12}'.format('lines', 'seconds', 'lines/sec'))
+for count in [int(n) for n in args.n.split(',')]:
+	with tempfile.TemporaryFile() as script:
+		for i in range(count):
+			if args.w > 6:
+				line = 'true ' + 'x' * (args.w - 6)
+			else:
+				line = lines[i % len(lines)]
+			script.write((line + '\n').encode())
+		script.seek(0)
+		start = time.monotonic()
+		if args.pipe:
+			p = subprocess.Popen([args.e], stdin=subprocess.PIPE,
+					     stdout=subprocess.DEVNULL)
+			p.communicate(script.read())
+		else:
+			subprocess.run([args.e], stdin=script,
+				       stdout=subprocess.DEVNULL)
+		elapsed = time.monotonic() - start
+	print('{:>10} {:>10.3f} {:>12.0f}'.format(count, elapsed, count / elapsed))
@@ -0,0 +1,883 @@
+#define _GNU_SOURCE
+#include "builtins.h"
+
+#include "parser.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+enum {
+    OUT_BUF_SIZE = 4096,
+    /** Bytes asked from splice() and friends at once. */
+    COPY_CHUNK = 1 << 30,
+    COPY_BUF_SIZE = 64 * 1024,
+};
+
+/** Buffered writer into an fd, one write() per 4KB instead of per token. */
+struct out_buf {
+    int fd;
+    uint32_t size;
+    bool is_error;
+    char data[OUT_BUF_SIZE];
+};
+
+static void
+out_flush(struct out_buf *b)
+{
+    uint32_t done = 0;
+    while (done < b->size && !b->is_error) {
+        ssize_t rc = write(b->fd, b->data + done, b->size - done);
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            b->is_error = true;
+            break;
+        }
+        done += rc;
+    }
+    b->size = 0;
+}
+
+static void
+out_write(struct out_buf *b, const char *data, size_t size)
+{
+    while (size > 0) {
+        if (b->size == OUT_BUF_SIZE)
+            out_flush(b);
+        size_t chunk = OUT_BUF_SIZE - b->size;
+        if (chunk > size)
+            chunk = size;
+        memcpy(b->data + b->size, data, chunk);
+        b->size += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+}
+
+static void
+out_putc(struct out_buf *b, char c)
+{
+    if (b->size == OUT_BUF_SIZE)
+        out_flush(b);
+    b->data[b->size++] = c;
+}
+
+static void
+out_puts(struct out_buf *b, const char *str)
+{
+    out_write(b, str, strlen(str));
+}
+
+static void
+out_format(struct out_buf *b, const char *format, ...)
+{
+    char small[256];
+    va_list ap;
+    va_start(ap, format);
+    int len = vsnprintf(small, sizeof(small), format, ap);
+    va_end(ap);
+    if (len < 0)
+        return;
+    if ((size_t)len < sizeof(small)) {
+        out_write(b, small, len);
+        return;
+    }
+    char *big = malloc(len + 1);
+    va_start(ap, format);
+    vsnprintf(big, len + 1, format, ap);
+    va_end(ap);
+    out_write(b, big, len);
+    free(big);
+}
+
+static int
+out_finish(struct out_buf *b, int status)
+{
+    out_flush(b);
+    return b->is_error ? 1 : status;
+}
+
+enum {
+    /** Returned by decode_escape() for \c - stop all the output. */
+    ESCAPE_STOP = -1,
+};
+
+/**
+ * Decode an escape sequence. @a pos points right after the
+ * backslash and is moved past the sequence. echo wants octal as
+ * \0nnn, printf as \nnn.
+ */
+static int
+decode_escape(const char **pos, bool is_echo)
+{
+    const char *p = *pos;
+    int c = *p;
+    if (c == 0)
+        return '\\';
+    ++p;
+    switch (c) {
+    case 'a': c = '\a'; break;
+    case 'b': c = '\b'; break;
+    case 'e': c = 27; break;
+    case 'f': c = '\f'; break;
+    case 'n': c = '\n'; break;
+    case 'r': c = '\r'; break;
+    case 't': c = '\t'; break;
+    case 'v': c = '\v'; break;
+    case '\\': c = '\\'; break;
+    case 'c':
+        *pos = p;
+        return ESCAPE_STOP;
+    case 'x': {
+        int value = 0, digits = 0;
+        while (digits < 2) {
+            char h = *p;
+            int d;
+            if (h >= '0' && h <= '9')
+                d = h - '0';
+            else if (h >= 'a' && h <= 'f')
+                d = h - 'a' + 10;
+            else if (h >= 'A' && h <= 'F')
+                d = h - 'A' + 10;
+            else
+                break;
+            value = value * 16 + d;
+            ++digits;
+            ++p;
+        }
+        if (digits == 0) {
+            /* Not an escape - keep the backslash. */
+            return '\\';
+        }
+        c = value;
+        break;
+    }
+    default:
+        if (c >= '0' && c <= '7' && (!is_echo || c == '0')) {
+            int value = is_echo ? 0 : c - '0';
+            int digits = is_echo ? 0 : 1;
+            while (digits < 3 && *p >= '0' && *p <= '7') {
+                value = value * 8 + (*p++ - '0');
+                ++digits;
+            }
+            c = value & 0xff;
+            break;
+        }
+        /* Unknown escape - keep the backslash, the char goes next. */
+        return '\\';
+    }
+    *pos = p;
+    return c;
+}
+
+/**
+ * Expand the escapes of @a str into a new string. The result is
+ * never longer than @a str, an escape is at least 2 chars. Its
+ * length is in @a len, as \0 can be inside. @a is_stop is set on \c.
+ */
+static char *
+escaped_dup(const char *str, bool is_echo, size_t *len, bool *is_stop)
+{
+    char *res = malloc(strlen(str) + 1);
+    size_t size = 0;
+    *is_stop = false;
+    while (*str != 0) {
+        if (*str != '\\') {
+            res[size++] = *str++;
+            continue;
+        }
+        ++str;
+        int c = decode_escape(&str, is_echo);
+        if (c == ESCAPE_STOP) {
+            *is_stop = true;
+            break;
+        }
+        res[size++] = c;
+    }
+    res[size] = 0;
+    *len = size;
+    return res;
+}
+
+/** Write @a str expanding escapes. Returns false on \c. */
+static bool
+out_escaped(struct out_buf *b, const char *str, bool is_echo)
+{
+    while (*str != 0) {
+        if (*str != '\\') {
+            out_putc(b, *str++);
+            continue;
+        }
+        ++str;
+        int c = decode_escape(&str, is_echo);
+        if (c == ESCAPE_STOP)
+            return false;
+        out_putc(b, c);
+    }
+    return true;
+}
+
+static int
+builtin_true(const struct command *cmd, int out_fd)
+{
+    (void)cmd;
+    (void)out_fd;
+    return 0;
+}
+
+static int
+builtin_false(const struct command *cmd, int out_fd)
+{
+    (void)cmd;
+    (void)out_fd;
+    return 1;
+}
+
+static int
+builtin_echo(const struct command *cmd, int out_fd)
+{
+    struct out_buf b = {.fd = out_fd};
+    bool need_newline = true;
+    bool need_escapes = false;
+    uint32_t i = 0;
+    /* Options like in bash: any mix of -n, -e, -E, until a non-option. */
+    for (; i < cmd->arg_count; ++i) {
+        const char *arg = cmd->args[i];
+        if (arg[0] != '-' || arg[1] == 0 || strspn(arg + 1, "neE") != strlen(arg + 1))
+            break;
+        for (const char *c = arg + 1; *c != 0; ++c) {
+            if (*c == 'n')
+                need_newline = false;
+            else
+                need_escapes = *c == 'e';
+        }
+    }
+    for (uint32_t first = i; i < cmd->arg_count; ++i) {
+        if (i != first)
+            out_putc(&b, ' ');
+        if (!need_escapes) {
+            out_puts(&b, cmd->args[i]);
+        } else if (!out_escaped(&b, cmd->args[i], true)) {
+            return out_finish(&b, 0);
+        }
+    }
+    if (need_newline)
+        out_putc(&b, '\n');
+    return out_finish(&b, 0);
+}
+
+static int
+builtin_pwd(const struct command *cmd, int out_fd)
+{
+    (void)cmd;
+    char *cwd = getcwd(NULL, 0);
+    if (cwd == NULL) {
+        perror("pwd");
+        return 1;
+    }
+    struct out_buf b = {.fd = out_fd};
+    out_puts(&b, cwd);
+    out_putc(&b, '\n');
+    free(cwd);
+    return out_finish(&b, 0);
+}
+
+static int
+builtin_printf(const struct command *cmd, int out_fd)
+{
+    if (cmd->arg_count == 0) {
+        fprintf(stderr, "printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+    struct out_buf b = {.fd = out_fd};
+    const char *format = cmd->args[0];
+    uint32_t arg_i = 1;
+    int status = 0;
+    /* The format is reused while there are arguments, like in bash. */
+    while (true) {
+        bool is_arg_used = false;
+        const char *p = format;
+        while (*p != 0) {
+            if (*p == '\\') {
+                ++p;
+                int c = decode_escape(&p, false);
+                if (c == ESCAPE_STOP)
+                    return out_finish(&b, status);
+                out_putc(&b, c);
+                continue;
+            }
+            if (*p != '%') {
+                out_putc(&b, *p++);
+                continue;
+            }
+            if (p[1] == '%') {
+                out_putc(&b, '%');
+                p += 2;
+                continue;
+            }
+            /* Flags, width and precision go to snprintf() as is. */
+            char spec[32];
+            size_t spec_len = strspn(p + 1, "-+ #0123456789.") + 1;
+            if (spec_len > sizeof(spec) - 4 || p[spec_len] == 0) {
+                fprintf(stderr, "printf: invalid format\n");
+                return out_finish(&b, 1);
+            }
+            memcpy(spec, p, spec_len);
+            char conv = p[spec_len];
+            p += spec_len + 1;
+            const char *arg = NULL;
+            if (arg_i < cmd->arg_count) {
+                arg = cmd->args[arg_i++];
+                is_arg_used = true;
+            }
+            char *end;
+            switch (conv) {
+            case 's':
+                memcpy(spec + spec_len, "s", 2);
+                out_format(&b, spec, arg != NULL ? arg : "");
+                break;
+            case 'b': {
+                size_t len;
+                bool is_stop;
+                char *str = escaped_dup(arg != NULL ? arg : "", true, &len, &is_stop);
+                if (spec_len == 1) {
+                    /* No width, \0 bytes are printed too. */
+                    out_write(&b, str, len);
+                } else {
+                    memcpy(spec + spec_len, "s", 2);
+                    out_format(&b, spec, str);
+                }
+                free(str);
+                /* \c in %b stops all the output, like in bash. */
+                if (is_stop)
+                    return out_finish(&b, status);
+                break;
+            }
+            case 'c':
+                if (arg != NULL && arg[0] != 0)
+                    out_putc(&b, arg[0]);
+                break;
+            case 'd':
+            case 'i': {
+                long long v = arg != NULL ? strtoll(arg, &end, 0) : 0;
+                if (arg != NULL && (*end != 0 || end == arg)) {
+                    fprintf(stderr, "printf: %s: invalid number\n", arg);
+                    status = 1;
+                }
+                memcpy(spec + spec_len, "lld", 4);
+                out_format(&b, spec, v);
+                break;
+            }
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X': {
+                unsigned long long v = arg != NULL ? strtoull(arg, &end, 0) : 0;
+                if (arg != NULL && (*end != 0 || end == arg)) {
+                    fprintf(stderr, "printf: %s: invalid number\n", arg);
+                    status = 1;
+                }
+                spec[spec_len] = 'l';
+                spec[spec_len + 1] = 'l';
+                spec[spec_len + 2] = conv;
+                spec[spec_len + 3] = 0;
+                out_format(&b, spec, v);
+                break;
+            }
+            case 'f':
+            case 'e':
+            case 'E':
+            case 'g':
+            case 'G': {
+                double v = arg != NULL ? strtod(arg, &end) : 0;
+                spec[spec_len] = conv;
+                spec[spec_len + 1] = 0;
+                out_format(&b, spec, v);
+                break;
+            }
+            default:
+                fprintf(stderr, "printf: %%%c: invalid directive\n", conv);
+                return out_finish(&b, 1);
+            }
+        }
+        if (!is_arg_used || arg_i >= cmd->arg_count)
+            break;
+    }
+    return out_finish(&b, status);
+}
+
+static int
+test_unary(const char *op, const char *arg)
+{
+    struct stat st;
+    if (strcmp(op, "-n") == 0)
+        return arg[0] != 0 ? 0 : 1;
+    if (strcmp(op, "-z") == 0)
+        return arg[0] == 0 ? 0 : 1;
+    if (strcmp(op, "-r") == 0)
+        return access(arg, R_OK) == 0 ? 0 : 1;
+    if (strcmp(op, "-w") == 0)
+        return access(arg, W_OK) == 0 ? 0 : 1;
+    if (strcmp(op, "-x") == 0)
+        return access(arg, X_OK) == 0 ? 0 : 1;
+    if (op[0] != '-' || op[1] == 0 || op[2] != 0 || strchr("efdsLh", op[1]) == NULL) {
+        fprintf(stderr, "test: %s: unary operator expected\n", op);
+        return 2;
+    }
+    int rc = op[1] == 'L' || op[1] == 'h' ? lstat(arg, &st) : stat(arg, &st);
+    if (rc != 0)
+        return 1;
+    switch (op[1]) {
+    case 'e':
+        return 0;
+    case 'f':
+        return S_ISREG(st.st_mode) ? 0 : 1;
+    case 'd':
+        return S_ISDIR(st.st_mode) ? 0 : 1;
+    case 's':
+        return st.st_size > 0 ? 0 : 1;
+    default:
+        return S_ISLNK(st.st_mode) ? 0 : 1;
+    }
+}
+
+static int
+test_binary(const char *lhs, const char *op, const char *rhs)
+{
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0)
+        return strcmp(lhs, rhs) == 0 ? 0 : 1;
+    if (strcmp(op, "!=") == 0)
+        return strcmp(lhs, rhs) != 0 ? 0 : 1;
+    static const char *ops[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+    for (int i = 0; i < 6; ++i) {
+        if (strcmp(op, ops[i]) != 0)
+            continue;
+        char *end1, *end2;
+        long long a = strtoll(lhs, &end1, 10);
+        long long b = strtoll(rhs, &end2, 10);
+        if (*end1 != 0 || *end2 != 0 || end1 == lhs || end2 == rhs) {
+            fprintf(stderr, "test: integer expression expected\n");
+            return 2;
+        }
+        bool res[] = {a == b, a != b, a < b, a <= b, a > b, a >= b};
+        return res[i] ? 0 : 1;
+    }
+    fprintf(stderr, "test: %s: binary operator expected\n", op);
+    return 2;
+}
+
+static bool
+test_is_binary_op(const char *op)
+{
+    static const char *ops[] = {"=", "==", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); ++i) {
+        if (strcmp(op, ops[i]) == 0)
+            return true;
+    }
+    return false;
+}
+
+static bool
+test_is_unary_op(const char *op)
+{
+    return op[0] == '-' && op[1] != 0 && op[2] == 0 && strchr("nzrwxefdsLh", op[1]) != NULL;
+}
+
+/** Recursive descent over the arguments of a long test expression. */
+struct test_parser {
+    char **argv;
+    uint32_t argc;
+    uint32_t pos;
+};
+
+static int
+test_parse_or(struct test_parser *p);
+
+/** ! primary, ( expr ), unary, binary, or a single string. */
+static int
+test_parse_primary(struct test_parser *p)
+{
+    char **a = p->argv + p->pos;
+    uint32_t left = p->argc - p->pos;
+    if (left == 0) {
+        fprintf(stderr, "test: argument expected\n");
+        return 2;
+    }
+    if (left > 1 && strcmp(a[0], "!") == 0) {
+        ++p->pos;
+        int rc = test_parse_primary(p);
+        return rc == 2 ? 2 : !rc;
+    }
+    if (left > 1 && strcmp(a[0], "(") == 0) {
+        ++p->pos;
+        int rc = test_parse_or(p);
+        if (rc == 2)
+            return 2;
+        if (p->pos == p->argc || strcmp(p->argv[p->pos], ")") != 0) {
+            fprintf(stderr, "test: `)' expected\n");
+            return 2;
+        }
+        ++p->pos;
+        return rc;
+    }
+    if (left > 2 && test_is_binary_op(a[1])) {
+        p->pos += 3;
+        return test_binary(a[0], a[1], a[2]);
+    }
+    if (left > 1 && test_is_unary_op(a[0])) {
+        p->pos += 2;
+        return test_unary(a[0], a[1]);
+    }
+    ++p->pos;
+    return a[0][0] != 0 ? 0 : 1;
+}
+
+/** -a binds tighter than -o. */
+static int
+test_parse_and(struct test_parser *p)
+{
+    int rc = test_parse_primary(p);
+    while (rc != 2 && p->pos < p->argc && strcmp(p->argv[p->pos], "-a") == 0) {
+        ++p->pos;
+        int rhs = test_parse_primary(p);
+        rc = rhs == 2 ? 2 : (rc == 0 && rhs == 0 ? 0 : 1);
+    }
+    return rc;
+}
+
+static int
+test_parse_or(struct test_parser *p)
+{
+    int rc = test_parse_and(p);
+    while (rc != 2 && p->pos < p->argc && strcmp(p->argv[p->pos], "-o") == 0) {
+        ++p->pos;
+        int rhs = test_parse_and(p);
+        rc = rhs == 2 ? 2 : (rc == 0 || rhs == 0 ? 0 : 1);
+    }
+    return rc;
+}
+
+/**
+ * POSIX test. Up to 4 arguments the meaning is decided by their
+ * count, so `[ -n ]` or `[ ! = x ]` work. Longer expressions are
+ * parsed with !, ( ), -a and -o.
+ */
+static int
+test_eval(char **argv, uint32_t argc)
+{
+    if (argc == 0)
+        return 1;
+    /* With 3 arguments a binary operator goes first: [ ! = x ]. */
+    if (argc > 1 && argc <= 4 && strcmp(argv[0], "!") == 0 &&
+        (argc != 3 || !test_is_binary_op(argv[1]))) {
+        int rc = test_eval(argv + 1, argc - 1);
+        return rc == 2 ? 2 : !rc;
+    }
+    bool is_parens = argc > 2 && strcmp(argv[0], "(") == 0 && strcmp(argv[argc - 1], ")") == 0;
+    switch (argc) {
+    case 1:
+        return argv[0][0] != 0 ? 0 : 1;
+    case 2:
+        return test_unary(argv[0], argv[1]);
+    case 3:
+        if (test_is_binary_op(argv[1]))
+            return test_binary(argv[0], argv[1], argv[2]);
+        if (is_parens)
+            return test_eval(argv + 1, 1);
+        /* Only -a and -o are left, test_binary() reports the rest. */
+        if (strcmp(argv[1], "-a") != 0 && strcmp(argv[1], "-o") != 0)
+            return test_binary(argv[0], argv[1], argv[2]);
+        break;
+    case 4:
+        if (is_parens)
+            return test_eval(argv + 1, 2);
+        break;
+    }
+    struct test_parser p = {.argv = argv, .argc = argc, .pos = 0};
+    int rc = test_parse_or(&p);
+    if (rc != 2 && p.pos != argc) {
+        fprintf(stderr, "test: too many arguments\n");
+        return 2;
+    }
+    return rc;
+}
+
+static int
+builtin_test(const struct command *cmd, int out_fd)
+{
+    (void)out_fd;
+    uint32_t argc = cmd->arg_count;
+    if (strcmp(cmd->exe, "[") == 0) {
+        if (argc == 0 || strcmp(cmd->args[argc - 1], "]") != 0) {
+            fprintf(stderr, "[: missing `]'\n");
+            return 2;
+        }
+        --argc;
+    }
+    return test_eval(cmd->args, argc);
+}
+
+static int
+write_all(int fd, const char *data, size_t size)
+{
+    while (size > 0) {
+        ssize_t rc = write(fd, data, size);
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += rc;
+        size -= rc;
+    }
+    return 0;
+}
+
+static int64_t spliced_bytes;
+
+/** Copy through a buffer, for the fds the kernel can't move between. */
+static int
+copy_fds_rw(int in_fd, const int *out_fds, uint32_t out_count)
+{
+    char buf[COPY_BUF_SIZE];
+    while (true) {
+        ssize_t rc = read(in_fd, buf, sizeof(buf));
+        if (rc == 0)
+            return 0;
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        for (uint32_t i = 0; i < out_count; ++i) {
+            if (write_all(out_fds[i], buf, rc) != 0)
+                return -1;
+        }
+    }
+}
+
+static bool
+fd_is(int fd, mode_t type)
+{
+    struct stat st;
+    return fstat(fd, &st) == 0 && (st.st_mode & S_IFMT) == type;
+}
+
+/**
+ * Move everything from @a in_fd to @a out_fd without copying it
+ * into the process: splice() when one end is a pipe,
+ * copy_file_range() between regular files. Anything else, like a
+ * terminal, is copied with read() and write(). The file offsets are
+ * advanced by all the ways, so a fallback can take over midway.
+ */
+static int
+copy_fd(int in_fd, int out_fd)
+{
+    bool is_pipe = fd_is(in_fd, S_IFIFO) || fd_is(out_fd, S_IFIFO);
+    bool is_file = fd_is(in_fd, S_IFREG) && fd_is(out_fd, S_IFREG);
+    while (is_pipe || is_file) {
+        ssize_t rc;
+        if (is_pipe)
+            rc = splice(in_fd, NULL, out_fd, NULL, COPY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+        else
+            rc = copy_file_range(in_fd, NULL, out_fd, NULL, COPY_CHUNK, 0);
+        if (rc == 0)
+            return 0;
+        if (rc > 0) {
+            spliced_bytes += rc;
+            continue;
+        }
+        if (errno == EINTR)
+            continue;
+        /* EBADF is also an O_APPEND output, splice() refuses those. */
+        if (errno != EINVAL && errno != EBADF && errno != EXDEV && errno != ENOSYS &&
+            errno != EOPNOTSUPP)
+            return -1;
+        break;
+    }
+    return copy_fds_rw(in_fd, &out_fd, 1);
+}
+
+static int
+splice_exact(int in_fd, int out_fd, size_t size)
+{
+    while (size > 0) {
+        ssize_t rc = splice(in_fd, NULL, out_fd, NULL, size, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (rc == -1 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return -1;
+        spliced_bytes += rc;
+        size -= rc;
+    }
+    return 0;
+}
+
+/**
+ * Options the builtins don't know are handled by the real binary.
+ * Only for builtins which always run as a forked stage.
+ */
+static bool
+has_unknown_option(const struct command *cmd, uint32_t first, const char *known)
+{
+    for (uint32_t i = first; i < cmd->arg_count; ++i) {
+        const char *arg = cmd->args[i];
+        if (arg[0] == '-' && arg[1] != 0 && strcmp(arg, known) != 0)
+            return true;
+    }
+    return false;
+}
+
+static int
+exec_external(const struct command *cmd)
+{
+    char **argv = malloc((cmd->arg_count + 2) * sizeof(*argv));
+    argv[0] = cmd->exe;
+    memcpy(argv + 1, cmd->args, cmd->arg_count * sizeof(*argv));
+    argv[cmd->arg_count + 1] = NULL;
+    execvp(cmd->exe, argv);
+    fprintf(stderr, "%s: %s\n", cmd->exe, strerror(errno));
+    free(argv);
+    return 127;
+}
+
+static int
+cat_path(const char *path, int out_fd)
+{
+    bool is_stdin = strcmp(path, "-") == 0;
+    int fd = is_stdin ? STDIN_FILENO : open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "cat: %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    int rc = copy_fd(fd, out_fd);
+    if (rc != 0)
+        fprintf(stderr, "cat: %s: %s\n", path, strerror(errno));
+    if (!is_stdin)
+        close(fd);
+    return rc != 0;
+}
+
+/** cat [-u] [FILE...], "-" or no files is stdin. Never buffers. */
+static int
+builtin_cat(const struct command *cmd, int out_fd)
+{
+    if (has_unknown_option(cmd, 0, "-u"))
+        return exec_external(cmd);
+    uint32_t i = 0;
+    if (i < cmd->arg_count && strcmp(cmd->args[i], "-u") == 0)
+        ++i;
+    if (i == cmd->arg_count)
+        return cat_path("-", out_fd);
+    int status = 0;
+    for (; i < cmd->arg_count; ++i)
+        status |= cat_path(cmd->args[i], out_fd);
+    return status;
+}
+
+/**
+ * Stdin into stdout and the first file. tee() duplicates the pipe
+ * pages into stdout, then splice() moves the same pages into the
+ * file. Needs stdin and stdout to be pipes, and the file not in
+ * O_APPEND mode - splice() refuses those.
+ */
+static int
+tee_spliced(int in_fd, int out_fd, int file_fd)
+{
+    while (true) {
+        ssize_t rc = tee(in_fd, out_fd, COPY_CHUNK, 0);
+        if (rc == 0)
+            return 0;
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        spliced_bytes += rc;
+        if (splice_exact(in_fd, file_fd, rc) != 0)
+            return -1;
+    }
+}
+
+/**
+ * tee [-a] [FILE...]. With no files it is cat. With one file
+ * between two pipes the data never enters the process, otherwise
+ * it goes through a buffer.
+ */
+static int
+builtin_tee(const struct command *cmd, int out_fd)
+{
+    if (has_unknown_option(cmd, 0, "-a"))
+        return exec_external(cmd);
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | O_TRUNC;
+    uint32_t i = 0;
+    if (i < cmd->arg_count && strcmp(cmd->args[i], "-a") == 0) {
+        flags = O_WRONLY | O_CREAT | O_CLOEXEC | O_APPEND;
+        ++i;
+    }
+    int status = 0;
+    uint32_t fd_count = 0;
+    int *fds = malloc((cmd->arg_count - i + 1) * sizeof(*fds));
+    fds[fd_count++] = out_fd;
+    for (; i < cmd->arg_count; ++i) {
+        int fd = open(cmd->args[i], flags, 0644);
+        if (fd == -1) {
+            fprintf(stderr, "tee: %s: %s\n", cmd->args[i], strerror(errno));
+            status = 1;
+            continue;
+        }
+        fds[fd_count++] = fd;
+    }
+    int rc;
+    if (fd_count == 1) {
+        rc = copy_fd(STDIN_FILENO, out_fd);
+    } else if (fd_count == 2 && (flags & O_APPEND) == 0 && fd_is(STDIN_FILENO, S_IFIFO) &&
+               fd_is(out_fd, S_IFIFO) && (fd_is(fds[1], S_IFREG) || fd_is(fds[1], S_IFIFO))) {
+        rc = tee_spliced(STDIN_FILENO, out_fd, fds[1]);
+    } else {
+        rc = copy_fds_rw(STDIN_FILENO, fds, fd_count);
+    }
+    if (rc != 0) {
+        perror("tee");
+        status = 1;
+    }
+    for (uint32_t k = 1; k < fd_count; ++k)
+        close(fds[k]);
+    free(fds);
+    return status;
+}
+
+static const struct builtin builtins[] = {
+    {"echo", builtin_echo, false},
+    {"true", builtin_true, false},
+    {"false", builtin_false, false},
+    {"pwd", builtin_pwd, false},
+    {"printf", builtin_printf, false},
+    {"test", builtin_test, false},
+    {"[", builtin_test, false},
+    {"cat", builtin_cat, true},
+    {"tee", builtin_tee, true},
+};
+
+const struct builtin *
+builtin_find(const char *name)
+{
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); ++i) {
+        if (strcmp(builtins[i].name, name) == 0)
+            return &builtins[i];
+    }
+    return NULL;
+}
+
+int64_t
+builtin_spliced_bytes(void)
+{
+    return spliced_bytes;
+}
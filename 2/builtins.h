@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct command;
+
+/**
+ * A builtin is a command executed without exec. It writes into
+ * @a out_fd and returns an exit status. Builtins don't touch the
+ * shell state, so the same function works both inside the shell
+ * process and inside a forked pipeline stage.
+ */
+typedef int (*builtin_f)(const struct command *cmd, int out_fd);
+
+struct builtin {
+    const char *name;
+    builtin_f f;
+    /**
+     * Reads stdin. Such a builtin always runs as a forked stage: in
+     * the shell process stdin is the script.
+     */
+    bool is_stdin_reader;
+};
+
+/** Find a builtin by the command name. NULL if it is not a builtin. */
+const struct builtin *
+builtin_find(const char *name);
+
+/**
+ * Bytes the builtins of this process moved by splice(), tee() and
+ * copy_file_range(). They are not in wchar of /proc/<pid>/io, which
+ * counts only the write()s.
+ */
+int64_t
+builtin_spliced_bytes(void);
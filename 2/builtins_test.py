@@ -0,0 +1,28 @@
+# Regression tests of the echo, printf and test builtins.
+from shell_test import check, finish
+
+check('printf %b longer than the output buffer',
+      "printf '%b\\n' '" + 'x' * 5000 + "' | wc -c | tr -d [:blank:]\n",
+      '5001\n')
+check('printf %b expands escapes',
+      "printf '%b|%5b|\\n' 'a\\tb' 'cd'\n",
+      'a\tb|   cd|\n')
+check('printf \\c in %b stops the output',
+      "printf '%b%s\\n' 'one\\ctwo' three\necho\n",
+      'one\n')
+check('test with ( ), -a, -o and !',
+      "[ \\( a = b -o 1 -lt 2 \\) -a ! -z a ] && echo yes\n"
+      "test a = a -a b = c || echo no\n"
+      "[ ! a = b -a -n x ] && echo yes\n",
+      'yes\nno\nyes\n')
+check('test decides up to 4 arguments by their count',
+      "[ -n ] && echo 1\n"
+      "[ ! = x ] || echo 2\n"
+      "[ \\( x \\) ] && echo 3\n"
+      "[ ! \\( \"\" \\) ] && echo 4\n",
+      '1\n2\n3\n4\n')
+check('test reports a bad expression',
+      "[ a b c d e ] || echo bad\n"
+      "[ a = b -o ] || echo bad\n",
+      'test: too many arguments\nbad\ntest: argument expected\nbad\n')
+finish()
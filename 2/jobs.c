@@ -0,0 +1,293 @@
+#include "jobs.h"
+
+#include "parser.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+enum {
+    PID_HASH_MIN_SIZE = 16,
+};
+
+static uint32_t
+pid_hash_slot(const struct job_table *t, pid_t pid)
+{
+    /* Fibonacci hashing - pids are sequential, spread them. */
+    return ((uint32_t)pid * 2654435769u) & (t->pid_hash_size - 1);
+}
+
+static void
+pid_hash_resize(struct job_table *t, uint32_t new_size)
+{
+    struct process **old = t->pid_hash;
+    uint32_t old_size = t->pid_hash_size;
+    t->pid_hash = calloc(new_size, sizeof(*t->pid_hash));
+    t->pid_hash_size = new_size;
+    for (uint32_t i = 0; i < old_size; ++i) {
+        struct process *p = old[i];
+        while (p != NULL) {
+            struct process *next = p->hash_next;
+            uint32_t slot = pid_hash_slot(t, p->pid);
+            p->hash_next = t->pid_hash[slot];
+            t->pid_hash[slot] = p;
+            p = next;
+        }
+    }
+    free(old);
+}
+
+static void
+pid_hash_insert(struct job_table *t, struct process *p)
+{
+    if (t->pid_count >= t->pid_hash_size)
+        pid_hash_resize(t, t->pid_hash_size * 2);
+    uint32_t slot = pid_hash_slot(t, p->pid);
+    p->hash_next = t->pid_hash[slot];
+    t->pid_hash[slot] = p;
+    ++t->pid_count;
+}
+
+static void
+pid_hash_remove(struct job_table *t, struct process *p)
+{
+    struct process **pos = &t->pid_hash[pid_hash_slot(t, p->pid)];
+    while (*pos != p) {
+        assert(*pos != NULL);
+        pos = &(*pos)->hash_next;
+    }
+    *pos = p->hash_next;
+    --t->pid_count;
+}
+
+void
+job_table_create(struct job_table *t)
+{
+    t->jobs = NULL;
+    t->capacity = 0;
+    t->count = 0;
+    t->pid_hash = calloc(PID_HASH_MIN_SIZE, sizeof(*t->pid_hash));
+    t->pid_hash_size = PID_HASH_MIN_SIZE;
+    t->pid_count = 0;
+}
+
+void
+job_table_destroy(struct job_table *t)
+{
+    for (int i = 0; i < t->capacity; ++i) {
+        if (t->jobs[i] != NULL)
+            job_delete(t, t->jobs[i]);
+    }
+    free(t->jobs);
+    free(t->pid_hash);
+}
+
+struct job *
+job_new(struct job_table *t, struct command_line *line, bool is_background)
+{
+    int slot = 0;
+    while (slot < t->capacity && t->jobs[slot] != NULL)
+        ++slot;
+    if (slot == t->capacity) {
+        int new_capacity = (t->capacity + 1) * 2;
+        t->jobs = realloc(t->jobs, new_capacity * sizeof(*t->jobs));
+        for (int i = t->capacity; i < new_capacity; ++i)
+            t->jobs[i] = NULL;
+        t->capacity = new_capacity;
+    }
+    struct job *j = calloc(1, sizeof(*j));
+    j->id = slot + 1;
+    j->line = line;
+    j->next_expr = line->head;
+    j->is_background = is_background;
+    j->out_fd = -1;
+    t->jobs[slot] = j;
+    ++t->count;
+    return j;
+}
+
+static void
+job_clear_processes(struct job_table *t, struct job *j)
+{
+    for (int i = 0; i < j->proc_count; ++i) {
+        if (j->procs[i]->pid > 0)
+            pid_hash_remove(t, j->procs[i]);
+        if (j->procs[i]->spliced_bytes != NULL)
+            munmap(j->procs[i]->spliced_bytes, sizeof(int64_t));
+        free(j->procs[i]);
+    }
+    j->proc_count = 0;
+    j->running_count = 0;
+    j->stopped_count = 0;
+}
+
+void
+job_delete(struct job_table *t, struct job *j)
+{
+    job_clear_processes(t, j);
+    free(j->procs);
+    free(j->stats);
+    command_line_delete(j->line);
+    t->jobs[j->id - 1] = NULL;
+    --t->count;
+    free(j);
+}
+
+static struct process *
+job_append_process(struct job *j, pid_t pid)
+{
+    if (j->proc_count == j->proc_capacity) {
+        j->proc_capacity = (j->proc_capacity + 1) * 2;
+        j->procs = realloc(j->procs, j->proc_capacity * sizeof(*j->procs));
+    }
+    struct process *p = calloc(1, sizeof(*p));
+    p->pid = pid;
+    p->job = j;
+    j->procs[j->proc_count++] = p;
+    return p;
+}
+
+struct process *
+job_add_process(struct job_table *t, struct job *j, pid_t pid)
+{
+    struct process *p = job_append_process(j, pid);
+    ++j->running_count;
+    pid_hash_insert(t, p);
+    return p;
+}
+
+struct process *
+job_add_finished_process(struct job *j, int exit_status)
+{
+    struct process *p = job_append_process(j, -1);
+    p->is_done = true;
+    p->wstatus = W_EXITCODE(exit_status, 0);
+    return p;
+}
+
+void
+job_add_stat(struct job *j, const struct stage_stat *stat)
+{
+    if (j->stat_count == j->stat_capacity) {
+        j->stat_capacity = (j->stat_capacity + 1) * 2;
+        j->stats = realloc(j->stats, j->stat_capacity * sizeof(*j->stats));
+    }
+    j->stats[j->stat_count++] = *stat;
+}
+
+void
+job_finish_pipeline(struct job_table *t, struct job *j)
+{
+    assert(j->running_count == 0 && j->stopped_count == 0);
+    if (j->proc_count > 0)
+        j->status = wstatus_to_exit_status(j->procs[j->proc_count - 1]->wstatus);
+    if (j->is_traced) {
+        for (int i = 0; i < j->proc_count; ++i) {
+            struct process *p = j->procs[i];
+            p->stat.status = wstatus_to_exit_status(p->wstatus);
+            job_add_stat(j, &p->stat);
+        }
+    }
+    job_clear_processes(t, j);
+}
+
+struct job *
+job_table_find(const struct job_table *t, int id)
+{
+    if (id <= 0 || id > t->capacity)
+        return NULL;
+    return t->jobs[id - 1];
+}
+
+struct process *
+job_table_find_pid(const struct job_table *t, pid_t pid)
+{
+    struct process *p = t->pid_hash[pid_hash_slot(t, pid)];
+    while (p != NULL && p->pid != pid)
+        p = p->hash_next;
+    return p;
+}
+
+struct job *
+job_table_update(struct job_table *t, pid_t pid, int wstatus)
+{
+    struct process *p = job_table_find_pid(t, pid);
+    if (p == NULL)
+        return NULL;
+    struct job *j = p->job;
+    if (WIFSTOPPED(wstatus)) {
+        if (!p->is_stopped) {
+            p->is_stopped = true;
+            --j->running_count;
+            ++j->stopped_count;
+        }
+    } else if (WIFCONTINUED(wstatus)) {
+        if (p->is_stopped) {
+            p->is_stopped = false;
+            --j->stopped_count;
+            ++j->running_count;
+        }
+    } else {
+        if (p->is_stopped) {
+            --j->stopped_count;
+            ++j->running_count;
+        }
+        p->is_stopped = false;
+        p->is_done = true;
+        p->wstatus = wstatus;
+        --j->running_count;
+    }
+    return j;
+}
+
+void
+job_mark_continued(struct job *j)
+{
+    for (int i = 0; i < j->proc_count; ++i) {
+        struct process *p = j->procs[i];
+        if (p->is_stopped) {
+            p->is_stopped = false;
+            --j->stopped_count;
+            ++j->running_count;
+        }
+    }
+}
+
+int
+wstatus_to_exit_status(int wstatus)
+{
+    if (WIFSIGNALED(wstatus))
+        return 128 + WTERMSIG(wstatus);
+    return WEXITSTATUS(wstatus);
+}
+
+void
+job_print_command(const struct job *j, FILE *out)
+{
+    const struct command_line *line = j->line;
+    for (const struct expr *e = line->head; e != NULL; e = e->next) {
+        switch (e->type) {
+        case EXPR_TYPE_COMMAND:
+            fprintf(out, "%s", e->cmd.exe);
+            for (uint32_t i = 0; i < e->cmd.arg_count; ++i)
+                fprintf(out, " %s", e->cmd.args[i]);
+            break;
+        case EXPR_TYPE_PIPE:
+            fprintf(out, " | ");
+            break;
+        case EXPR_TYPE_AND:
+            fprintf(out, " && ");
+            break;
+        case EXPR_TYPE_OR:
+            fprintf(out, " || ");
+            break;
+        }
+    }
+    if (line->out_type == OUTPUT_TYPE_FILE_NEW)
+        fprintf(out, " > %s", line->out_file);
+    else if (line->out_type == OUTPUT_TYPE_FILE_APPEND)
+        fprintf(out, " >> %s", line->out_file);
+    if (line->is_background)
+        fprintf(out, " &");
+}
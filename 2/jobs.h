@@ -0,0 +1,185 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+struct command_line;
+struct expr;
+struct job;
+
+/**
+ * Resources used by one pipeline stage. Collected for the lines
+ * under `time` or in the trace mode.
+ */
+struct stage_stat {
+    /** argv[0], points into the job line. */
+    const char *name;
+    /** 0 for a builtin run in the shell process. */
+    pid_t pid;
+    int status;
+    /** posix_spawn() duration: fork + exec as seen by the shell. */
+    double spawn_sec;
+    /** From the launch until the shell reaped the stage. */
+    double wall_sec;
+    double user_sec;
+    double sys_sec;
+    long max_rss_kb;
+    /** Bytes written by the stage, into its pipe too. -1 if unknown. */
+    int64_t write_bytes;
+    /**
+     * write_bytes has splice() and the like too. Only for builtins,
+     * an external stage has just its write()s counted.
+     */
+    bool is_splice_counted;
+};
+
+struct process {
+    pid_t pid;
+    /** Raw status from waitpid(). Valid when is_done. */
+    int wstatus;
+    bool is_done;
+    bool is_stopped;
+    struct job *job;
+    /** Link in the pid hash of the job table. */
+    struct process *hash_next;
+    /** Filled only when the job is traced. */
+    struct stage_stat stat;
+    /** When the launch started, for stat.wall_sec. */
+    double start_sec;
+    /**
+     * A shared page where a traced forked builtin stores its
+     * builtin_spliced_bytes(), NULL for the other stages.
+     */
+    int64_t *spliced_bytes;
+};
+
+/**
+ * A job is one command line. Its pipelines are launched one by one
+ * right from the shell event loop, the && and || operators are
+ * evaluated when the previous pipeline finishes. So a background
+ * line needs no supervising copy of the shell.
+ */
+struct job {
+    /** Number shown by `jobs` and accepted as %N. */
+    int id;
+    /** Process group of the job, when job control is enabled. */
+    pid_t pgid;
+    /** The job owns the line. */
+    struct command_line *line;
+    /**
+     * The first expression not launched yet. NULL when the whole
+     * line is launched.
+     */
+    const struct expr *next_expr;
+    /** Processes of the pipeline being executed now. */
+    struct process **procs;
+    int proc_count;
+    int proc_capacity;
+    /** How many of procs are neither finished nor stopped. */
+    int running_count;
+    /** How many of procs are stopped. */
+    int stopped_count;
+    /** Exit status of the last finished pipeline. */
+    int status;
+    bool is_background;
+    bool is_done;
+    /**
+     * Started by `parallel`. It waits for the job and deletes it,
+     * the job is not reachable by fg, bg and wait.
+     */
+    bool is_parallel_task;
+    /** Stdout of the line instead of the shell's one. -1 if not set. */
+    int out_fd;
+    /** Collect stage stats and print them when the line is done. */
+    bool is_traced;
+    /** Print the stats as JSON, not as a table. */
+    bool is_trace_json;
+    double start_sec;
+    /** Stats of the finished stages of all the pipelines. */
+    struct stage_stat *stats;
+    int stat_count;
+    int stat_capacity;
+};
+
+struct job_table {
+    /** Job with ID N is jobs[N - 1]. Free slots are NULL. */
+    struct job **jobs;
+    int capacity;
+    int count;
+    /** Chained hash pid -> process, size is a power of 2. */
+    struct process **pid_hash;
+    uint32_t pid_hash_size;
+    uint32_t pid_count;
+};
+
+void
+job_table_create(struct job_table *t);
+
+/** Delete all the jobs. Their processes are not touched. */
+void
+job_table_destroy(struct job_table *t);
+
+/** Register a new job with the lowest free ID. The line is stolen. */
+struct job *
+job_new(struct job_table *t, struct command_line *line, bool is_background);
+
+void
+job_delete(struct job_table *t, struct job *j);
+
+struct process *
+job_add_process(struct job_table *t, struct job *j, pid_t pid);
+
+/**
+ * Add a pipeline stage which failed to start, with the given exit
+ * status. It has no pid and is finished from the beginning.
+ */
+struct process *
+job_add_finished_process(struct job *j, int exit_status);
+
+/** Save the stats of a stage. Done for all processes of traced jobs. */
+void
+job_add_stat(struct job *j, const struct stage_stat *stat);
+
+/**
+ * Forget the processes of the finished pipeline and remember its
+ * status - the one of the last process, like in bash. Their stats
+ * are saved if the job is traced.
+ */
+void
+job_finish_pipeline(struct job_table *t, struct job *j);
+
+struct job *
+job_table_find(const struct job_table *t, int id);
+
+struct process *
+job_table_find_pid(const struct job_table *t, pid_t pid);
+
+/**
+ * Apply a status returned by waitpid() to the owner process.
+ * Returns its job or NULL if the pid is unknown.
+ */
+struct job *
+job_table_update(struct job_table *t, pid_t pid, int wstatus);
+
+static inline bool
+job_is_stopped(const struct job *j)
+{
+    return j->running_count == 0 && j->stopped_count > 0;
+}
+
+/**
+ * Forget that the job processes are stopped. Called when SIGCONT
+ * is sent, not to wait for the WIFCONTINUED notifications.
+ */
+void
+job_mark_continued(struct job *j);
+
+/** Convert a raw waitpid() status into a shell exit status. */
+int
+wstatus_to_exit_status(int wstatus);
+
+/** Print the command line of the job like it would be typed. */
+void
+job_print_command(const struct job *j, FILE *out);
@@ -0,0 +1,28 @@
+# Tests of the parallel builtin. -j1 keeps the output order fixed.
+from shell_test import check, finish
+
+check('a task per input with a template',
+      "parallel -j1 echo ::: a b c\n",
+      'a\nb\nc\n')
+check('-jN as one word',
+      "parallel -j1 echo {}-x ::: a b\n",
+      'a-x\nb-x\n')
+check('a newline in an input stays in the argument',
+      "parallel -j 1 echo ::: 'a\nb' c\n",
+      'a\nb\nc\n')
+check('a command line input must be one line',
+      "parallel -j1 ::: 'echo x\necho y' 'echo z'\n",
+      'parallel: bad command line: echo x\necho y\nz\n')
+check('an open quote is not glued to the next input',
+      "parallel -j1 ::: 'echo \"q' 'echo w'\n",
+      'parallel: bad command line: echo "q\nw\n')
+check('inputs from a file',
+      "printf 'a\\n\\nb\\n' > in.txt\nparallel -j1 -a in.txt echo\n",
+      'a\nb\n')
+check('grouped output',
+      "parallel -j2 -g echo ::: a\n",
+      'a\n')
+check('background parallel is refused',
+      "parallel -j1 echo ::: a &\necho next\n",
+      "parallel: can't run in the background\nnext\n")
+finish()
@@ -2,14 +2,12 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
-
-struct parser {
-	char *buffer;
-	uint32_t size;
-	uint32_t capacity;
-};
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 enum token_type {
 	TOKEN_TYPE_NONE,
@@ -30,12 +28,123 @@ struct token {
 	uint32_t capacity;
 };
 
+struct parser {
+	char *buffer;
+	/** Start of the not parsed data. */
+	uint32_t offset;
+	/** End of the data. */
+	uint32_t size;
+	uint32_t capacity;
+	/** Reused by all the lines, only its data is copied out. */
+	struct token token;
+};
+
+enum {
+	LINE_BLOCK_SIZE = 1024,
+};
+
+struct line_block {
+	struct line_block *next;
+	char data[];
+};
+
+/**
+ * Bump allocator of one command line. The line itself, its exprs,
+ * args arrays and strings are all cut from the same blocks, so a
+ * usual line costs one malloc() and one free().
+ */
+struct line_arena {
+	/** The newest block first. The last one holds this arena. */
+	struct line_block *block;
+	char *pos;
+	char *end;
+	size_t next_block_size;
+};
+
+/** The first thing in the first block of a line. */
+struct line_with_arena {
+	struct line_arena arena;
+	struct command_line line;
+};
+
+static inline size_t
+line_align(size_t size)
+{
+	return (size + 7) & ~(size_t)7;
+}
+
+static void *
+line_alloc(struct line_arena *a, size_t size)
+{
+	size = line_align(size);
+	if ((size_t)(a->end - a->pos) < size) {
+		size_t block_size = a->next_block_size;
+		while (block_size - sizeof(struct line_block) < size)
+			block_size *= 2;
+		a->next_block_size = block_size * 2;
+		struct line_block *b = malloc(block_size);
+		b->next = a->block;
+		a->block = b;
+		a->pos = b->data;
+		a->end = (char *)b + block_size;
+	}
+	void *res = a->pos;
+	a->pos += size;
+	return res;
+}
+
+/** Grow the last allocation in place if possible. */
+static void *
+line_realloc(struct line_arena *a, void *ptr, size_t old_size, size_t new_size)
+{
+	if (ptr != NULL && (char *)ptr + line_align(old_size) == a->pos &&
+	    (size_t)(a->end - (char *)ptr) >= new_size) {
+		a->pos = (char *)ptr + line_align(new_size);
+		return ptr;
+	}
+	void *res = line_alloc(a, new_size);
+	if (old_size > 0)
+		memcpy(res, ptr, old_size);
+	return res;
+}
+
+static struct line_arena *
+command_line_arena(struct command_line *line)
+{
+	return (struct line_arena *)((char *)line -
+		offsetof(struct line_with_arena, line));
+}
+
+static struct command_line *
+command_line_new(void)
+{
+	struct line_block *b = malloc(LINE_BLOCK_SIZE);
+	b->next = NULL;
+	struct line_with_arena *lwa = (struct line_with_arena *)b->data;
+	memset(lwa, 0, sizeof(*lwa));
+	struct line_arena *a = &lwa->arena;
+	a->block = b;
+	a->pos = b->data + line_align(sizeof(*lwa));
+	a->end = (char *)b + LINE_BLOCK_SIZE;
+	a->next_block_size = LINE_BLOCK_SIZE * 2;
+	return &lwa->line;
+}
+
+static struct expr *
+command_line_new_expr(struct command_line *line, enum expr_type type)
+{
+	struct expr *e = line_alloc(command_line_arena(line), sizeof(*e));
+	memset(e, 0, sizeof(*e));
+	e->type = type;
+	return e;
+}
+
 static char *
-token_strdup(const struct token *t)
+token_strdup(struct command_line *line, const struct token *t)
 {
+	/* Can be empty, like "". */
 	assert(t->type == TOKEN_TYPE_STR);
-	assert(t->size > 0);
-	char *res = malloc(t->size + 1);
+	char *res = line_alloc(command_line_arena(line), t->size + 1);
 	memcpy(res, t->data, t->size);
 	res[t->size] = 0;
 	return res;
@@ -53,6 +162,20 @@ token_append(struct token *t, char c)
 	t->data[t->size++] = c;
 }
 
+static void
+token_append_n(struct token *t, const char *data, uint32_t len)
+{
+	if (t->capacity - t->size < len) {
+		uint32_t new_capacity = (t->capacity + 1) * 2;
+		if (new_capacity - t->size < len)
+			new_capacity = t->size + len;
+		t->data = realloc(t->data, sizeof(*t->data) * new_capacity);
+		t->capacity = new_capacity;
+	}
+	memcpy(t->data + t->size, data, len);
+	t->size += len;
+}
+
 static void
 token_reset(struct token *t)
 {
@@ -61,11 +184,14 @@ token_reset(struct token *t)
 }
 
 static void
-command_append_arg(struct command *cmd, char *arg)
+command_append_arg(struct command_line *line, struct command *cmd, char *arg)
 {
 	if (cmd->arg_count == cmd->arg_capacity) {
-		cmd->arg_capacity = (cmd->arg_capacity + 1) * 2;
-		cmd->args = realloc(cmd->args, sizeof(*cmd->args) * cmd->arg_capacity);
+		uint32_t new_capacity = (cmd->arg_capacity + 1) * 2;
+		cmd->args = line_realloc(command_line_arena(line), cmd->args,
+			sizeof(*cmd->args) * cmd->arg_capacity,
+			sizeof(*cmd->args) * new_capacity);
+		cmd->arg_capacity = new_capacity;
 	} else {
 		assert(cmd->arg_count < cmd->arg_capacity);
 	}
@@ -75,20 +201,12 @@ command_append_arg(struct command *cmd, char *arg)
 void
 command_line_delete(struct command_line *line)
 {
-	while (line->head != NULL) {
-		struct expr *e = line->head;
-		if (e->type == EXPR_TYPE_COMMAND) {
-			struct command *cmd = &e->cmd;
-			free(cmd->exe);
-			for (uint32_t i = 0; i < cmd->arg_count; ++i)
-				free(cmd->args[i]);
-			free(cmd->args);
-		}
-		line->head = e->next;
-		free(e);
+	struct line_block *b = command_line_arena(line)->block;
+	while (b != NULL) {
+		struct line_block *next = b->next;
+		free(b);
+		b = next;
 	}
-	free(line->out_file);
-	free(line);
 }
 
 static void
@@ -111,6 +229,16 @@ void
 parser_feed(struct parser *p, const char *str, uint32_t len)
 {
 	uint32_t cap = p->capacity - p->size;
+	if (cap < len && p->offset > 0) {
+		/*
+		 * Compact only when out of space. Then only the tail of the
+		 * data is moved, not the whole buffer after each line.
+		 */
+		p->size -= p->offset;
+		memmove(p->buffer, p->buffer + p->offset, p->size);
+		p->offset = 0;
+		cap = p->capacity - p->size;
+	}
 	if (cap < len) {
 		uint32_t new_capacity = (p->capacity + 1) * 2;
 		if (new_capacity - p->size < len)
@@ -126,13 +254,94 @@ parser_feed(struct parser *p, const char *str, uint32_t len)
 static void
 parser_consume(struct parser *p, uint32_t size)
 {
-	assert(p->size >= size);
-	if (size == p->size) {
+	assert(p->size - p->offset >= size);
+	p->offset += size;
+	if (p->offset == p->size) {
+		p->offset = 0;
 		p->size = 0;
-		return;
 	}
-	memmove(p->buffer, p->buffer + size, p->size - size);
-	p->size -= size;
+}
+
+enum {
+	/** The byte ends a plain run outside of quotes. */
+	SPECIAL_UNQUOTED = 1,
+	SPECIAL_SINGLE_QUOTED = 2,
+	SPECIAL_DOUBLE_QUOTED = 4,
+};
+
+static const uint8_t special_bytes[256] = {
+	['\t'] = SPECIAL_UNQUOTED,
+	['\n'] = SPECIAL_UNQUOTED,
+	['\r'] = SPECIAL_UNQUOTED,
+	[' '] = SPECIAL_UNQUOTED,
+	['#'] = SPECIAL_UNQUOTED,
+	['&'] = SPECIAL_UNQUOTED,
+	['>'] = SPECIAL_UNQUOTED,
+	['|'] = SPECIAL_UNQUOTED,
+	['"'] = SPECIAL_UNQUOTED | SPECIAL_DOUBLE_QUOTED,
+	['\\'] = SPECIAL_UNQUOTED | SPECIAL_DOUBLE_QUOTED,
+	['\''] = SPECIAL_UNQUOTED | SPECIAL_SINGLE_QUOTED,
+};
+
+/**
+ * Length of the prefix of [pos, end) which the tokenizer would just
+ * append char by char, given the current quote.
+ */
+static uint32_t
+plain_run_len(const char *pos, const char *end, char quote)
+{
+	const char *begin = pos;
+	uint8_t bit = quote == 0 ? SPECIAL_UNQUOTED :
+		quote == '\'' ? SPECIAL_SINGLE_QUOTED : SPECIAL_DOUBLE_QUOTED;
+	/* Most of the tokens are short, try the first bytes one by one. */
+	const char *probe_end = end - pos > 16 ? pos + 16 : end;
+	while (pos < probe_end && (special_bytes[(uint8_t)*pos] & bit) == 0)
+		++pos;
+	if (pos < probe_end || pos == end)
+		return pos - begin;
+#if defined(__SSE2__)
+	const __m128i dquote = _mm_set1_epi8('"');
+	const __m128i squote = _mm_set1_epi8('\'');
+	const __m128i bslash = _mm_set1_epi8('\\');
+	const __m128i tab = _mm_set1_epi8('\t');
+	const __m128i nl = _mm_set1_epi8('\n');
+	const __m128i cr = _mm_set1_epi8('\r');
+	const __m128i space = _mm_set1_epi8(' ');
+	const __m128i hash = _mm_set1_epi8('#');
+	const __m128i amp = _mm_set1_epi8('&');
+	const __m128i gt = _mm_set1_epi8('>');
+	const __m128i bar = _mm_set1_epi8('|');
+	for (; end - pos >= 16; pos += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)pos);
+		__m128i m;
+		if (quote == '\'') {
+			m = _mm_cmpeq_epi8(v, squote);
+		} else {
+			m = _mm_or_si128(_mm_cmpeq_epi8(v, dquote),
+					 _mm_cmpeq_epi8(v, bslash));
+			if (quote == 0) {
+				__m128i ws = _mm_or_si128(
+					_mm_or_si128(_mm_cmpeq_epi8(v, tab),
+						     _mm_cmpeq_epi8(v, nl)),
+					_mm_or_si128(_mm_cmpeq_epi8(v, cr),
+						     _mm_cmpeq_epi8(v, space)));
+				__m128i ops = _mm_or_si128(
+					_mm_or_si128(_mm_cmpeq_epi8(v, hash),
+						     _mm_cmpeq_epi8(v, amp)),
+					_mm_or_si128(_mm_cmpeq_epi8(v, gt),
+						     _mm_cmpeq_epi8(v, bar)));
+				m = _mm_or_si128(m, _mm_or_si128(ws, ops));
+				m = _mm_or_si128(m, _mm_cmpeq_epi8(v, squote));
+			}
+		}
+		unsigned mask = _mm_movemask_epi8(m);
+		if (mask != 0)
+			return pos - begin + __builtin_ctz(mask);
+	}
+#endif
+	while (pos < end && (special_bytes[(uint8_t)*pos] & bit) == 0)
+		++pos;
+	return pos - begin;
 }
 
 static uint32_t
@@ -151,6 +360,14 @@ parse_token(const char *pos, const char *end, struct token *out)
 	}
 	char quote = 0;
 	while (pos < end) {
+		/* Plain runs are copied at once, the switch sees specials only. */
+		uint32_t run = plain_run_len(pos, end, quote);
+		if (run > 0) {
+			token_append_n(out, pos, run);
+			pos += run;
+			if (pos == end)
+				return 0;
+		}
 		char c = *pos;
 		switch(c) {
 		case '\'':
@@ -249,13 +466,21 @@ parse_token(const char *pos, const char *end, struct token *out)
 		case '\r':
 			if (quote != 0)
 				goto append_and_next;
-			assert(out->size > 0);
+			if (out->size == 0) {
+				/* Whitespace after a line continuation. */
+				++pos;
+				continue;
+			}
 			out->type = TOKEN_TYPE_STR;
 			return pos + 1 - begin;
 		case '\n':
 			if (quote != 0)
 				goto append_and_next;
-			assert(out->size > 0);
+			if (out->size == 0) {
+				/* An empty line after a line continuation. */
+				out->type = TOKEN_TYPE_NEW_LINE;
+				return pos + 1 - begin;
+			}
 			out->type = TOKEN_TYPE_STR;
 			return pos - begin;
 		case '#':
@@ -266,14 +491,11 @@ parse_token(const char *pos, const char *end, struct token *out)
 				return pos - begin;
 			}
 			++pos;
-			while (pos < end) {
-				if (*pos == '\n') {
-					out->type = TOKEN_TYPE_NEW_LINE;
-					return pos + 1 - begin;
-				}
-				++pos;
-			}
-			return 0;
+			pos = memchr(pos, '\n', end - pos);
+			if (pos == NULL)
+				return 0;
+			out->type = TOKEN_TYPE_NEW_LINE;
+			return pos + 1 - begin;
 		default:
 			goto append_and_next;
 		}
@@ -287,28 +509,31 @@ parse_token(const char *pos, const char *end, struct token *out)
 enum parser_error
 parser_pop_next(struct parser *p, struct command_line **out)
 {
-	struct command_line *line = calloc(1, sizeof(*line));
-	char *pos = p->buffer;
+	if (p->offset == p->size) {
+		*out = NULL;
+		return PARSER_ERR_NONE;
+	}
+	struct command_line *line = command_line_new();
+	char *pos = p->buffer + p->offset;
 	const char *begin = pos;
-	char *end = pos + p->size;
-	struct token token = {0};
+	char *end = p->buffer + p->size;
+	struct token *token = &p->token;
 	enum parser_error res = PARSER_ERR_NONE;
 
 	while (pos < end) {
-		uint32_t used = parse_token(pos, end, &token);
+		uint32_t used = parse_token(pos, end, token);
 		if (used == 0)
 			goto return_no_line;
 		pos += used;
 		struct expr *e;
-		switch(token.type) {
+		switch(token->type) {
 		case TOKEN_TYPE_STR:
 			if (line->tail != NULL && line->tail->type == EXPR_TYPE_COMMAND) {
-				command_append_arg(&line->tail->cmd, token_strdup(&token));
+				command_append_arg(line, &line->tail->cmd, token_strdup(line, token));
 				continue;
 			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_COMMAND;
-			e->cmd.exe = token_strdup(&token);
+			e = command_line_new_expr(line, EXPR_TYPE_COMMAND);
+			e->cmd.exe = token_strdup(line, token);
 			command_line_append(line, e);
 			continue;
 		case TOKEN_TYPE_NEW_LINE:
@@ -325,8 +550,7 @@ parser_pop_next(struct parser *p, struct command_line **out)
 				res = PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND;
 				goto return_error;
 			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_PIPE;
+			e = command_line_new_expr(line, EXPR_TYPE_PIPE);
 			command_line_append(line, e);
 			continue;
 		case TOKEN_TYPE_AND:
@@ -338,8 +562,7 @@ parser_pop_next(struct parser *p, struct command_line **out)
 				res = PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND;
 				goto return_error;
 			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_AND;
+			e = command_line_new_expr(line, EXPR_TYPE_AND);
 			command_line_append(line, e);
 			continue;
 		case TOKEN_TYPE_OR:
@@ -351,8 +574,7 @@ parser_pop_next(struct parser *p, struct command_line **out)
 				res = PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND;
 				goto return_error;
 			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_OR;
+			e = command_line_new_expr(line, EXPR_TYPE_OR);
 			command_line_append(line, e);
 			continue;
 		case TOKEN_TYPE_OUT_NEW:
@@ -366,34 +588,39 @@ parser_pop_next(struct parser *p, struct command_line **out)
 	goto return_no_line;
 
 close_and_return:
-	if (token.type == TOKEN_TYPE_OUT_NEW || token.type == TOKEN_TYPE_OUT_APPEND)
+	if (line->tail == NULL) {
+		/* "> file" or "&" with no command before. */
+		res = PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
+		goto return_error;
+	}
+	if (token->type == TOKEN_TYPE_OUT_NEW || token->type == TOKEN_TYPE_OUT_APPEND)
 	{
-		if (token.type == TOKEN_TYPE_OUT_NEW)
+		if (token->type == TOKEN_TYPE_OUT_NEW)
 			line->out_type = OUTPUT_TYPE_FILE_NEW;
 		else
 			line->out_type = OUTPUT_TYPE_FILE_APPEND;
-		uint32_t used = parse_token(pos, end, &token);
+		uint32_t used = parse_token(pos, end, token);
 		if (used == 0)
 			goto return_no_line;
 		pos += used;
-		if (token.type != TOKEN_TYPE_STR) {
+		if (token->type != TOKEN_TYPE_STR) {
 			res = PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
 			goto return_error;
 		}
-		line->out_file = token_strdup(&token);
-		used = parse_token(pos, end, &token);
+		line->out_file = token_strdup(line, token);
+		used = parse_token(pos, end, token);
 		if (used == 0)
 			goto return_no_line;
 		pos += used;
 	}
-	if (token.type == TOKEN_TYPE_BACKGROUND) {
+	if (token->type == TOKEN_TYPE_BACKGROUND) {
 		line->is_background = true;
-		uint32_t used = parse_token(pos, end, &token);
+		uint32_t used = parse_token(pos, end, token);
 		if (used == 0)
 			goto return_no_line;
 		pos += used;
 	}
-	if (token.type == TOKEN_TYPE_NEW_LINE) {
+	if (token->type == TOKEN_TYPE_NEW_LINE) {
 		assert(line->tail != NULL);
 		parser_consume(p, pos - begin);
 		if (line->tail->type != EXPR_TYPE_COMMAND) {
@@ -413,11 +640,11 @@ return_error:
 	 * just crash here because of that.
 	 */
 	while (pos < end) {
-		uint32_t used = parse_token(pos, end, &token);
+		uint32_t used = parse_token(pos, end, token);
 		if (used == 0)
 			break;
 		pos += used;
-		if (token.type == TOKEN_TYPE_NEW_LINE) {
+		if (token->type == TOKEN_TYPE_NEW_LINE) {
 			parser_consume(p, pos - begin);
 			goto return_no_line;
 		}
@@ -430,7 +657,6 @@ return_no_line:
 	*out = NULL;
 
 return_final:
-	free(token.data);
 	return res;
 }
 
@@ -438,5 +664,6 @@ void
 parser_delete(struct parser *p)
 {
 	free(p->buffer);
+	free(p->token.data);
 	free(p);
 }
@@ -0,0 +1,177 @@
+#include "parser.h"
+#include "parser_corpus.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Parser throughput on synthetic scripts. The script is fed in
+ * chunks of random size, so lines and tokens are split at random
+ * places like when reading a pipe. Built with -Wl,--wrap for the
+ * allocation functions to count allocations per line.
+ */
+
+struct alloc_stat {
+    uint64_t count;
+};
+
+/* The linker wrappers can't take a context, so the counter is a global. */
+static struct alloc_stat alloc_stat;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *
+__wrap_malloc(size_t size)
+{
+    ++alloc_stat.count;
+    return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t count, size_t size)
+{
+    ++alloc_stat.count;
+    return __real_calloc(count, size);
+}
+
+void *
+__wrap_realloc(void *ptr, size_t size)
+{
+    ++alloc_stat.count;
+    return __real_realloc(ptr, size);
+}
+
+static double
+now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t
+next_rand(uint64_t *state)
+{
+    /* xorshift64. */
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static void
+bench_one(enum corpus_kind kind, size_t size, size_t max_chunk, uint64_t seed)
+{
+    size_t len;
+    char *script = corpus_generate(kind, size, seed, &len);
+    struct parser *p = parser_new();
+    uint64_t rand_state = seed | 1;
+    uint64_t lines = 0;
+    uint64_t errors = 0;
+
+    uint64_t allocs_start = alloc_stat.count;
+    double start = now_sec();
+    for (size_t pos = 0; pos < len;) {
+        size_t chunk = 1 + next_rand(&rand_state) % max_chunk;
+        if (chunk > len - pos)
+            chunk = len - pos;
+        parser_feed(p, script + pos, chunk);
+        pos += chunk;
+        while (true) {
+            struct command_line *line = NULL;
+            enum parser_error err = parser_pop_next(p, &line);
+            if (err != PARSER_ERR_NONE) {
+                ++errors;
+                continue;
+            }
+            if (line == NULL)
+                break;
+            ++lines;
+            command_line_delete(line);
+        }
+    }
+    double elapsed = now_sec() - start;
+    uint64_t allocs = alloc_stat.count - allocs_start;
+
+    printf("%10s %8.1f %10llu %8llu %10.1f %12.2f\n", corpus_kind_name(kind), len / 1e6,
+           (unsigned long long)lines, (unsigned long long)errors, len / elapsed / 1e6,
+           lines > 0 ? (double)allocs / lines : 0);
+    parser_delete(p);
+    free(script);
+}
+
+/** Write a small sample of every kind into @a dir - the fuzz seeds. */
+static int
+write_corpus(const char *dir, uint64_t seed)
+{
+    for (int kind = 0; kind < corpus_kind_MAX; ++kind) {
+        for (int i = 0; i < 4; ++i) {
+            char path[1024];
+            snprintf(path, sizeof(path), "%s/%s_%d", dir, corpus_kind_name(kind), i);
+            size_t len;
+            char *script = corpus_generate(kind, 256 << i, seed + i, &len);
+            FILE *f = fopen(path, "w");
+            if (f == NULL) {
+                perror(path);
+                free(script);
+                return EXIT_FAILURE;
+            }
+            fwrite(script, 1, len, f);
+            fclose(f);
+            free(script);
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t size = 32 << 20;
+    size_t max_chunk = 64 * 1024;
+    uint64_t seed = 42;
+    const char *kind_name = NULL;
+    const char *corpus_dir = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "m:c:k:s:d:")) != -1) {
+        switch (opt) {
+        case 'm':
+            size = (size_t)atol(optarg) << 20;
+            break;
+        case 'c':
+            max_chunk = atol(optarg);
+            break;
+        case 'k':
+            kind_name = optarg;
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'd':
+            corpus_dir = optarg;
+            break;
+        default:
+            printf("Usage: %s [-m <script MB>] [-c <max feed chunk>] [-k <kind>] [-s <seed>] "
+                   "[-d <corpus dir to fill>]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (max_chunk == 0)
+        max_chunk = 1;
+    if (corpus_dir != NULL)
+        return write_corpus(corpus_dir, seed);
+
+    printf("%10s %8s %10s %8s %10s %12s\n", "kind", "MB", "lines", "errors", "MB/s", "allocs/line");
+    for (int kind = 0; kind < corpus_kind_MAX; ++kind) {
+        if (kind_name != NULL && strcmp(kind_name, corpus_kind_name(kind)) != 0)
+            continue;
+        bench_one(kind, size, max_chunk, seed);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,201 @@
+#include "parser_corpus.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct corpus_gen {
+    uint64_t rand_state;
+    char *data;
+    size_t size;
+    size_t capacity;
+};
+
+static uint64_t
+gen_rand(struct corpus_gen *g)
+{
+    /* splitmix64. */
+    uint64_t z = (g->rand_state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+static uint32_t
+gen_range(struct corpus_gen *g, uint32_t min, uint32_t max)
+{
+    return min + gen_rand(g) % (max - min + 1);
+}
+
+static void
+gen_append(struct corpus_gen *g, const char *str)
+{
+    size_t len = strlen(str);
+    if (g->capacity - g->size < len) {
+        g->capacity = (g->capacity + len) * 2;
+        g->data = realloc(g->data, g->capacity);
+    }
+    memcpy(g->data + g->size, str, len);
+    g->size += len;
+}
+
+static const char *
+gen_pick(struct corpus_gen *g, const char *const *words, size_t count)
+{
+    return words[gen_rand(g) % count];
+}
+
+#define GEN_PICK(g, words) gen_pick(g, words, sizeof(words) / sizeof(words[0]))
+
+static const char *const commands[] = {
+    "cat", "grep", "sed", "awk", "sort", "uniq", "head", "tail", "wc",
+    "tr", "cut", "xargs", "echo", "printf", "/usr/bin/env", "ls",
+};
+
+static const char *const args[] = {
+    "-n", "-v", "-l", "-c", "-k2", "-F:", "--color=never", "'{print $1}'",
+    "s/a/b/g", "file.txt", "/tmp/some/long/path/to/a/file.log", "42",
+    "-rf", "--", "x", "README.md", "*.c",
+};
+
+static const char *const quoted[] = {
+    "\"double quoted string\"",
+    "'single quoted string'",
+    "\"escaped \\\"quotes\\\" inside\"",
+    "'a \"double\" in single'",
+    "\"a 'single' in double\"",
+    "\"backslash \\\\ in double\"",
+    "'backslash \\ in single'",
+    "escaped\\ space\\ outside",
+    "\"spaces   and\ttabs  inside\"",
+    "\"special | & > # chars\"",
+    "'| && || > >> & #'",
+    "\"multi\nline\nstring\"",
+    "\"joined \\\nline\"",
+    "glued\"quoted\"'parts'",
+    "\"\"",
+    "''",
+};
+
+static const char *const comments[] = {
+    "# a comment line",
+    "#!/bin/sh",
+    "    # indented comment with | & > chars",
+    "#",
+    "# quotes in comments don't open strings: ' \"",
+};
+
+static const char *const operators[] = {
+    " | ", " | ", " | ", " && ", " || ",
+};
+
+static void
+gen_command(struct corpus_gen *g, bool need_quotes)
+{
+    gen_append(g, GEN_PICK(g, commands));
+    uint32_t count = gen_range(g, 0, 4);
+    for (uint32_t i = 0; i < count; ++i) {
+        gen_append(g, " ");
+        if (need_quotes && gen_range(g, 0, 1) == 0)
+            gen_append(g, GEN_PICK(g, quoted));
+        else
+            gen_append(g, GEN_PICK(g, args));
+    }
+}
+
+static void
+gen_line_tail(struct corpus_gen *g)
+{
+    uint32_t r = gen_range(g, 0, 9);
+    if (r == 0)
+        gen_append(g, " > out.txt");
+    else if (r == 1)
+        gen_append(g, " >> out.log");
+    if (gen_range(g, 0, 19) == 0)
+        gen_append(g, " &");
+    gen_append(g, "\n");
+}
+
+static void
+gen_pipeline_line(struct corpus_gen *g)
+{
+    uint32_t count = gen_range(g, 3, 20);
+    for (uint32_t i = 0; i < count; ++i) {
+        if (i > 0)
+            gen_append(g, GEN_PICK(g, operators));
+        gen_command(g, false);
+    }
+    gen_line_tail(g);
+}
+
+static void
+gen_quoting_line(struct corpus_gen *g)
+{
+    uint32_t count = gen_range(g, 1, 3);
+    for (uint32_t i = 0; i < count; ++i) {
+        if (i > 0)
+            gen_append(g, GEN_PICK(g, operators));
+        gen_command(g, true);
+        if (gen_range(g, 0, 7) == 0)
+            gen_append(g, " \\\n   ");
+    }
+    gen_line_tail(g);
+}
+
+static void
+gen_comments_line(struct corpus_gen *g)
+{
+    uint32_t r = gen_range(g, 0, 3);
+    if (r == 0) {
+        gen_append(g, GEN_PICK(g, comments));
+        gen_append(g, "\n");
+    } else if (r == 1) {
+        gen_append(g, gen_range(g, 0, 1) == 0 ? "\n" : "   \t \n");
+    } else {
+        gen_command(g, false);
+        gen_append(g, " ");
+        gen_append(g, GEN_PICK(g, comments));
+        gen_append(g, "\n");
+    }
+}
+
+const char *
+corpus_kind_name(enum corpus_kind kind)
+{
+    switch (kind) {
+    case CORPUS_PIPELINES:
+        return "pipelines";
+    case CORPUS_QUOTING:
+        return "quoting";
+    case CORPUS_COMMENTS:
+        return "comments";
+    case CORPUS_MIXED:
+        return "mixed";
+    default:
+        return "unknown";
+    }
+}
+
+char *
+corpus_generate(enum corpus_kind kind, size_t size, uint64_t seed, size_t *out_len)
+{
+    struct corpus_gen g = {.rand_state = seed};
+    while (g.size < size) {
+        enum corpus_kind line_kind = kind;
+        if (kind == CORPUS_MIXED)
+            line_kind = gen_range(&g, 0, CORPUS_MIXED - 1);
+        switch (line_kind) {
+        case CORPUS_PIPELINES:
+            gen_pipeline_line(&g);
+            break;
+        case CORPUS_QUOTING:
+            gen_quoting_line(&g);
+            break;
+        default:
+            gen_comments_line(&g);
+            break;
+        }
+    }
+    *out_len = g.size;
+    return g.data;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Synthetic shell scripts for the parser benchmark. Their samples
+ * are also the seed corpus of the parser fuzz target.
+ */
+enum corpus_kind {
+    /** Long pipelines with && / || and redirects. */
+    CORPUS_PIPELINES,
+    /** Quotes, escapes, multiline strings, line continuations. */
+    CORPUS_QUOTING,
+    /** Comment lines, trailing comments, empty lines. */
+    CORPUS_COMMENTS,
+    /** All of the above line by line. */
+    CORPUS_MIXED,
+    corpus_kind_MAX,
+};
+
+const char *
+corpus_kind_name(enum corpus_kind kind);
+
+/**
+ * Generate whole lines of the given kind, about @a size bytes. The
+ * same seed gives the same script. Returns a malloc()'ed buffer.
+ */
+char *
+corpus_generate(enum corpus_kind kind, size_t size, uint64_t seed, size_t *out_len);
@@ -0,0 +1,173 @@
+#include "parser.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/*
+ * Fuzz target of the parser. The input is parsed twice: fed at once
+ * and fed in chunks which sizes come from the input itself. Both
+ * must give the same lines, and every line must be well-formed.
+ *
+ * Built with clang -fsanitize=fuzzer it is a libFuzzer target. With
+ * -DPARSER_FUZZ_STANDALONE it gets own main() which runs the given
+ * files and directories once, to replay a corpus or a crash.
+ */
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+struct dump {
+    char *data;
+    size_t size;
+    size_t capacity;
+};
+
+static void
+dump_append(struct dump *d, const void *data, size_t size)
+{
+    if (d->capacity - d->size < size) {
+        d->capacity = (d->capacity + size) * 2;
+        d->data = realloc(d->data, d->capacity);
+    }
+    memcpy(d->data + d->size, data, size);
+    d->size += size;
+}
+
+static void
+dump_str(struct dump *d, const char *str)
+{
+    /* With the terminating zero, so "a" "b" != "ab". */
+    dump_append(d, str, strlen(str) + 1);
+}
+
+static void
+check_and_dump_line(const struct command_line *line, struct dump *d)
+{
+    assert(line->head != NULL && line->tail != NULL);
+    assert(line->tail->next == NULL);
+    assert(line->tail->type == EXPR_TYPE_COMMAND);
+    assert((line->out_type == OUTPUT_TYPE_STDOUT) == (line->out_file == NULL));
+    bool need_command = true;
+    for (const struct expr *e = line->head; e != NULL; e = e->next) {
+        /* Commands and operators alternate. */
+        assert((e->type == EXPR_TYPE_COMMAND) == need_command);
+        need_command = !need_command;
+        dump_append(d, &e->type, sizeof(e->type));
+        if (e->type != EXPR_TYPE_COMMAND)
+            continue;
+        assert(e->cmd.arg_count <= e->cmd.arg_capacity);
+        dump_str(d, e->cmd.exe);
+        for (uint32_t i = 0; i < e->cmd.arg_count; ++i)
+            dump_str(d, e->cmd.args[i]);
+        dump_append(d, "\n", 1);
+    }
+    dump_append(d, &line->out_type, sizeof(line->out_type));
+    if (line->out_file != NULL)
+        dump_str(d, line->out_file);
+    dump_append(d, &line->is_background, sizeof(line->is_background));
+}
+
+static void
+parse_all(struct parser *p, struct dump *d)
+{
+    while (true) {
+        struct command_line *line = NULL;
+        enum parser_error err = parser_pop_next(p, &line);
+        if (err != PARSER_ERR_NONE) {
+            assert(line == NULL);
+            dump_append(d, &err, sizeof(err));
+            continue;
+        }
+        if (line == NULL)
+            return;
+        check_and_dump_line(line, d);
+        command_line_delete(line);
+    }
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    struct dump whole = {0};
+    struct parser *p = parser_new();
+    parser_feed(p, (const char *)data, size);
+    parse_all(p, &whole);
+    parser_delete(p);
+
+    struct dump split = {0};
+    p = parser_new();
+    uint32_t chunk_seed = size > 0 ? data[0] : 1;
+    for (size_t pos = 0; pos < size;) {
+        size_t chunk = 1 + chunk_seed % 17;
+        chunk_seed = chunk_seed * 1103515245 + 12345 + data[pos];
+        if (chunk > size - pos)
+            chunk = size - pos;
+        parser_feed(p, (const char *)data + pos, chunk);
+        pos += chunk;
+        parse_all(p, &split);
+    }
+    parser_delete(p);
+
+    assert(whole.size == split.size);
+    assert(whole.size == 0 || memcmp(whole.data, split.data, whole.size) == 0);
+    free(whole.data);
+    free(split.data);
+    return 0;
+}
+
+#ifdef PARSER_FUZZ_STANDALONE
+
+static void
+run_file(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    struct dump d = {0};
+    char buf[4096];
+    size_t rc;
+    while ((rc = fread(buf, 1, sizeof(buf), f)) > 0)
+        dump_append(&d, buf, rc);
+    fclose(f);
+    LLVMFuzzerTestOneInput((const uint8_t *)d.data, d.size);
+    free(d.data);
+}
+
+int
+main(int argc, char **argv)
+{
+    int count = 0;
+    for (int i = 1; i < argc; ++i) {
+        struct stat st;
+        if (stat(argv[i], &st) != 0) {
+            perror(argv[i]);
+            return EXIT_FAILURE;
+        }
+        if (!S_ISDIR(st.st_mode)) {
+            run_file(argv[i]);
+            ++count;
+            continue;
+        }
+        DIR *dir = opendir(argv[i]);
+        struct dirent *ent;
+        while ((ent = readdir(dir)) != NULL) {
+            if (ent->d_name[0] == '.')
+                continue;
+            char path[4096];
+            snprintf(path, sizeof(path), "%s/%s", argv[i], ent->d_name);
+            run_file(path);
+            ++count;
+        }
+        closedir(dir);
+    }
+    printf("%d inputs passed\n", count);
+    return EXIT_SUCCESS;
+}
+
+#endif
@@ -197,6 +197,18 @@ test_escape_in_string(void)
 	unit_check(e->next == NULL, "no more exprs");
 	command_line_delete(line);
 
+	unit_msg("Empty strings");
+	/* echo "" '' */
+	str = "echo \"\" ''\n";
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	e = line->head;
+	unit_check(strcmp(e->cmd.exe, "echo") == 0, "exe");
+	unit_check(e->cmd.arg_count == 2, "arg count");
+	unit_check(strcmp(e->cmd.args[0], "") == 0, "arg[0]");
+	unit_check(strcmp(e->cmd.args[1], "") == 0, "arg[1]");
+	command_line_delete(line);
+
 	parser_delete(p);
 	unit_test_finish();
 }
@@ -364,6 +376,25 @@ test_escape_outside_of_string(void)
 	unit_check(e->next == NULL, "no more exprs");
 	command_line_delete(line);
 
+	unit_msg("Whitespace after escaped new line");
+	/*
+	 * echo 123 \
+	 *     456 \
+	 *
+	 */
+	str = "echo 123 \\\n    456 \\\n\n";
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	e = line->head;
+	unit_check(strcmp(e->cmd.exe, "echo") == 0, "exe");
+	unit_check(e->cmd.arg_count == 2, "arg count");
+	unit_check(strcmp(e->cmd.args[0], "123") == 0, "arg[0]");
+	unit_check(strcmp(e->cmd.args[1], "456") == 0, "arg[1]");
+	unit_check(e->next == NULL, "no more exprs");
+	command_line_delete(line);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line == NULL, "no more lines");
+
 	parser_delete(p);
 	unit_test_finish();
 }
@@ -808,6 +839,9 @@ test_errors(void)
 	test_error_one(p, "exe |", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
 	test_error_one(p, "exe &&", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
 	test_error_one(p, "exe ||", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
+	test_error_one(p, "> test.txt", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
+	test_error_one(p, ">> test.txt &", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
+	test_error_one(p, " &", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
 
 	parser_feed(p, "echo\n", 5);
 	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse ok");
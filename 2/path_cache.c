@@ -0,0 +1,206 @@
+#define _GNU_SOURCE
+#include "path_cache.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+enum {
+    PATH_CACHE_MIN_SIZE = 32,
+};
+
+/** Used by execvp() too when PATH is not set. */
+static const char *default_path = "/bin:/usr/bin";
+
+static uint32_t
+name_hash(const char *name)
+{
+    /* FNV-1a. */
+    uint32_t h = 2166136261u;
+    for (; *name != 0; ++name)
+        h = (h ^ (uint8_t)*name) * 16777619u;
+    return h;
+}
+
+static struct path_entry **
+path_cache_find_pos(const struct path_cache *c, const char *name)
+{
+    struct path_entry **pos = &c->buckets[name_hash(name) & (c->size - 1)];
+    while (*pos != NULL && strcmp((*pos)->name, name) != 0)
+        pos = &(*pos)->next;
+    return pos;
+}
+
+static void
+path_cache_resize(struct path_cache *c, uint32_t new_size)
+{
+    struct path_entry **old = c->buckets;
+    uint32_t old_size = c->size;
+    c->buckets = calloc(new_size, sizeof(*c->buckets));
+    c->size = new_size;
+    for (uint32_t i = 0; i < old_size; ++i) {
+        struct path_entry *e = old[i];
+        while (e != NULL) {
+            struct path_entry *next = e->next;
+            uint32_t slot = name_hash(e->name) & (new_size - 1);
+            e->next = c->buckets[slot];
+            c->buckets[slot] = e;
+            e = next;
+        }
+    }
+    free(old);
+}
+
+static void
+path_entry_delete(struct path_entry *e)
+{
+    free(e->name);
+    free(e->path);
+    free(e);
+}
+
+void
+path_cache_create(struct path_cache *c)
+{
+    c->buckets = calloc(PATH_CACHE_MIN_SIZE, sizeof(*c->buckets));
+    c->size = PATH_CACHE_MIN_SIZE;
+    c->count = 0;
+    c->path_env = NULL;
+    c->hits = 0;
+    c->misses = 0;
+}
+
+void
+path_cache_destroy(struct path_cache *c)
+{
+    path_cache_clear(c);
+    free(c->buckets);
+    free(c->path_env);
+}
+
+void
+path_cache_clear(struct path_cache *c)
+{
+    for (uint32_t i = 0; i < c->size; ++i) {
+        struct path_entry *e = c->buckets[i];
+        while (e != NULL) {
+            struct path_entry *next = e->next;
+            path_entry_delete(e);
+            e = next;
+        }
+        c->buckets[i] = NULL;
+    }
+    c->count = 0;
+}
+
+void
+path_cache_forget(struct path_cache *c, const char *name)
+{
+    struct path_entry **pos = path_cache_find_pos(c, name);
+    struct path_entry *e = *pos;
+    if (e == NULL)
+        return;
+    *pos = e->next;
+    path_entry_delete(e);
+    --c->count;
+}
+
+/** Drop everything if PATH is not the one the entries came from. */
+static void
+path_cache_check_env(struct path_cache *c, const char *path_env)
+{
+    if (c->path_env == path_env)
+        return;
+    if (c->path_env != NULL && path_env != NULL && strcmp(c->path_env, path_env) == 0)
+        return;
+    path_cache_clear(c);
+    free(c->path_env);
+    c->path_env = path_env != NULL ? strdup(path_env) : NULL;
+}
+
+static bool
+is_executable_file(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0;
+}
+
+/** Walk PATH like execvp() does. Returns a new string or NULL. */
+static char *
+path_resolve(const char *path_env, const char *name)
+{
+    size_t name_len = strlen(name);
+    const char *dir = path_env;
+    while (true) {
+        const char *end = strchrnul(dir, ':');
+        size_t dir_len = end - dir;
+        /* An empty element means the current directory. */
+        char *path = malloc(dir_len + name_len + 3);
+        if (dir_len == 0) {
+            memcpy(path, "./", 2);
+            dir_len = 2;
+        } else {
+            memcpy(path, dir, dir_len);
+            path[dir_len++] = '/';
+        }
+        memcpy(path + dir_len, name, name_len + 1);
+        if (is_executable_file(path))
+            return path;
+        free(path);
+        if (*end == 0)
+            return NULL;
+        dir = end + 1;
+    }
+}
+
+const char *
+path_cache_lookup(struct path_cache *c, const char *name)
+{
+    if (strchr(name, '/') != NULL)
+        return name;
+    if (name[0] == 0)
+        return NULL;
+    const char *path_env = getenv("PATH");
+    path_cache_check_env(c, path_env);
+    struct path_entry **pos = path_cache_find_pos(c, name);
+    if (*pos != NULL) {
+        ++c->hits;
+        ++(*pos)->hits;
+        return (*pos)->path;
+    }
+    ++c->misses;
+    char *path = path_resolve(path_env != NULL ? path_env : default_path, name);
+    if (path == NULL)
+        return NULL;
+    if (c->count >= c->size) {
+        path_cache_resize(c, c->size * 2);
+        pos = path_cache_find_pos(c, name);
+    }
+    struct path_entry *e = malloc(sizeof(*e));
+    e->name = strdup(name);
+    e->path = path;
+    /* The lookup which added it is a miss, not a hit. */
+    e->hits = 0;
+    e->next = NULL;
+    *pos = e;
+    ++c->count;
+    return path;
+}
+
+void
+path_cache_print(const struct path_cache *c, FILE *out)
+{
+    if (c->count == 0) {
+        fprintf(out, "hash: hash table empty\n");
+    } else {
+        fprintf(out, "hits\tcommand\n");
+        for (uint32_t i = 0; i < c->size; ++i) {
+            for (const struct path_entry *e = c->buckets[i]; e != NULL; e = e->next)
+                fprintf(out, "%4llu\t%s\n", (unsigned long long)e->hits, e->path);
+        }
+    }
+    fprintf(out, "hash: %llu hits, %llu misses\n", (unsigned long long)c->hits,
+            (unsigned long long)c->misses);
+}
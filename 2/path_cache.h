@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+struct path_entry {
+    char *name;
+    char *path;
+    /**
+     * Lookups served by the entry, shown by `hash`. The per-entry
+     * hits add up to path_cache.hits.
+     */
+    uint64_t hits;
+    struct path_entry *next;
+};
+
+/**
+ * Command name -> absolute path, like the bash `hash` table. Without
+ * it every command walks PATH with failed execve()s or stat()s.
+ */
+struct path_cache {
+    /** Chained hash, size is a power of 2. */
+    struct path_entry **buckets;
+    uint32_t size;
+    uint32_t count;
+    /** PATH the entries were resolved with. NULL if unset. */
+    char *path_env;
+    /** Lookups found in the cache and lookups which walked PATH. */
+    uint64_t hits;
+    uint64_t misses;
+};
+
+void
+path_cache_create(struct path_cache *c);
+
+void
+path_cache_destroy(struct path_cache *c);
+
+/**
+ * Absolute path of the command. Names with a slash are returned as
+ * is and are not cached. If PATH changed since the last call, all
+ * the entries are dropped first. Returns NULL if the command is not
+ * found. The result is valid until the next call.
+ */
+const char *
+path_cache_lookup(struct path_cache *c, const char *name);
+
+/** Drop the entry, for example when its file is gone. */
+void
+path_cache_forget(struct path_cache *c, const char *name);
+
+/** Drop all the entries. The counters are kept. */
+void
+path_cache_clear(struct path_cache *c);
+
+/** Print the entries and the hit/miss counters. */
+void
+path_cache_print(const struct path_cache *c, FILE *out);
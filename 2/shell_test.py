@@ -0,0 +1,34 @@
+# Helpers for the tests of the shell's own extensions: parallel,
+# the builtins, the spawn path. checker.py checks only the bash
+# compatible part, these cases don't belong there.
+import os
+import subprocess
+import sys
+import tempfile
+
+shell = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'a.out')
+failed_count = 0
+
+
+def check(name, script, expected):
+	"""Feed the script to the shell in an empty directory and
+	compare its stdout and stderr with the expected text."""
+	global failed_count
+	with tempfile.TemporaryDirectory() as cwd:
+		p = subprocess.run([shell], input=script.encode(), cwd=cwd,
+				   stdout=subprocess.PIPE,
+				   stderr=subprocess.STDOUT, timeout=30)
+	output = p.stdout.decode('utf-8', errors='replace')
+	if output == expected:
+		print('ok - {}'.format(name))
+		return
+	failed_count += 1
+	print('not ok - {}'.format(name))
+	print('Expected:\n{}Got:\n{}'.format(expected, output))
+
+
+def finish():
+	if failed_count > 0:
+		print('{} tests failed'.format(failed_count))
+		sys.exit(1)
+	print('The tests passed')
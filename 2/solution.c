@@ -1,413 +1,1258 @@
+#define _GNU_SOURCE
 #include "parser.h"
+#include "builtins.h"
+#include "jobs.h"
+#include "path_cache.h"
+#include "trace.h"
 
 #include <assert.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
 #include <sys/wait.h>
 #include <fcntl.h>
 
-enum command_exit_type {
-    COMMAND_EXIT,
-    COMMAND_CONTINUE,
+struct shell {
+    struct parser *parser;
+    struct job_table jobs;
+    struct path_cache paths;
+    /** Watches the SIGCHLD signalfd and stdin. */
+    int epoll_fd;
+    int signal_fd;
+    /** False when stdin is a regular file, epoll can't wait on it. */
+    bool is_stdin_pollable;
+    /** Interactive mode: each job gets own process group and the terminal. */
+    bool is_job_control;
+    pid_t pgid;
+    /** Signal mask to restore in children. */
+    sigset_t child_sigmask;
+    /** SHELL_TRACE is set: every line is traced like under `time`. */
+    bool is_trace_all;
+    /** SHELL_TRACE=json. Also the format of `time` output. */
+    bool is_trace_json;
+    /**
+     * SHELL_PIPE_SIZE: capacity of the pipeline pipes, 0 is the
+     * kernel default of 64KB. Bigger pipes mean fewer context
+     * switches between the stages of a data-moving pipeline.
+     */
+    int pipe_size;
+    /** Status of the last finished foreground pipeline, $? in bash. */
+    int last_status;
+    bool should_exit;
+    int exit_status;
 };
 
-struct execute_cmd_result {
-    enum command_exit_type type;
-    // if type == COMMAND_CONTINUE:
-    int status;
-};
+/** "65536", "256K", "1M". 0 for a missing or a bad value. */
+static int
+parse_size(const char *str)
+{
+    if (str == NULL) {
+        return 0;
+    }
+    char *end;
+    errno = 0;
+    long size = strtol(str, &end, 10);
+    if (errno == ERANGE || end == str || size <= 0) {
+        return 0;
+    }
+    int shift = 0;
+    if (*end == 'k' || *end == 'K') {
+        shift = 10;
+        ++end;
+    } else if (*end == 'm' || *end == 'M') {
+        shift = 20;
+        ++end;
+    }
+    /* Check before the shift, a signed overflow is undefined. */
+    if (*end != 0 || size > (INT_MAX >> shift)) {
+        return 0;
+    }
+    return size << shift;
+}
 
-struct pid_queue {
-    pid_t *data;
-    size_t size;
-    size_t capacity;
-};
+static void
+shell_create(struct shell *sh)
+{
+    memset(sh, 0, sizeof(*sh));
+    sh->parser = parser_new();
+    job_table_create(&sh->jobs);
+    path_cache_create(&sh->paths);
+    const char *trace = getenv("SHELL_TRACE");
+    sh->is_trace_all = trace != NULL && trace[0] != 0 && strcmp(trace, "0") != 0;
+    sh->is_trace_json = trace != NULL && strcmp(trace, "json") == 0;
+    sh->pipe_size = parse_size(getenv("SHELL_PIPE_SIZE"));
+
+    sh->is_job_control = isatty(STDIN_FILENO);
+    if (sh->is_job_control) {
+        /* Wait until the shell is in the foreground. */
+        while (tcgetpgrp(STDIN_FILENO) != (sh->pgid = getpgrp())) {
+            kill(-sh->pgid, SIGTTIN);
+        }
+        signal(SIGINT, SIG_IGN);
+        signal(SIGQUIT, SIG_IGN);
+        signal(SIGTSTP, SIG_IGN);
+        signal(SIGTTIN, SIG_IGN);
+        signal(SIGTTOU, SIG_IGN);
+        sh->pgid = getpid();
+        setpgid(sh->pgid, sh->pgid);
+        tcsetpgrp(STDIN_FILENO, sh->pgid);
+    }
 
-void pid_queue_push(struct pid_queue *q, pid_t pid) {
-    if (q->size == q->capacity) {
-        size_t new_capacity = (q->capacity + 1)  * 2;
-        q->data = realloc(q->data, new_capacity * sizeof(*q->data));
-        q->capacity = new_capacity;
+    /* Children are reaped only via the signalfd, in the event loop. */
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &mask, &sh->child_sigmask) == -1) {
+        perror("sigprocmask");
+        exit(EXIT_FAILURE);
     }
-    q->data[q->size++] = pid;
+    sh->signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    sh->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (sh->signal_fd == -1 || sh->epoll_fd == -1) {
+        perror("signalfd/epoll");
+        exit(EXIT_FAILURE);
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = sh->signal_fd};
+    epoll_ctl(sh->epoll_fd, EPOLL_CTL_ADD, sh->signal_fd, &ev);
+    ev.data.fd = STDIN_FILENO;
+    sh->is_stdin_pollable = epoll_ctl(sh->epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == 0;
+}
+
+static void
+shell_destroy(struct shell *sh)
+{
+    job_table_destroy(&sh->jobs);
+    path_cache_destroy(&sh->paths);
+    parser_delete(sh->parser);
+    close(sh->signal_fd);
+    close(sh->epoll_fd);
 }
 
-pid_t pid_queue_pop(struct pid_queue *q) {
-    pid_t temp = q->data[0];
-    for (size_t i = 0; i < q->size - 1; ++i) {
-        q->data[i] = q->data[i + 1];
+/** Restore what the shell changed for itself, right before exec. */
+static void
+child_reset(struct shell *sh, struct job *j)
+{
+    if (sh->is_job_control) {
+        setpgid(0, j->pgid);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
     }
-    q->size--;
-    return temp;
+    sigprocmask(SIG_SETMASK, &sh->child_sigmask, NULL);
 }
 
-void pid_queue_destroy(struct pid_queue *q) {
-    free(q->data);
+static void
+job_signal(struct shell *sh, struct job *j, int signo)
+{
+    if (sh->is_job_control && j->pgid > 0) {
+        killpg(j->pgid, signo);
+    } else {
+        for (int i = 0; i < j->proc_count; ++i) {
+            if (!j->procs[i]->is_done) {
+                kill(j->procs[i]->pid, signo);
+            }
+        }
+    }
+    if (signo == SIGCONT) {
+        job_mark_continued(j);
+    }
 }
 
-void sigchld_handler(int signo) {
-    assert(signo == SIGCHLD);
-    pid_t pid;
-    int status;
-    while ((pid = waitpid(-1, &status, WNOHANG))  > 0) {}
+static void
+job_print_state(struct job *j, const char *state)
+{
+    printf("[%d]  %-22s  ", j->id, state);
+    job_print_command(j, stdout);
+    printf("\n");
+    fflush(stdout);
 }
 
-static struct execute_cmd_result
-execute_command_line(struct command_line *line, struct parser *p)
+/**
+ * Parse a job reference: %N or a pid of any job process. Without
+ * the argument it is the most recent job other than @a self - the
+ * job executing the builtin.
+ */
+static struct job *
+shell_find_job(struct shell *sh, struct job *self, const struct command *cmd)
 {
-    /* REPLACE THIS CODE WITH ACTUAL COMMAND EXECUTION */
-    assert(line != NULL);
+    struct job *j;
+    if (cmd->arg_count == 0) {
+        j = NULL;
+        for (int i = sh->jobs.capacity - 1; i >= 0 && j == NULL; --i) {
+            if (sh->jobs.jobs[i] != self) {
+                j = sh->jobs.jobs[i];
+            }
+        }
+    } else if (cmd->args[0][0] == '%') {
+        j = job_table_find(&sh->jobs, atoi(cmd->args[0] + 1));
+    } else {
+        struct process *p = job_table_find_pid(&sh->jobs, atoi(cmd->args[0]));
+        j = p != NULL ? p->job : NULL;
+    }
+    return j != self && (j == NULL || !j->is_parallel_task) ? j : NULL;
+}
 
-    if (line->is_background) {
-        struct sigaction sa = {
-            .sa_handler = sigchld_handler,
-            .sa_flags = SA_RESTART
-        };
-        int err = sigaction(SIGCHLD, &sa, NULL);
-        assert(err != -1);
+static void
+shell_wait_events(struct shell *sh, bool need_stdin);
 
-        pid_t child_pid = fork();
-        assert(child_pid != -1);
+static int
+shell_wait_job(struct shell *sh, struct job *j);
 
-        if (child_pid != 0) {
-            struct execute_cmd_result result = {COMMAND_CONTINUE, 0};
-            return result;
+static void
+job_advance(struct shell *sh, struct job *j);
+
+static int
+builtin_cd(struct shell *sh, struct job *j, const struct command *cmd)
+{
+    (void)sh;
+    const char *dir = cmd->arg_count > 0 ? cmd->args[0] : getenv("HOME");
+    /* A background line works like a subshell, the cwd can't change. */
+    if (j->is_background || dir == NULL) {
+        return 0;
+    }
+    if (chdir(dir) == -1) {
+        perror("cd");
+        return 1;
+    }
+    return 0;
+}
+
+static int
+builtin_exit(struct shell *sh, struct job *j, const struct command *cmd)
+{
+    int status = cmd->arg_count > 0 ? atoi(cmd->args[0]) : sh->last_status;
+    if (j->is_background) {
+        /* Exit from the "subshell" - just stop the line. */
+        j->next_expr = NULL;
+        return status;
+    }
+    sh->should_exit = true;
+    sh->exit_status = status;
+    j->next_expr = NULL;
+    return status;
+}
+
+static int
+builtin_jobs(struct shell *sh, struct job *self, const struct command *cmd)
+{
+    (void)cmd;
+    for (int i = 0; i < sh->jobs.capacity; ++i) {
+        struct job *j = sh->jobs.jobs[i];
+        if (j == NULL || j == self) {
+            continue;
         }
+        job_print_state(j, job_is_stopped(j) ? "Stopped" : "Running");
     }
+    return 0;
+}
 
-    int output_fd = STDOUT_FILENO;
-    if (line->out_type == OUTPUT_TYPE_FILE_NEW) {
-        output_fd = open(line->out_file, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-        if (output_fd == -1) {
-            perror("open");
-            exit(EXIT_FAILURE);
+static int
+builtin_fg(struct shell *sh, struct job *self, const struct command *cmd)
+{
+    struct job *j = shell_find_job(sh, self, cmd);
+    if (j == NULL) {
+        fprintf(stderr, "fg: no such job\n");
+        return 1;
+    }
+    job_print_command(j, stdout);
+    printf("\n");
+    fflush(stdout);
+    j->is_background = false;
+    if (job_is_stopped(j)) {
+        job_signal(sh, j, SIGCONT);
+    }
+    return shell_wait_job(sh, j);
+}
+
+static int
+builtin_bg(struct shell *sh, struct job *self, const struct command *cmd)
+{
+    struct job *j = shell_find_job(sh, self, cmd);
+    if (j == NULL) {
+        fprintf(stderr, "bg: no such job\n");
+        return 1;
+    }
+    j->is_background = true;
+    if (job_is_stopped(j)) {
+        job_signal(sh, j, SIGCONT);
+    }
+    printf("[%d]  ", j->id);
+    job_print_command(j, stdout);
+    printf(" &\n");
+    fflush(stdout);
+    return 0;
+}
+
+static int
+builtin_wait(struct shell *sh, struct job *self, const struct command *cmd)
+{
+    if (cmd->arg_count == 0) {
+        /* Wait for all the background jobs except stopped ones. */
+        while (true) {
+            bool has_running = false;
+            for (int i = 0; i < sh->jobs.capacity && !has_running; ++i) {
+                struct job *j = sh->jobs.jobs[i];
+                has_running = j != NULL && j != self && j->is_background && !job_is_stopped(j);
+            }
+            if (!has_running) {
+                return 0;
+            }
+            shell_wait_events(sh, false);
         }
-    } else if (line->out_type == OUTPUT_TYPE_FILE_APPEND) {
-        output_fd = open(line->out_file, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-        if (output_fd == -1) {
-            perror("open");
-            exit(EXIT_FAILURE);
+    }
+    struct job *j = shell_find_job(sh, self, cmd);
+    if (j == NULL) {
+        return 127;
+    }
+    int id = j->id;
+    /* Done background jobs are deleted right away, so watch the slot. */
+    while (job_table_find(&sh->jobs, id) == j && !j->is_done && !job_is_stopped(j)) {
+        shell_wait_events(sh, false);
+    }
+    return job_table_find(&sh->jobs, id) == j ? j->status : 0;
+}
+
+struct text_buf {
+    char *data;
+    size_t size;
+    size_t capacity;
+};
+
+static void
+text_buf_append(struct text_buf *buf, const char *data, size_t size)
+{
+    if (buf->capacity - buf->size < size) {
+        buf->capacity = (buf->capacity + size) * 2;
+        buf->data = realloc(buf->data, buf->capacity);
+    }
+    memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
+}
+
+/** Quote a word for the parser, so it stays one argument. */
+static void
+parallel_append_word(struct text_buf *buf, const char *word, size_t len)
+{
+    text_buf_append(buf, "\"", 1);
+    for (size_t i = 0; i < len; ++i) {
+        if (word[i] == '"' || word[i] == '\\') {
+            text_buf_append(buf, "\\", 1);
         }
+        text_buf_append(buf, &word[i], 1);
     }
+    text_buf_append(buf, "\"", 1);
+}
 
+/**
+ * Command line of a parallel task. Without a template the input is
+ * a whole command line. Otherwise {} in the template words is
+ * replaced with the input, or the input is appended as the last
+ * argument, like in xargs -n 1.
+ */
+static void
+parallel_make_line(struct text_buf *buf, char **words, uint32_t word_count, const char *input)
+{
+    buf->size = 0;
+    if (word_count == 0) {
+        text_buf_append(buf, input, strlen(input));
+        text_buf_append(buf, "\n", 1);
+        return;
+    }
+    bool is_used = false;
+    size_t input_len = strlen(input);
+    for (uint32_t i = 0; i < word_count; ++i) {
+        if (i > 0) {
+            text_buf_append(buf, " ", 1);
+        }
+        const char *word = words[i];
+        const char *mark = strstr(word, "{}");
+        if (mark == NULL) {
+            parallel_append_word(buf, word, strlen(word));
+            continue;
+        }
+        /* Build the word with the replacements, then quote it. */
+        struct text_buf tmp = {0};
+        for (; mark != NULL; mark = strstr(word, "{}")) {
+            text_buf_append(&tmp, word, mark - word);
+            text_buf_append(&tmp, input, input_len);
+            word = mark + 2;
+        }
+        text_buf_append(&tmp, word, strlen(word));
+        parallel_append_word(buf, tmp.data, tmp.size);
+        free(tmp.data);
+        is_used = true;
+    }
+    if (!is_used) {
+        text_buf_append(buf, " ", 1);
+        parallel_append_word(buf, input, input_len);
+    }
+    text_buf_append(buf, "\n", 1);
+}
 
-    int pipes[3][2] = {{-1, -1}, {-1, -1}, {-1, -1}};
+/** Lines of the file, without the empty ones. */
+static char **
+parallel_read_inputs(const char *path, uint32_t *count)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return NULL;
+    }
+    char **inputs = NULL;
+    uint32_t capacity = 0;
+    *count = 0;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t len;
+    while ((len = getline(&line, &line_capacity, f)) != -1) {
+        if (len > 0 && line[len - 1] == '\n') {
+            line[--len] = 0;
+        }
+        if (len == 0) {
+            continue;
+        }
+        if (*count == capacity) {
+            capacity = (capacity + 1) * 2;
+            inputs = realloc(inputs, capacity * sizeof(*inputs));
+        }
+        inputs[(*count)++] = strdup(line);
+    }
+    free(line);
+    fclose(f);
+    return inputs;
+}
 
-    struct pid_queue children_queue = {};
+/** Print what a grouped task wrote into its memfd. */
+static void
+parallel_flush_output(int fd)
+{
+    char buf[64 * 1024];
+    ssize_t rc;
+    fflush(stdout);
+    lseek(fd, 0, SEEK_SET);
+    while ((rc = read(fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t done = 0; done < rc;) {
+            ssize_t written = write(STDOUT_FILENO, buf + done, rc - done);
+            if (written <= 0) {
+                return;
+            }
+            done += written;
+        }
+    }
+}
 
-    bool skip_next_command = false;
+/**
+ * Parse a task command line. NULL if it isn't exactly one complete
+ * line: an input with a newline or an open quote is refused instead
+ * of being glued to the next one.
+ */
+static struct command_line *
+parallel_parse_line(const struct text_buf *text)
+{
+    struct parser *parser = parser_new();
+    parser_feed(parser, text->data, text->size);
+    struct command_line *line = NULL;
+    struct command_line *extra = NULL;
+    if (parser_pop_next(parser, &line) == PARSER_ERR_NONE && line != NULL &&
+        (parser_pop_next(parser, &extra) != PARSER_ERR_NONE || extra != NULL)) {
+        command_line_delete(line);
+        line = NULL;
+    }
+    if (extra != NULL) {
+        command_line_delete(extra);
+    }
+    parser_delete(parser);
+    return line;
+}
 
-    const struct expr *prev_e = NULL;
+/**
+ * parallel [-j N] [-g] [-a FILE] [TEMPLATE...] [::: INPUT...]
+ *
+ * Run a task per input with at most N of them at once, N is the
+ * number of CPUs by default. A task is an ordinary job, launched
+ * and reaped by the shell loop; a slot is refilled as soon as its
+ * job is done. With -g the output of each task is buffered and
+ * printed as one piece when it finishes, otherwise it is streamed.
+ * Returns the number of failed tasks, at most 101, like GNU parallel.
+ *
+ * Unlike GNU parallel the inputs are never read from stdin: it is
+ * the shell's own script. Use -a FILE or ::: instead. The tasks are
+ * jobs of this shell, so `parallel ... &` is refused.
+ */
+static int
+builtin_parallel(struct shell *sh, struct job *self, const struct command *cmd)
+{
+    if (self->is_background) {
+        fprintf(stderr, "parallel: can't run in the background\n");
+        return 2;
+    }
+    long slot_count = sysconf(_SC_NPROCESSORS_ONLN);
+    bool is_grouped = false;
+    const char *input_file = NULL;
+    uint32_t i = 0;
+    for (; i < cmd->arg_count; ++i) {
+        const char *arg = cmd->args[i];
+        if (strcmp(arg, "-j") == 0 && i + 1 < cmd->arg_count) {
+            slot_count = atol(cmd->args[++i]);
+        } else if (strncmp(arg, "-j", 2) == 0 && arg[2] != 0) {
+            slot_count = atol(arg + 2);
+        } else if (strcmp(arg, "-g") == 0) {
+            is_grouped = true;
+        } else if (strcmp(arg, "-a") == 0 && i + 1 < cmd->arg_count) {
+            input_file = cmd->args[++i];
+        } else {
+            break;
+        }
+    }
+    char **words = cmd->args + i;
+    uint32_t word_count = 0;
+    while (i + word_count < cmd->arg_count && strcmp(words[word_count], ":::") != 0) {
+        ++word_count;
+    }
+    char **inputs;
+    uint32_t input_count;
+    bool is_inputs_owned = false;
+    if (i + word_count < cmd->arg_count) {
+        inputs = words + word_count + 1;
+        input_count = cmd->arg_count - i - word_count - 1;
+    } else if (input_file != NULL) {
+        inputs = parallel_read_inputs(input_file, &input_count);
+        if (inputs == NULL) {
+            perror(input_file);
+            return 1;
+        }
+        is_inputs_owned = true;
+    } else {
+        fprintf(stderr, "usage: parallel [-j N] [-g] [-a FILE] [TEMPLATE...] [::: INPUT...]\n");
+        return 2;
+    }
+    if (slot_count < 1) {
+        slot_count = 1;
+    }
 
-    const struct expr *e = line->head;
-    while (e != NULL) {
-        if (e->type == EXPR_TYPE_COMMAND) {
-            if (skip_next_command) {
-                skip_next_command = false;
-                if (e->next && e->next->type == EXPR_TYPE_PIPE) {
-                    skip_next_command = true;
-                }
-                prev_e = e;
-                e = e->next;
+    struct text_buf text = {0};
+    struct job **slots = calloc(slot_count, sizeof(*slots));
+    int running_count = 0;
+    int failed_count = 0;
+    uint32_t next = 0;
+    while (next < input_count || running_count > 0) {
+        for (long s = 0; s < slot_count && next < input_count; ++s) {
+            if (slots[s] != NULL) {
                 continue;
             }
-
-            // TODO: fix for && and ||
-            if (strcmp(e->cmd.exe, "cd") == 0 && !e->next) {
-                chdir(e->cmd.args[0]);
-                break;
+            parallel_make_line(&text, words, word_count, inputs[next++]);
+            struct command_line *line = parallel_parse_line(&text);
+            if (line == NULL) {
+                fprintf(stderr, "parallel: bad command line: %.*s", (int)text.size, text.data);
+                ++failed_count;
+                --s;
+                continue;
             }
-
-            // TODO: fix for && and ||
-            if (strcmp(e->cmd.exe, "exit") == 0 && line->head == e && !e->next) {
-                struct execute_cmd_result result = {COMMAND_EXIT, EXIT_SUCCESS};
-                if (e->cmd.arg_count == 1) {
-                    result.status = atoi(e->cmd.args[0]);
-                }
-                return result;
+            /* A background "subshell": cd and exit don't touch the shell. */
+            struct job *j = job_new(&sh->jobs, line, true);
+            j->is_parallel_task = true;
+            j->status = 0;
+            j->is_traced = self->is_traced;
+            j->is_trace_json = self->is_trace_json;
+            j->start_sec = j->is_traced ? trace_now() : 0;
+            if (is_grouped) {
+                j->out_fd = memfd_create("parallel", MFD_CLOEXEC);
             }
-
-            bool is_next_pipe = e->next && e->next->type == EXPR_TYPE_PIPE;
-            if (is_next_pipe) {
-                if (pipe(pipes[2]) == -1) {
-                    perror("pipe");
-                    exit(EXIT_FAILURE);
-                }
+            slots[s] = j;
+            ++running_count;
+            job_advance(sh, j);
+        }
+        bool has_finished = false;
+        for (long s = 0; s < slot_count; ++s) {
+            struct job *j = slots[s];
+            if (j == NULL || !j->is_done) {
+                continue;
+            }
+            if (j->out_fd != -1) {
+                parallel_flush_output(j->out_fd);
+                close(j->out_fd);
+            }
+            if (j->status != 0) {
+                ++failed_count;
             }
+            job_delete(&sh->jobs, j);
+            slots[s] = NULL;
+            --running_count;
+            has_finished = true;
+        }
+        if (!has_finished && running_count > 0) {
+            shell_wait_events(sh, false);
+        }
+    }
+    free(slots);
+    free(text.data);
+    if (is_inputs_owned) {
+        for (uint32_t k = 0; k < input_count; ++k) {
+            free(inputs[k]);
+        }
+        free(inputs);
+    }
+    return failed_count > 101 ? 101 : failed_count;
+}
 
-            pid_t child_pid = fork();
-            if (child_pid == -1) {
-                perror("fork");
-                exit(EXIT_FAILURE);
+/**
+ * hash: print the command path cache, -r: clear it, hash NAME...:
+ * resolve and remember the names.
+ */
+static int
+builtin_hash(struct shell *sh, struct job *j, const struct command *cmd)
+{
+    (void)j;
+    int status = 0;
+    if (cmd->arg_count == 0) {
+        path_cache_print(&sh->paths, stdout);
+    } else if (strcmp(cmd->args[0], "-r") == 0) {
+        path_cache_clear(&sh->paths);
+    } else {
+        for (uint32_t i = 0; i < cmd->arg_count; ++i) {
+            if (path_cache_lookup(&sh->paths, cmd->args[i]) == NULL) {
+                fprintf(stderr, "hash: %s: not found\n", cmd->args[i]);
+                status = 1;
             }
+        }
+    }
+    fflush(stdout);
+    return status;
+}
 
-            pid_queue_push(&children_queue, child_pid);
-
-            if (child_pid == 0) {
-                // TODO: fix for && and ||
-                if (strcmp(e->cmd.exe, "exit") == 0) {
-                    if (e->cmd.arg_count == 1) {
-                        pid_queue_destroy(&children_queue);
-                        int exit_code = atoi(e->cmd.args[0]);
-                        command_line_delete(line);
-                        parser_delete(p);
-                        exit(exit_code);
-                    } else {
-                        pid_queue_destroy(&children_queue);
-                        command_line_delete(line);
-                        parser_delete(p);
-                        exit(EXIT_SUCCESS);
-                    }
-                }
+/**
+ * Commands which change the shell itself. They are executed in the
+ * shell process when they are a whole pipeline. Returns false if
+ * the command isn't one of them.
+ */
+static bool
+try_run_special(struct shell *sh, struct job *j, const struct command *cmd, int *status)
+{
+    static const struct {
+        const char *name;
+        int (*f)(struct shell *, struct job *, const struct command *);
+    } specials[] = {
+        {"cd", builtin_cd},
+        {"exit", builtin_exit},
+        {"jobs", builtin_jobs},
+        {"fg", builtin_fg},
+        {"bg", builtin_bg},
+        {"wait", builtin_wait},
+        {"hash", builtin_hash},
+        {"parallel", builtin_parallel},
+    };
+    for (size_t i = 0; i < sizeof(specials) / sizeof(specials[0]); ++i) {
+        if (strcmp(cmd->exe, specials[i].name) == 0) {
+            *status = specials[i].f(sh, j, cmd);
+            return true;
+        }
+    }
+    return false;
+}
 
-                // Substitute the stdin fd with the reading end of the pipe
-                if (prev_e && prev_e->type == EXPR_TYPE_PIPE) {
-                    int new_fd = dup2(pipes[1][0], STDIN_FILENO);
-                    if (new_fd == -1) {
-                        perror("dup2");
-                        exit(EXIT_FAILURE);
-                    }
-                    for (int i = 0; i < 2; ++i) {
-                        if (pipes[i][0] != -1) {
-                            int res = close(pipes[i][0]);
-                            if (res == -1) {
-                                perror("close");
-                                exit(EXIT_FAILURE);
-                            }
-                            res = close(pipes[i][1]);
-                            if (res == -1) {
-                                perror("close");
-                                exit(EXIT_FAILURE);
-                            }
-                            pipes[i][0] = -1;
-                            pipes[i][1] = -1;
-                        }
-                    }
-                }
+static int
+open_output_file(const struct command_line *line)
+{
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+    flags |= line->out_type == OUTPUT_TYPE_FILE_NEW ? O_TRUNC : O_APPEND;
+    int fd = open(line->out_file, flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd == -1) {
+        perror("open");
+    }
+    return fd;
+}
 
-                // TODO: fix for && and ||
-                // Substitute the stdout fd with the writing end of the pipe
-                if (is_next_pipe) {
-                    int new_fd = dup2(pipes[2][1], STDOUT_FILENO);
-                    if (new_fd == -1) {
-                        perror("dup2");
-                        exit(EXIT_FAILURE);
-                    }
-                    int res = close(pipes[2][0]);
-                    if (res == -1) {
-                        perror("close");
-                        exit(EXIT_FAILURE);
-                    }
-                    res = close(pipes[2][1]);
-                    if (res == -1) {
-                        perror("close");
-                        exit(EXIT_FAILURE);
-                    }
-                    pipes[2][0] = -1;
-                    pipes[2][1] = -1;
-                }
+/** argv for exec: exe, args, NULL. The strings are not copied. */
+static char **
+command_make_argv(const struct command *cmd)
+{
+    char **argv = malloc((cmd->arg_count + 2) * sizeof(*argv));
+    argv[0] = cmd->exe;
+    for (size_t i = 0; i < cmd->arg_count; ++i) {
+        argv[i + 1] = cmd->args[i];
+    }
+    argv[cmd->arg_count + 1] = NULL;
+    return argv;
+}
 
-                if (!e->next && (line->out_type == OUTPUT_TYPE_FILE_NEW || line->out_type == OUTPUT_TYPE_FILE_APPEND)) {
-                    int new_fd = dup2(output_fd, STDOUT_FILENO);
-                    if (new_fd == -1) {
-                        perror("dup2");
-                        exit(EXIT_FAILURE);
-                    }
-                }
+/**
+ * Fork path, for builtins inside pipelines and for exit - they run
+ * as a copy of the shell instead of being exec'ed.
+ */
+static pid_t
+launch_forked(struct shell *sh, struct job *j, const struct command *cmd, int in_fd, int out_fd,
+              int64_t *spliced_bytes)
+{
+    /* Otherwise the child would print the shell's buffer again. */
+    fflush(stdout);
+    pid_t child_pid = fork();
+    if (child_pid == -1) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (child_pid != 0) {
+        return child_pid;
+    }
+    child_reset(sh, j);
+    /* All the fds are O_CLOEXEC, only the dup2() copies survive exec. */
+    if ((in_fd != -1 && dup2(in_fd, STDIN_FILENO) == -1) ||
+        (out_fd != -1 && dup2(out_fd, STDOUT_FILENO) == -1)) {
+        perror("dup2");
+        _exit(EXIT_FAILURE);
+    }
+    const struct builtin *b = builtin_find(cmd->exe);
+    if (b != NULL) {
+        int64_t before = builtin_spliced_bytes();
+        int status = b->f(cmd, STDOUT_FILENO);
+        if (spliced_bytes != NULL) {
+            *spliced_bytes = builtin_spliced_bytes() - before;
+        }
+        _exit(status);
+    }
+    assert(strcmp(cmd->exe, "exit") == 0);
+    _exit(cmd->arg_count > 0 ? atoi(cmd->args[0]) : EXIT_SUCCESS);
+}
 
-                char **argv = malloc((e->cmd.arg_count + 2) * sizeof(*argv));
-                argv[0] = e->cmd.exe;
-                for (size_t i = 0; i < e->cmd.arg_count; ++i) {
-                    argv[i + 1] = e->cmd.args[i];
-                }
-                argv[e->cmd.arg_count + 1] = NULL;
-                int err = execvp(e->cmd.exe, argv);
-                if (err == -1) {
-                    free(argv);
-                    perror("execvp");
-                    exit(EXIT_FAILURE);
-                }
+/**
+ * Spawn path. glibc posix_spawn() is clone(CLONE_VM | CLONE_VFORK),
+ * so the shell page tables are not copied no matter how big the
+ * heap is. The binary comes from the path cache, so PATH is not
+ * walked for every command. The redirects are file actions; the
+ * other fds are O_CLOEXEC and don't need closing. A file without
+ * #! is run by /bin/sh, like execvp() does. Returns -1 and an exit
+ * status if the command couldn't be started.
+ */
+static pid_t
+launch_spawned(struct shell *sh, struct job *j, const struct command *cmd, int in_fd, int out_fd, int *status)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (in_fd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    }
+    if (out_fd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    }
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    posix_spawnattr_setsigmask(&attr, &sh->child_sigmask);
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    if (sh->is_job_control) {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&attr, j->pgid);
+        sigaddset(&defaults, SIGINT);
+        sigaddset(&defaults, SIGQUIT);
+        sigaddset(&defaults, SIGTSTP);
+        sigaddset(&defaults, SIGTTIN);
+        sigaddset(&defaults, SIGTTOU);
+    }
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setflags(&attr, flags);
+
+    char **argv = command_make_argv(cmd);
+    pid_t child_pid;
+    int rc = ENOENT;
+    const char *path = path_cache_lookup(&sh->paths, cmd->exe);
+    if (path != NULL) {
+        rc = posix_spawn(&child_pid, path, &actions, &attr, argv, environ);
+        if (rc == ENOENT && path != cmd->exe) {
+            /* The file moved or was deleted, look it up again. */
+            path_cache_forget(&sh->paths, cmd->exe);
+            path = path_cache_lookup(&sh->paths, cmd->exe);
+            if (path != NULL) {
+                rc = posix_spawn(&child_pid, path, &actions, &attr, argv, environ);
             }
-            if (pipes[0][0] != -1) {
-                int res = close(pipes[0][0]);
-                if (res == -1) {
-                    perror("close");
-                    exit(EXIT_FAILURE);
-                }
-                res = close(pipes[0][1]);
-                if (res == -1) {
-                    perror("close");
-                    exit(EXIT_FAILURE);
-                }
+        }
+        if (rc == ENOEXEC) {
+            /* No #! line: run it by sh, the way execvp() does. */
+            int argc = 0;
+            while (argv[argc] != NULL) {
+                ++argc;
             }
-            pipes[0][0] = pipes[1][0];
-            pipes[0][1] = pipes[1][1];
-            pipes[1][0] = pipes[2][0];
-            pipes[1][1] = pipes[2][1];
-            pipes[2][0] = -1;
-            pipes[2][1] = -1;
-        } else if (e->type == EXPR_TYPE_PIPE) {
-        } else if (e->type == EXPR_TYPE_AND) {
-            for (int i = 0; i < 3; ++i) {
-                if (pipes[i][0] != -1) {
-                    int res = close(pipes[i][0]);
-                    if (res == -1) {
-                        perror("close");
-                        exit(EXIT_FAILURE);
-                    }
-                    res = close(pipes[i][1]);
-                    if (res == -1) {
-                        perror("close");
-                        exit(EXIT_FAILURE);
-                    }
-                    pipes[i][0] = -1;
-                    pipes[i][1] = -1;
-                }
+            char **sh_argv = malloc((argc + 2) * sizeof(*sh_argv));
+            sh_argv[0] = "/bin/sh";
+            sh_argv[1] = (char *)path;
+            memcpy(sh_argv + 2, argv + 1, argc * sizeof(*sh_argv));
+            rc = posix_spawn(&child_pid, "/bin/sh", &actions, &attr, sh_argv, environ);
+            free(sh_argv);
+        }
+    }
+    free(argv);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if (rc != 0) {
+        fprintf(stderr, "%s: %s\n", cmd->exe, strerror(rc));
+        *status = rc == ENOENT ? 127 : 126;
+        return -1;
+    }
+    return child_pid;
+}
+
+/**
+ * Run a builtin which is a whole pipeline right in the shell
+ * process, without fork or exec. Returns false if the command
+ * isn't a builtin. While other jobs run the builtin is forked
+ * instead: it then takes about as long as a real command, and the
+ * output of the jobs keeps its order relative to the builtin's.
+ */
+static bool
+try_run_builtin(struct shell *sh, struct job *j, const struct command *cmd)
+{
+    const struct builtin *b = builtin_find(cmd->exe);
+    if (b == NULL || b->is_stdin_reader || sh->jobs.count > 1) {
+        return false;
+    }
+    const struct command_line *line = j->line;
+    int out_fd = j->out_fd != -1 ? j->out_fd : STDOUT_FILENO;
+    if (j->next_expr == NULL && line->out_type != OUTPUT_TYPE_STDOUT) {
+        out_fd = open_output_file(line);
+        if (out_fd == -1) {
+            j->status = EXIT_FAILURE;
+            return true;
+        }
+    }
+    /* The builtin writes to the fd directly, keep the order. */
+    fflush(stdout);
+    struct rusage ru_before;
+    double start = 0;
+    if (j->is_traced) {
+        getrusage(RUSAGE_SELF, &ru_before);
+        start = trace_now();
+    }
+    j->status = b->f(cmd, out_fd);
+    if (out_fd != STDOUT_FILENO && out_fd != j->out_fd) {
+        close(out_fd);
+    }
+    if (j->is_traced) {
+        /* The shell's own usage delta. Max RSS is the shell's. */
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        struct stage_stat stat = {
+            .name = cmd->exe, .status = j->status, .write_bytes = -1, .is_splice_counted = true,
+        };
+        stat.wall_sec = trace_now() - start;
+        trace_stat_set_rusage(&stat, &ru);
+        struct stage_stat before;
+        trace_stat_set_rusage(&before, &ru_before);
+        stat.user_sec -= before.user_sec;
+        stat.sys_sec -= before.sys_sec;
+        job_add_stat(j, &stat);
+    }
+    return true;
+}
+
+/**
+ * Start all the commands of the pipeline beginning at
+ * j->next_expr. On return next_expr points at the operator after
+ * the pipeline, or is NULL.
+ */
+static void
+job_launch_pipeline(struct shell *sh, struct job *j)
+{
+    const struct expr *e = j->next_expr;
+    assert(e != NULL && e->type == EXPR_TYPE_COMMAND);
+    const struct command_line *line = j->line;
+
+    if (e->next == NULL || e->next->type != EXPR_TYPE_PIPE) {
+        j->next_expr = e->next;
+        if (try_run_special(sh, j, &e->cmd, &j->status)) {
+            return;
+        }
+        if (try_run_builtin(sh, j, &e->cmd)) {
+            return;
+        }
+    }
+
+    int in_fd = -1;
+    while (true) {
+        assert(e->type == EXPR_TYPE_COMMAND);
+        const struct expr *next = e->next;
+        bool is_next_pipe = next != NULL && next->type == EXPR_TYPE_PIPE;
+        int pipe_fds[2] = {-1, -1};
+        int out_fd = -1;
+        int status = EXIT_FAILURE;
+        pid_t child_pid = -1;
+        bool is_forked = strcmp(e->cmd.exe, "exit") == 0 || builtin_find(e->cmd.exe) != NULL;
+        /* wchar misses splice(), the forked builtin reports it here. */
+        int64_t *spliced_bytes = NULL;
+        if (is_forked && j->is_traced) {
+            spliced_bytes = mmap(NULL, sizeof(*spliced_bytes), PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+            if (spliced_bytes == MAP_FAILED) {
+                spliced_bytes = NULL;
+            } else {
+                *spliced_bytes = 0;
             }
-            int wstatus;
-            int exit_status = 0;
-            while (children_queue.size > 0) {
-                pid_t child_pid = pid_queue_pop(&children_queue);
-                waitpid(child_pid, &wstatus, 0);
-                exit_status = WEXITSTATUS(wstatus);
+        }
+        if (is_next_pipe) {
+            if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+                perror("pipe");
+                exit(EXIT_FAILURE);
             }
-            if (exit_status != 0) {
-                skip_next_command = true;
+            /*
+             * Unprivileged users can't go above
+             * /proc/sys/fs/pipe-max-size, then the default stays.
+             */
+            if (sh->pipe_size > 0) {
+                fcntl(pipe_fds[1], F_SETPIPE_SZ, sh->pipe_size);
             }
-        } else if (e->type == EXPR_TYPE_OR) {
-            for (int i = 0; i < 3; ++i) {
-                if (pipes[i][0] != -1) {
-                    int res = close(pipes[i][0]);
-                    if (res == -1) {
-                        perror("close");
-                        exit(EXIT_FAILURE);
-                    }
-                    res = close(pipes[i][1]);
-                    if (res == -1) {
-                        perror("close");
-                        exit(EXIT_FAILURE);
-                    }
-                    pipes[i][0] = -1;
-                    pipes[i][1] = -1;
+            out_fd = pipe_fds[1];
+        } else if (next == NULL && line->out_type != OUTPUT_TYPE_STDOUT) {
+            out_fd = open_output_file(line);
+        } else if (next == NULL && j->out_fd != -1) {
+            out_fd = fcntl(j->out_fd, F_DUPFD_CLOEXEC, 0);
+        }
+
+        double start = j->is_traced ? trace_now() : 0;
+        if (next == NULL && line->out_type != OUTPUT_TYPE_STDOUT && out_fd == -1) {
+            /* Like in bash, a command is not run when its redirect fails. */
+        } else if (is_forked) {
+            child_pid = launch_forked(sh, j, &e->cmd, in_fd, out_fd, spliced_bytes);
+        } else {
+            child_pid = launch_spawned(sh, j, &e->cmd, in_fd, out_fd, &status);
+        }
+        struct process *p;
+        if (child_pid == -1) {
+            p = job_add_finished_process(j, status);
+        } else {
+            if (sh->is_job_control) {
+                if (j->pgid == 0) {
+                    j->pgid = child_pid;
                 }
+                setpgid(child_pid, j->pgid);
             }
-            int wstatus;
-            int exit_status = -1;
-            while (children_queue.size > 0) {
-                pid_t child_pid = pid_queue_pop(&children_queue);
-                waitpid(child_pid, &wstatus, 0);
-                exit_status = WEXITSTATUS(wstatus);
-            }
-            if (exit_status == 0) {
-                skip_next_command = true;
-            }
-        } else {
-            assert(false);
+            p = job_add_process(&sh->jobs, j, child_pid);
         }
-        prev_e = e;
-        e = e->next;
+        p->spliced_bytes = spliced_bytes;
+        if (j->is_traced) {
+            p->start_sec = start;
+            p->stat.name = e->cmd.exe;
+            p->stat.pid = child_pid;
+            p->stat.spawn_sec = trace_now() - start;
+            p->stat.wall_sec = p->stat.spawn_sec;
+            p->stat.write_bytes = -1;
+            p->stat.is_splice_counted = is_forked;
+        }
+
+        if (in_fd != -1) {
+            close(in_fd);
+        }
+        if (out_fd != -1) {
+            close(out_fd);
+        }
+        in_fd = pipe_fds[0];
+        if (!is_next_pipe) {
+            j->next_expr = next;
+            return;
+        }
+        e = next->next;
     }
+}
 
-    if (pipes[0][0] != -1) {
-        int res = close(pipes[0][0]);
-        if (res == -1) {
-            perror("close");
-            exit(EXIT_FAILURE);
+static void
+job_complete(struct shell *sh, struct job *j)
+{
+    j->is_done = true;
+    if (j->is_traced) {
+        trace_print(j, j->is_trace_json, stderr);
+    }
+    if (!j->is_background || j->is_parallel_task) {
+        /* The waiter takes the status and deletes the job. */
+        return;
+    }
+    if (sh->is_job_control) {
+        job_print_state(j, "Done");
+    }
+    job_delete(&sh->jobs, j);
+}
+
+/**
+ * Move the job forward: while no pipeline of it is running, apply
+ * && / || to the status of the last one and launch the next.
+ */
+static void
+job_advance(struct shell *sh, struct job *j)
+{
+    while (j->running_count == 0 && j->stopped_count == 0) {
+        job_finish_pipeline(&sh->jobs, j);
+        const struct expr *e = j->next_expr;
+        if (e == NULL || sh->should_exit) {
+            job_complete(sh, j);
+            return;
         }
-        res = close(pipes[0][1]);
-        if (res == -1) {
-            perror("close");
-            exit(EXIT_FAILURE);
+        if (e->type == EXPR_TYPE_AND || e->type == EXPR_TYPE_OR) {
+            bool need_run = (e->type == EXPR_TYPE_AND) == (j->status == 0);
+            e = e->next;
+            if (!need_run) {
+                /* Skip the whole pipeline, the status stays the same. */
+                while (e->next != NULL && e->next->type == EXPR_TYPE_PIPE) {
+                    e = e->next->next;
+                }
+                j->next_expr = e->next;
+                continue;
+            }
+            j->next_expr = e;
         }
+        job_launch_pipeline(sh, j);
     }
-    pipes[0][0] = -1;
-    pipes[0][1] = -1;
+}
 
-    int exit_status = 0;
+static bool
+shell_has_traced_jobs(const struct shell *sh)
+{
+    for (int i = 0; i < sh->jobs.capacity; ++i) {
+        if (sh->jobs.jobs[i] != NULL && sh->jobs.jobs[i]->is_traced) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * wait4() for any child which changed its state. While there are
+ * traced jobs, an exited child is first looked at with WNOWAIT, to
+ * read its /proc/<pid>/io before it is gone.
+ */
+static pid_t
+shell_reap_child(struct shell *sh, int *wstatus, struct rusage *ru, int64_t *write_bytes)
+{
+    int flags = WNOHANG | WUNTRACED | WCONTINUED;
+    *write_bytes = -1;
+    if (!shell_has_traced_jobs(sh)) {
+        return wait4(-1, wstatus, flags, ru);
+    }
+    siginfo_t info;
+    info.si_pid = 0;
+    if (waitid(P_ALL, 0, &info, WEXITED | WSTOPPED | WCONTINUED | WNOHANG | WNOWAIT) == -1 ||
+        info.si_pid == 0) {
+        return -1;
+    }
+    if (info.si_code == CLD_EXITED || info.si_code == CLD_KILLED || info.si_code == CLD_DUMPED) {
+        *write_bytes = trace_proc_write_bytes(info.si_pid);
+    }
+    return wait4(info.si_pid, wstatus, flags, ru);
+}
+
+/** Reap all the children which changed their state. */
+static void
+shell_handle_children(struct shell *sh)
+{
+    struct signalfd_siginfo info;
+    while (read(sh->signal_fd, &info, sizeof(info)) > 0) {
+    }
+    pid_t pid;
     int wstatus;
-    while (children_queue.size > 0) {
-        pid_t child_pid = pid_queue_pop(&children_queue);
-        waitpid(child_pid, &wstatus, 0);
-        exit_status = WEXITSTATUS(wstatus);
+    struct rusage ru;
+    int64_t write_bytes;
+    while ((pid = shell_reap_child(sh, &wstatus, &ru, &write_bytes)) > 0) {
+        struct process *p = job_table_find_pid(&sh->jobs, pid);
+        if (p == NULL) {
+            continue;
+        }
+        struct job *j = job_table_update(&sh->jobs, pid, wstatus);
+        if (j->is_traced && p->is_done) {
+            p->stat.wall_sec = trace_now() - p->start_sec;
+            p->stat.write_bytes = write_bytes;
+            if (p->spliced_bytes != NULL && write_bytes >= 0) {
+                p->stat.write_bytes += *p->spliced_bytes;
+            }
+            trace_stat_set_rusage(&p->stat, &ru);
+        }
+        job_advance(sh, j);
     }
+}
 
-    pid_queue_destroy(&children_queue);
+/**
+ * Block until children change state or, if @a need_stdin, until
+ * stdin has data. Finished children are handled in the order they
+ * finish, not in the order they were started.
+ */
+static void
+shell_wait_events(struct shell *sh, bool need_stdin)
+{
+    if (need_stdin && !sh->is_stdin_pollable) {
+        /* A regular file is always readable. */
+        shell_handle_children(sh);
+        return;
+    }
+    struct epoll_event events[2];
+    while (true) {
+        int count = epoll_wait(sh->epoll_fd, events, 2, -1);
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+        bool is_stdin_ready = false;
+        for (int i = 0; i < count; ++i) {
+            if (events[i].data.fd == sh->signal_fd) {
+                shell_handle_children(sh);
+            } else {
+                is_stdin_ready = true;
+            }
+        }
+        if (!need_stdin || is_stdin_ready) {
+            return;
+        }
+    }
+}
 
-    if (line->is_background) {
-        command_line_delete(line);
-        parser_delete(p);
-        exit(exit_status);
+/** Wait for a foreground job to finish or stop. Returns its status. */
+static int
+shell_wait_job(struct shell *sh, struct job *j)
+{
+    if (sh->is_job_control && j->pgid > 0) {
+        tcsetpgrp(STDIN_FILENO, j->pgid);
+    }
+    while (!j->is_done && !job_is_stopped(j)) {
+        shell_wait_events(sh, false);
     }
+    if (sh->is_job_control) {
+        tcsetpgrp(STDIN_FILENO, sh->pgid);
+    }
+    if (!j->is_done) {
+        j->is_background = true;
+        printf("\n");
+        job_print_state(j, "Stopped");
+        return 128 + SIGTSTP;
+    }
+    int status = j->status;
+    job_delete(&sh->jobs, j);
+    return status;
+}
 
-    struct execute_cmd_result result = {COMMAND_CONTINUE, exit_status};
-    return result;
+static void
+command_shift(struct command *cmd)
+{
+    cmd->exe = cmd->args[0];
+    ++cmd->args;
+    --cmd->arg_count;
+    --cmd->arg_capacity;
 }
 
-struct input_string {
-    char *data;
-    size_t capacity;
-    size_t size;
-};
+/**
+ * `time [-j] line` measures the whole line: drop the words and trace
+ * the rest. The args are in the line arena, so they are not freed
+ * one by one and the array can just be shifted.
+ */
+static bool
+command_strip_time(struct command *cmd, bool *is_json)
+{
+    if (strcmp(cmd->exe, "time") != 0 || cmd->arg_count == 0) {
+        return false;
+    }
+    command_shift(cmd);
+    if (strcmp(cmd->exe, "-j") == 0 && cmd->arg_count > 0) {
+        *is_json = true;
+        command_shift(cmd);
+    }
+    return true;
+}
 
-void input_string_append(struct input_string *in_str, const char *str, size_t num_bytes) {
-    if (in_str->capacity <= in_str->size + num_bytes) {
-        size_t new_capacity = (in_str->capacity + 1) * 2;
-        if (new_capacity < in_str->size + num_bytes) {
-            new_capacity = in_str->size + num_bytes;
+static void
+execute_command_line(struct shell *sh, struct command_line *line)
+{
+    assert(line != NULL);
+    /*
+     * Let the background lines finished meanwhile go on first. Their
+     * builtins run in this process, so otherwise their output would
+     * be delayed until the next wait.
+     */
+    shell_handle_children(sh);
+    bool is_background = line->is_background;
+    bool is_json = sh->is_trace_json;
+    bool is_timed = command_strip_time(&line->head->cmd, &is_json);
+    struct job *j = job_new(&sh->jobs, line, is_background);
+    j->is_traced = is_timed || sh->is_trace_all;
+    j->is_trace_json = is_json;
+    j->start_sec = j->is_traced ? trace_now() : 0;
+    int id = j->id;
+    j->status = sh->last_status;
+    job_advance(sh, j);
+    if (is_background) {
+        /* The job might be already done and deleted. */
+        if (sh->is_job_control && job_table_find(&sh->jobs, id) == j && j->proc_count > 0) {
+            printf("[%d] %d\n", j->id, (int)j->procs[j->proc_count - 1]->pid);
+            fflush(stdout);
         }
-        in_str->data = realloc(in_str->data, new_capacity * sizeof(*in_str->data));
-        in_str->capacity = new_capacity;
-    } else {
-        assert(in_str->capacity > in_str->size + num_bytes);
+        return;
     }
-    memcpy(&in_str->data[in_str->size], str, num_bytes);
-    in_str->size += num_bytes;
+    sh->last_status = shell_wait_job(sh, j);
 }
 
-void input_string_reset(struct input_string *in_str) {
-    free(in_str->data);
-    in_str->data = NULL;
-    in_str->size = 0;
-    in_str->capacity = 0;
+/**
+ * On EOF finish the background lines which still have pipelines
+ * to launch - the shell is the one who launches them. Jobs in
+ * their last pipeline are left running, as bash does.
+ */
+static void
+shell_finish_jobs(struct shell *sh)
+{
+    while (true) {
+        bool has_pending = false;
+        for (int i = 0; i < sh->jobs.capacity && !has_pending; ++i) {
+            struct job *j = sh->jobs.jobs[i];
+            has_pending = j != NULL && j->next_expr != NULL && !job_is_stopped(j);
+        }
+        if (!has_pending) {
+            return;
+        }
+        shell_wait_events(sh, false);
+    }
 }
 
 int
 main(void)
 {
-    const size_t buf_size = 1024;
-    char buf[buf_size];
-    int rc;
-    struct input_string input_string = {};
-    struct parser *p = parser_new();
-    struct execute_cmd_result result = {COMMAND_CONTINUE, 0};
+    /*
+     * Scripts are read in big chunks straight into the parser. It
+     * keeps a partial last line by itself, no need to glue the
+     * chunks here.
+     */
+    const size_t buf_size = 64 * 1024;
+    char *buf = malloc(buf_size);
+    struct shell sh;
+    shell_create(&sh);
 
-    while ((rc = read(STDIN_FILENO, buf, buf_size)) > 0) {
-        input_string_append(&input_string, buf, rc);
-        if ((unsigned long)rc == sizeof(buf) && buf[rc - 1] != '\n') {
-            continue;
+    while (!sh.should_exit) {
+        shell_wait_events(&sh, true);
+        ssize_t rc = read(STDIN_FILENO, buf, buf_size);
+        if (rc <= 0) {
+            break;
         }
-
-        parser_feed(p, input_string.data, input_string.size);
-        input_string_reset(&input_string);
+        parser_feed(sh.parser, buf, rc);
 
         struct command_line *line = NULL;
-        while (true) {
-            enum parser_error err = parser_pop_next(p, &line);
+        while (!sh.should_exit) {
+            enum parser_error err = parser_pop_next(sh.parser, &line);
             if (err == PARSER_ERR_NONE && line == NULL)
                 break;
             if (err != PARSER_ERR_NONE) {
                 printf("Error: %d\n", (int)err);
                 continue;
             }
-            result = execute_command_line(line, p);
-            command_line_delete(line);
-        }
-        if (result.type == COMMAND_EXIT) {
-            break;
+            execute_command_line(&sh, line);
         }
     }
-    parser_delete(p);
-    return result.status;
+    free(buf);
+    int status = sh.should_exit ? sh.exit_status : sh.last_status;
+    if (!sh.should_exit) {
+        shell_finish_jobs(&sh);
+    }
+    shell_destroy(&sh);
+    return status;
 }
@@ -0,0 +1,99 @@
+#define _GNU_SOURCE
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/*
+ * Commands per second for fork() + execvp() against posix_spawnp(),
+ * the way the shell launched commands before and after switching to
+ * spawn. The parent heap is grown and touched between the rounds:
+ * fork() copies page tables of the whole heap, spawn doesn't.
+ */
+
+static double
+now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+bench_fork(char **argv, int count)
+{
+    double start = now_sec();
+    for (int i = 0; i < count; ++i) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            exit(EXIT_FAILURE);
+        }
+        if (pid == 0) {
+            execvp(argv[0], argv);
+            _exit(127);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return count / (now_sec() - start);
+}
+
+static double
+bench_spawn(char **argv, int count)
+{
+    double start = now_sec();
+    for (int i = 0; i < count; ++i) {
+        pid_t pid;
+        if (posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ) != 0) {
+            perror("posix_spawnp");
+            exit(EXIT_FAILURE);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return count / (now_sec() - start);
+}
+
+int
+main(int argc, char **argv)
+{
+    int count = 1000;
+    const char *heap_sizes = "0,64,256,1024";
+    char *cmd_argv[] = {"true", NULL};
+    int opt;
+    while ((opt = getopt(argc, argv, "n:m:c:")) != -1) {
+        switch (opt) {
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 'm':
+            heap_sizes = optarg;
+            break;
+        case 'c':
+            cmd_argv[0] = optarg;
+            break;
+        default:
+            printf("Usage: %s [-n <commands per round>] [-m <heap MB list>] [-c <command>]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    char *sizes = strdup(heap_sizes);
+    char *heap = NULL;
+    printf("%10s %14s %14s %8s\n", "heap_mb", "fork_cmd/s", "spawn_cmd/s", "speedup");
+    for (char *tok = strtok(sizes, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        size_t heap_size = (size_t)atol(tok) * 1024 * 1024;
+        free(heap);
+        heap = malloc(heap_size + 1);
+        /* Touch it, untouched pages have no page table entries. */
+        memset(heap, 1, heap_size + 1);
+        double fork_cps = bench_fork(cmd_argv, count);
+        double spawn_cps = bench_spawn(cmd_argv, count);
+        printf("%10s %14.0f %14.0f %7.2fx\n", tok, fork_cps, spawn_cps, spawn_cps / fork_cps);
+    }
+    free(heap);
+    free(sizes);
+    return 0;
+}
@@ -0,0 +1,16 @@
+# Tests of launching external commands with posix_spawn().
+from shell_test import check, finish
+
+check('a script without #! is run by /bin/sh',
+      "printf 'echo no shebang\\n' > noshebang.sh\nchmod +x noshebang.sh\n"
+      "./noshebang.sh\n",
+      'no shebang\n')
+check('the arguments reach a script without #!',
+      "printf 'echo \"$0 $1 $2\"\\n' > args.sh\nchmod +x args.sh\n"
+      "./args.sh a 'b c'\n",
+      './args.sh a b c\n')
+check('a script with #! is exec\'ed as is',
+      "printf '#!/bin/sh\\necho shebang\\n' > shebang.sh\nchmod +x shebang.sh\n"
+      "./shebang.sh | cat\n",
+      'shebang\n')
+finish()
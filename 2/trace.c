@@ -0,0 +1,127 @@
+#include "trace.h"
+
+#include "jobs.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+double
+trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int64_t
+trace_proc_write_bytes(pid_t pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    int64_t res = -1;
+    char line[128];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        /* wchar counts all write()s, the pipe included, but not splice(). */
+        if (strncmp(line, "wchar: ", 7) == 0) {
+            res = strtoll(line + 7, NULL, 10);
+            break;
+        }
+    }
+    fclose(f);
+    return res;
+}
+
+static double
+timeval_sec(const struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+void
+trace_stat_set_rusage(struct stage_stat *stat, const struct rusage *ru)
+{
+    stat->user_sec = timeval_sec(&ru->ru_utime);
+    stat->sys_sec = timeval_sec(&ru->ru_stime);
+    stat->max_rss_kb = ru->ru_maxrss;
+}
+
+static double
+trace_write_rate(const struct stage_stat *s)
+{
+    if (s->write_bytes <= 0 || s->wall_sec <= 0)
+        return 0;
+    return s->write_bytes / s->wall_sec / 1e6;
+}
+
+static void
+print_json_string(const char *str, FILE *out)
+{
+    fputc('"', out);
+    for (; *str != 0; ++str) {
+        unsigned char c = *str;
+        if (c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(out, "\\u%04x", c);
+        else
+            fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+static void
+trace_print_json(const struct job *j, FILE *out)
+{
+    fprintf(out, "{\"job\": %d, \"status\": %d, \"wall_ms\": %.3f, \"stages\": [",
+            j->id, j->status, (trace_now() - j->start_sec) * 1e3);
+    for (int i = 0; i < j->stat_count; ++i) {
+        const struct stage_stat *s = &j->stats[i];
+        fprintf(out, "%s{\"name\": ", i > 0 ? ", " : "");
+        print_json_string(s->name, out);
+        fprintf(out, ", \"pid\": %d, \"status\": %d, \"spawn_us\": %.1f, \"wall_ms\": %.3f, "
+                "\"user_ms\": %.3f, \"sys_ms\": %.3f, \"max_rss_kb\": %ld, "
+                "\"write_bytes\": %lld, \"write_mb_s\": %.2f, \"write_has_splice\": %s}",
+                (int)s->pid, s->status, s->spawn_sec * 1e6, s->wall_sec * 1e3,
+                s->user_sec * 1e3, s->sys_sec * 1e3, s->max_rss_kb,
+                (long long)s->write_bytes, trace_write_rate(s),
+                s->is_splice_counted ? "true" : "false");
+    }
+    fprintf(out, "]}\n");
+}
+
+static void
+trace_print_table(const struct job *j, FILE *out)
+{
+    fprintf(out, "%-16s %7s %4s %9s %9s %9s %9s %10s %12s %9s\n", "stage", "pid", "st",
+            "spawn_us", "wall_ms", "user_ms", "sys_ms", "maxrss_kb", "write_bytes", "MB/s");
+    bool has_partial = false;
+    for (int i = 0; i < j->stat_count; ++i) {
+        const struct stage_stat *s = &j->stats[i];
+        bool is_partial = s->write_bytes >= 0 && !s->is_splice_counted;
+        has_partial = has_partial || is_partial;
+        fprintf(out, "%-16.16s %7d %4d %9.1f %9.3f %9.3f %9.3f %10ld %11lld%c %9.2f\n",
+                s->name, (int)s->pid, s->status, s->spawn_sec * 1e6, s->wall_sec * 1e3,
+                s->user_sec * 1e3, s->sys_sec * 1e3, s->max_rss_kb,
+                (long long)s->write_bytes, is_partial ? '*' : ' ', trace_write_rate(s));
+    }
+    if (has_partial)
+        fprintf(out, "* external command: write()s only, splice(), tee() and "
+                "copy_file_range() are not counted\n");
+    fprintf(out, "total: %.3f ms wall, status %d\n", (trace_now() - j->start_sec) * 1e3,
+            j->status);
+}
+
+void
+trace_print(const struct job *j, bool is_json, FILE *out)
+{
+    if (is_json)
+        trace_print_json(j, out);
+    else
+        trace_print_table(j, out);
+    fflush(out);
+}
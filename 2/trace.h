@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+struct job;
+struct rusage;
+struct stage_stat;
+
+/** Monotonic time in seconds. */
+double
+trace_now(void);
+
+/**
+ * Bytes written by a process, from /proc/<pid>/io. Readable while
+ * the process is a zombie, so it is taken before the reaping.
+ * splice(), tee() and copy_file_range() are not in it. Returns -1
+ * if unknown.
+ */
+int64_t
+trace_proc_write_bytes(pid_t pid);
+
+/** Fill user/sys time and max RSS of the stat. */
+void
+trace_stat_set_rusage(struct stage_stat *stat, const struct rusage *ru);
+
+/**
+ * Print the stage stats of a finished traced job, as a table or as
+ * one JSON object per line.
+ */
+void
+trace_print(const struct job *j, bool is_json, FILE *out);
@@ -2,6 +2,9 @@
 #include "unit.h"
 #include <assert.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 
 static void
@@ -469,6 +472,561 @@ test_resize(void)
 #endif
 }
 
+static void
+test_sparse(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	const size_t far = 50 * 1024 * 1024;
+	unit_check(ufs_pwrite(fd, "end", 3, far) == 3, "write far away");
+	unit_check(ufs_seek(fd, 0, UFS_SEEK_END) == (ssize_t)far + 3, "the size");
+	char buf[4096], zeros[4096];
+	memset(zeros, 0, sizeof(zeros));
+	int ok = 1;
+	for (size_t off = 0; off < far; off += far / 64)
+		ok = ok && ufs_pread(fd, buf, sizeof(buf), off) == sizeof(buf) &&
+		     memcmp(buf, zeros, sizeof(buf)) == 0;
+	unit_check(ok, "the hole reads as zeros");
+	unit_check(ufs_pread(fd, buf, 5, far - 2) == 5 &&
+		   memcmp(buf, "\0\0end", 5) == 0, "up to the data");
+
+	unit_fail_if(ufs_pwrite(fd, "abcdefgh", 8, 1000) != 8);
+	unit_check(ufs_resize(fd, 1004) == 0, "shrink into a block");
+	unit_check(ufs_seek(fd, 0, UFS_SEEK_CUR) == 1004,
+		   "a descriptor past the end moves to the new end");
+	unit_check(ufs_resize(fd, 5000) == 0, "grow");
+	unit_check(ufs_pread(fd, buf, 10, 1000) == 10 &&
+		   memcmp(buf, "abcd\0\0\0\0\0\0", 10) == 0,
+		   "the cut bytes don't come back");
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 4000) == 1000 &&
+		   memcmp(buf, zeros, 1000) == 0, "the growth is zeros");
+
+	unit_fail_if(ufs_clone("file", "clone") != 0);
+	unit_fail_if(ufs_resize(fd, 1002) != 0);
+	int clone = ufs_open("clone", 0);
+	unit_check(ufs_pread(clone, buf, 10, 1000) == 10 &&
+		   memcmp(buf, "abcd\0\0\0\0\0\0", 10) == 0,
+		   "a shrink doesn't change a clone");
+	unit_fail_if(ufs_close(clone) != 0);
+	unit_fail_if(ufs_delete("clone") != 0);
+
+	unit_check(ufs_resize(fd, 0) == 0, "shrink to nothing");
+	unit_check(ufs_pread(fd, buf, 10, 0) == 0, "empty");
+	unit_check(ufs_set_block_size(fd, 4096) == 0,
+		   "no data, the block size can be changed");
+	unit_check(ufs_resize(fd, 100 * 1024 * 1024 + 1) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_MEM, "not bigger than the maximum");
+	int ro = ufs_open("file", UFS_READ_ONLY);
+	unit_check(ufs_resize(ro, 10) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_PERMISSION, "not on a read-only one");
+	unit_fail_if(ufs_close(ro) != 0);
+
+	/* A hole of an image stays a hole. */
+	unit_fail_if(ufs_pwrite(fd, "x", 1, 1 << 20) != 1);
+	unit_fail_if(ufs_save("ufs_test.img") != 0);
+	struct ufs *fs = ufs_new();
+	unit_fail_if(ufs_load_ctx(fs, "ufs_test.img") != 0);
+	int fd2 = ufs_open_ctx(fs, "file", 0);
+	unit_check(ufs_pread_ctx(fs, fd2, buf, 2, (1 << 20) - 1) == 2 &&
+		   memcmp(buf, "\0x", 2) == 0, "the holes of an image");
+	ufs_free(fs);
+	remove("ufs_test.img");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_seek(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_seek(fd, 0, UFS_SEEK_CUR) == 0, "new file position is 0");
+	unit_check(ufs_seek(fd, -1, UFS_SEEK_SET) == -1,
+		   "can not seek before the start");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+	unit_check(ufs_seek(-1, 0, UFS_SEEK_SET) == -1, "seek invalid fd");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+
+	int buf_size = 3 * 1024 * 1024 + 123;
+	char *buf = malloc(buf_size);
+	char *buf2 = malloc(buf_size);
+	for (int i = 0; i < buf_size; ++i)
+		buf[i] = 'a' + i % 23;
+	unit_fail_if(ufs_write(fd, buf, buf_size) != buf_size);
+	unit_check(ufs_seek(fd, 0, UFS_SEEK_END) == buf_size, "seek to the end");
+	unit_check(ufs_seek(fd, -100, UFS_SEEK_CUR) == buf_size - 100,
+		   "seek back from the current position");
+	unit_check(ufs_read(fd, buf2, buf_size) == 100, "read till the end");
+	unit_fail_if(memcmp(buf2, buf + buf_size - 100, 100) != 0);
+
+	int offsets[] = {0, 1, 511, 512, 513, 1024 * 1024 - 7, 2 * 1024 * 1024 + 1};
+	int ok = 1;
+	for (size_t i = 0; i < sizeof(offsets) / sizeof(offsets[0]); ++i) {
+		int off = offsets[i];
+		ufs_seek(fd, off, UFS_SEEK_SET);
+		ok = ok && ufs_read(fd, buf2, 1000) == 1000 &&
+		     memcmp(buf2, buf + off, 1000) == 0;
+		ok = ok && ufs_pread(fd, buf2, 1000, off + 1) == 1000 &&
+		     memcmp(buf2, buf + off + 1, 1000) == 0;
+		ok = ok && ufs_seek(fd, 0, UFS_SEEK_CUR) == off + 1000;
+	}
+	unit_check(ok, "random reads with seek and pread");
+
+	ssize_t pos = ufs_seek(fd, 0, UFS_SEEK_CUR);
+	unit_check(ufs_pwrite(fd, "xyz", 3, 700) == 3, "pwrite in the middle");
+	unit_fail_if(ufs_pread(fd, buf2, 5, 699) != 5);
+	unit_check(buf2[0] == buf[699] && memcmp(buf2 + 1, "xyz", 3) == 0 &&
+		   buf2[4] == buf[703], "pwrite changed only its bytes");
+	unit_check(ufs_seek(fd, 0, UFS_SEEK_CUR) == pos,
+		   "pwrite and pread don't move the position");
+
+	unit_check(ufs_pread(fd, buf2, 10, buf_size + 10) == 0,
+		   "pread beyond the end is EOF");
+	unit_check(ufs_pwrite(fd, "end", 3, buf_size + 10) == 3,
+		   "pwrite beyond the end");
+	unit_fail_if(ufs_pread(fd, buf2, 20, buf_size) != 13);
+	unit_check(memcmp(buf2, "\0\0\0\0\0\0\0\0\0\0end", 13) == 0,
+		   "the gap reads as zeros");
+
+	pos = ufs_seek(fd, 0, UFS_SEEK_CUR);
+	unit_check(ufs_pwrite(fd, "abcdef", 6, (size_t)-3) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_MEM, "pwrite at a huge offset");
+	unit_fail_if(ufs_pread(fd, buf2, 6, 0) != 6);
+	unit_check(memcmp(buf2, buf, 6) == 0, "it doesn't wrap around");
+	unit_check(ufs_seek(fd, SSIZE_MAX, UFS_SEEK_END) == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARG, "seek can't overflow");
+	unit_check(ufs_seek(fd, 100 * 1024 * 1024 + 1, UFS_SEEK_SET) == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARG,
+		   "nor go beyond the maximal size");
+	unit_check(ufs_seek(fd, 0, UFS_SEEK_CUR) == pos,
+		   "the position is kept on a failure");
+	unit_fail_if(ufs_seek(fd, 100 * 1024 * 1024 - 2, UFS_SEEK_SET) == -1);
+	unit_check(ufs_write(fd, "abc", 3) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_MEM, "write at the maximal size");
+
+	free(buf2);
+	free(buf);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_block_size(void)
+{
+	unit_test_start();
+
+	unit_check(ufs_set_default_block_size(1000) == -1,
+		   "block size must be a power of 2");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+	unit_check(ufs_set_default_block_size(UFS_MAX_BLOCK_SIZE * 2) == -1,
+		   "and not too big");
+	unit_check(ufs_set_default_block_size(4096) == 0, "4KB by default");
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_set_block_size(fd, UFS_MAX_BLOCK_SIZE) == 0,
+		   "huge blocks for this file");
+	int buf_size = 5 * 1024 * 1024 + 17;
+	char *buf = malloc(buf_size);
+	char *buf2 = malloc(buf_size);
+	for (int i = 0; i < buf_size; ++i)
+		buf[i] = 'a' + i % 29;
+	unit_check(ufs_write(fd, buf, buf_size) == buf_size,
+		   "write over several blocks");
+	unit_check(ufs_set_block_size(fd, 4096) == -1,
+		   "can not change the block size of a file with data");
+	unit_check(ufs_pread(fd, buf2, buf_size, 0) == buf_size &&
+		   memcmp(buf, buf2, buf_size) == 0, "read it back");
+
+	int fd2 = ufs_open("file2", UFS_CREATE);
+	unit_fail_if(fd2 == -1);
+	int ok = 1;
+	for (int i = 0; i < buf_size; i += 3001) {
+		int size = buf_size - i < 3001 ? buf_size - i : 3001;
+		ok = ok && ufs_write(fd2, buf + i, size) == size;
+	}
+	unit_check(ok, "write with the default blocks in odd pieces");
+	unit_check(ufs_pread(fd2, buf2, buf_size, 0) == buf_size &&
+		   memcmp(buf, buf2, buf_size) == 0, "read it back");
+
+	free(buf2);
+	free(buf);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file2") != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	unit_fail_if(ufs_set_default_block_size(UFS_MIN_BLOCK_SIZE) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_many_files(void)
+{
+	unit_test_start();
+
+	const int count = 20000;
+	char name[32];
+	unit_msg("create %d files, delete every other one", count);
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_write(fd, name, strlen(name)) <= 0);
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+	for (int i = 0; i < count; i += 2) {
+		sprintf(name, "file%d", i);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+	int ok = 1;
+	char buf[32];
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		int fd = ufs_open(name, 0);
+		if (i % 2 == 0) {
+			ok = ok && fd == -1 && ufs_errno() == UFS_ERR_NO_FILE;
+			continue;
+		}
+		int len = strlen(name);
+		ok = ok && fd != -1 && ufs_read(fd, buf, sizeof(buf)) == len &&
+		     memcmp(buf, name, len) == 0;
+		ufs_close(fd);
+	}
+	unit_check(ok, "the rest are found with their data");
+
+	unit_msg("churn: create and delete a file many times");
+	for (int i = 0; i < count * 5; ++i) {
+		int fd = ufs_open("churn", UFS_CREATE);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_close(fd) != 0);
+		unit_fail_if(ufs_delete("churn") != 0);
+	}
+	for (int i = 1; i < count; i += 2) {
+		sprintf(name, "file%d", i);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+	unit_check(ufs_open("file1", 0) == -1, "all are deleted");
+
+	unit_test_finish();
+}
+
+static void
+test_fd_reuse(void)
+{
+	unit_test_start();
+
+	const int count = 5000;
+	int *fds = malloc(count * sizeof(*fds));
+	for (int i = 0; i < count; ++i) {
+		fds[i] = ufs_open("file", UFS_CREATE);
+		unit_fail_if(fds[i] == -1);
+	}
+	int ok = 1;
+	for (int i = 1; i < count; ++i)
+		ok = ok && fds[i] > fds[i - 1];
+	unit_check(ok, "descriptors are given in ascending order");
+
+	unit_fail_if(ufs_close(fds[4000]) != 0);
+	unit_fail_if(ufs_close(fds[70]) != 0);
+	unit_fail_if(ufs_close(fds[3]) != 0);
+	int fd = ufs_open("file", 0);
+	unit_check(fd == fds[3], "the lowest free one is taken");
+	fd = ufs_open("file", 0);
+	unit_check(fd == fds[70], "then the next lowest");
+	fd = ufs_open("file", 0);
+	unit_check(fd == fds[4000], "and the next");
+
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(ufs_close(fds[i]) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	free(fds);
+
+	unit_test_finish();
+}
+
+static void
+test_instances(void)
+{
+	unit_test_start();
+
+	struct ufs *a = ufs_new();
+	struct ufs *b = ufs_new();
+	int fd_a = ufs_open_ctx(a, "file", UFS_CREATE);
+	int fd_b = ufs_open_ctx(b, "file", UFS_CREATE);
+	unit_fail_if(fd_a == -1 || fd_b == -1);
+	unit_check(fd_a == fd_b, "each instance has its own descriptors");
+	unit_check(ufs_open("file", 0) == -1, "the default one has no such file");
+
+	unit_fail_if(ufs_write_ctx(a, fd_a, "aaa", 3) != 3);
+	unit_fail_if(ufs_write_ctx(b, fd_b, "bb", 2) != 2);
+	char buf[8];
+	unit_check(ufs_pread_ctx(a, fd_a, buf, sizeof(buf), 0) == 3 &&
+		   memcmp(buf, "aaa", 3) == 0, "same name, different files");
+	unit_check(ufs_pread_ctx(b, fd_b, buf, sizeof(buf), 0) == 2 &&
+		   memcmp(buf, "bb", 2) == 0, "and the other one");
+
+	unit_fail_if(ufs_delete_ctx(a, "file") != 0);
+	unit_check(ufs_open_ctx(a, "file", 0) == -1, "deleted in one");
+	int fd = ufs_open_ctx(b, "file", 0);
+	unit_check(fd != -1, "still exists in the other");
+	unit_fail_if(ufs_close_ctx(b, fd) != 0);
+
+	/* The open files are freed too. */
+	ufs_free(a);
+	ufs_free(b);
+
+	unit_test_finish();
+}
+
+static void
+test_clone(void)
+{
+	unit_test_start();
+
+	const int size = 10000;
+	char *data = malloc(size);
+	char *buf = malloc(size);
+	for (int i = 0; i < size; ++i)
+		data[i] = 'a' + i % 26;
+	int fd = ufs_open("src", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, data, size) != size);
+	unit_check(ufs_clone("no_such_file", "dst") == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "clone of no file");
+	unit_check(ufs_clone("src", "dst") == 0, "clone");
+	int dst = ufs_open("dst", 0);
+	unit_check(dst != -1 && ufs_read(dst, buf, size + 1) == size &&
+		   memcmp(buf, data, size) == 0, "the clone has the data");
+
+	unit_fail_if(ufs_pwrite(dst, "xyz", 3, 600) != 3);
+	unit_check(ufs_pread(fd, buf, size, 0) == size &&
+		   memcmp(buf, data, size) == 0, "a write to the clone is its own");
+	unit_fail_if(ufs_pwrite(fd, "123", 3, 5000) != 3);
+	unit_check(ufs_pread(dst, buf, 3, 5000) == 3 &&
+		   memcmp(buf, data + 5000, 3) == 0, "and to the source too");
+	unit_check(ufs_pread(dst, buf, 3, 600) == 3 &&
+		   memcmp(buf, "xyz", 3) == 0, "the clone keeps its write");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("src") != 0);
+	unit_check(ufs_pread(dst, buf, 3, 5000) == 3 &&
+		   memcmp(buf, data + 5000, 3) == 0, "the source is deleted");
+
+	fd = ufs_open("small", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, "small", 5) != 5);
+	unit_check(ufs_clone("small", "dst") == 0, "clone over a file");
+	unit_check(ufs_pread(dst, buf, size, 0) == 5 &&
+		   memcmp(buf, "small", 5) == 0, "its descriptor sees the new data");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_close(dst) != 0);
+	unit_fail_if(ufs_delete("small") != 0);
+	unit_fail_if(ufs_delete("dst") != 0);
+	free(buf);
+	free(data);
+
+	unit_test_finish();
+}
+
+static void
+test_snapshot(void)
+{
+	unit_test_start();
+
+	char buf[16];
+	int fd = ufs_open("kept", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, "before", 6) != 6);
+	int id = ufs_snapshot();
+	unit_check(id >= 0, "snapshot");
+
+	unit_fail_if(ufs_pwrite(fd, "after!", 6, 0) != 6);
+	unit_fail_if(ufs_close(ufs_open("new", UFS_CREATE)) != 0);
+	int id2 = ufs_snapshot();
+	unit_check(id2 != id, "another one");
+	unit_fail_if(ufs_delete("kept") != 0);
+
+	unit_check(ufs_snapshot_restore(id) == 0, "restore");
+	unit_check(ufs_open("new", 0) == -1, "later files are gone");
+	int kept = ufs_open("kept", 0);
+	unit_check(kept != -1 && ufs_read(kept, buf, sizeof(buf)) == 6 &&
+		   memcmp(buf, "before", 6) == 0, "the data is as it was");
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 0) == 6 &&
+		   memcmp(buf, "after!", 6) == 0, "the old descriptor still works");
+	unit_fail_if(ufs_pwrite(kept, "CHANGE", 6, 0) != 6);
+	unit_fail_if(ufs_close(kept) != 0);
+
+	unit_check(ufs_snapshot_restore(id2) == 0, "restore the other one");
+	kept = ufs_open("kept", 0);
+	unit_check(ufs_read(kept, buf, sizeof(buf)) == 6 &&
+		   memcmp(buf, "after!", 6) == 0, "its data");
+	unit_check(ufs_open("new", 0) != -1, "and files");
+
+	unit_check(ufs_snapshot_restore(id) == 0, "a snapshot can be restored again");
+	unit_check(ufs_pread(kept, buf, sizeof(buf), 0) == 6 &&
+		   memcmp(buf, "after!", 6) == 0, "open files are kept as they were");
+	int fd2 = ufs_open("kept", 0);
+	unit_check(ufs_read(fd2, buf, sizeof(buf)) == 6 &&
+		   memcmp(buf, "before", 6) == 0, "the restored file is not changed");
+
+	unit_check(ufs_snapshot_delete(id) == 0, "delete");
+	unit_check(ufs_snapshot_delete(id) == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARG, "no such snapshot");
+	unit_check(ufs_snapshot_restore(id) == -1, "can't restore a deleted one");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_close(kept) != 0);
+	unit_fail_if(ufs_delete("kept") != 0);
+	/* id2 is freed by ufs_destroy(). */
+
+	unit_test_finish();
+}
+
+static void
+test_image(void)
+{
+	unit_test_start();
+
+	const char *path = "ufs_test.img";
+	struct ufs *fs = ufs_new();
+	int fd = ufs_open_ctx(fs, "small", UFS_CREATE);
+	unit_fail_if(ufs_write_ctx(fs, fd, "hello", 5) != 5);
+	unit_fail_if(ufs_close_ctx(fs, fd) != 0);
+	fd = ufs_open_ctx(fs, "big", UFS_CREATE);
+	unit_fail_if(ufs_set_block_size_ctx(fs, fd, 8192) != 0);
+	const int size = 100000;
+	char *data = malloc(size);
+	for (int i = 0; i < size; ++i)
+		data[i] = i % 251;
+	unit_fail_if(ufs_write_ctx(fs, fd, data, size) != size);
+	unit_fail_if(ufs_close_ctx(fs, ufs_open_ctx(fs, "empty", UFS_CREATE)) != 0);
+	unit_check(ufs_save_ctx(fs, path) == 0, "save");
+	ufs_free(fs);
+
+	fs = ufs_new();
+	unit_check(ufs_load_ctx(fs, path) == 0, "load");
+	fd = ufs_open_ctx(fs, "big", 0);
+	unit_fail_if(fd == -1);
+	char *buf = malloc(size + 1);
+	unit_check(ufs_read_ctx(fs, fd, buf, size + 1) == size &&
+		   memcmp(buf, data, size) == 0, "the data is the same");
+	unit_check(ufs_set_block_size_ctx(fs, fd, 512) == -1,
+		   "and the block size");
+	unit_fail_if(ufs_pwrite_ctx(fs, fd, "xyz", 3, 10) != 3);
+	unit_fail_if(ufs_close_ctx(fs, fd) != 0);
+	fd = ufs_open_ctx(fs, "small", 0);
+	unit_check(ufs_read_ctx(fs, fd, buf, 10) == 5 &&
+		   memcmp(buf, "hello", 5) == 0, "small file too");
+	unit_fail_if(ufs_close_ctx(fs, fd) != 0);
+	fd = ufs_open_ctx(fs, "empty", 0);
+	unit_check(fd != -1 && ufs_read_ctx(fs, fd, buf, 10) == 0,
+		   "and the empty one");
+	unit_check(ufs_load_ctx(fs, path) == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARG, "only into an empty one");
+	ufs_free(fs);
+
+	fs = ufs_new();
+	unit_fail_if(ufs_load_ctx(fs, path) != 0);
+	fd = ufs_open_ctx(fs, "big", 0);
+	unit_check(ufs_pread_ctx(fs, fd, buf, 3, 10) == 3 &&
+		   memcmp(buf, data + 10, 3) == 0, "changes are not in the image");
+	ufs_free(fs);
+
+	FILE *f = fopen(path, "w");
+	fputs("not an image", f);
+	fclose(f);
+	fs = ufs_new();
+	unit_check(ufs_load_ctx(fs, path) == -1 && ufs_errno() == UFS_ERR_IO,
+		   "garbage is not loaded");
+	unit_check(ufs_open_ctx(fs, "big", 0) == -1, "nothing is");
+	unit_check(ufs_load_ctx(fs, "no/such/image") == -1 &&
+		   ufs_errno() == UFS_ERR_IO, "no image");
+	ufs_free(fs);
+	remove(path);
+	free(buf);
+	free(data);
+
+	unit_test_finish();
+}
+
+enum {
+	THREAD_COUNT = 4,
+	THREAD_ITERATIONS = 2000,
+};
+
+static void *
+thread_worker(void *arg)
+{
+	int id = (int)(intptr_t)arg;
+	char name[16];
+	snprintf(name, sizeof(name), "thread%d", id);
+	char data[100], buf[100];
+	memset(data, 'a' + id, sizeof(data));
+	long failed = 0;
+	int fd = ufs_open(name, UFS_CREATE);
+	if (fd == -1)
+		return (void *)1;
+	for (int i = 0; i < THREAD_ITERATIONS; ++i) {
+		size_t pos = (size_t)i * 37 % 5000;
+		if (ufs_pwrite(fd, data, sizeof(data), pos) != (ssize_t)sizeof(data) ||
+		    ufs_pread(fd, buf, sizeof(buf), pos) != (ssize_t)sizeof(buf) ||
+		    memcmp(buf, data, sizeof(buf)) != 0)
+			++failed;
+		/* The shared file churns the namespace and the fd table. */
+		int shared = ufs_open("shared", UFS_CREATE);
+		if (shared == -1 || ufs_pwrite(shared, data, 1, id) != 1 ||
+		    ufs_close(shared) != 0)
+			++failed;
+		/* Clones share the blocks the threads keep writing to. */
+		if (i % 64 == 0 && ufs_clone(name, "copy") != 0)
+			++failed;
+	}
+	if (ufs_close(fd) != 0 || ufs_delete(name) != 0)
+		++failed;
+	return (void *)failed;
+}
+
+static void
+test_threads(void)
+{
+	unit_test_start();
+
+	ufs_enable_concurrency();
+	pthread_t threads[THREAD_COUNT];
+	for (int i = 0; i < THREAD_COUNT; ++i) {
+		unit_fail_if(pthread_create(&threads[i], NULL, thread_worker,
+					    (void *)(intptr_t)i) != 0);
+	}
+	long failed = 0;
+	for (int i = 0; i < THREAD_COUNT; ++i) {
+		void *rc;
+		unit_fail_if(pthread_join(threads[i], &rc) != 0);
+		failed += (long)rc;
+	}
+	unit_check(failed == 0, "threads read what they wrote");
+
+	int fd = ufs_open("shared", 0);
+	unit_fail_if(fd == -1);
+	char buf[THREAD_COUNT];
+	unit_fail_if(ufs_read(fd, buf, sizeof(buf)) != (ssize_t)sizeof(buf));
+	int ok = 1;
+	for (int i = 0; i < THREAD_COUNT; ++i)
+		ok = ok && buf[i] == 'a' + i;
+	unit_check(ok, "each thread wrote its byte of the shared file");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("shared") != 0);
+	unit_fail_if(ufs_delete("copy") != 0);
+	unit_check(ufs_open("thread0", 0) == -1, "own files are deleted");
+
+	unit_test_finish();
+}
+
 int
 main(void)
 {
@@ -482,6 +1040,16 @@ main(void)
 	test_max_file_size();
 	test_rights();
 	test_resize();
+	test_sparse();
+	test_seek();
+	test_block_size();
+	test_many_files();
+	test_fd_reuse();
+	test_instances();
+	test_clone();
+	test_snapshot();
+	test_image();
+	test_threads();
 
 	/* Free the memory to make the memory leak detector happy. */
 	ufs_destroy();
@@ -0,0 +1,609 @@
+#include "userfs.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * userfs benchmarks. Each one is a separate test kind, selected with
+ * -t, all of them by default.
+ */
+
+struct alloc_stat {
+    uint64_t count;
+};
+
+/*
+ * Built with -Wl,--wrap for the allocation functions. The linker
+ * wrappers can't take a context, so the counter is a global.
+ */
+static struct alloc_stat alloc_stat;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *
+__wrap_malloc(size_t size)
+{
+    ++alloc_stat.count;
+    return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t count, size_t size)
+{
+    ++alloc_stat.count;
+    return __real_calloc(count, size);
+}
+
+void *
+__wrap_realloc(void *ptr, size_t size)
+{
+    ++alloc_stat.count;
+    return __real_realloc(ptr, size);
+}
+
+struct bench_opts {
+    /** File size in MB. */
+    size_t file_mb;
+    /** Bytes per operation. */
+    size_t io_size;
+    /** Block size of the files. */
+    size_t block_size;
+    /** Descriptors kept open. */
+    size_t fd_count;
+    /** Operations per test. */
+    size_t op_count;
+    /** The most threads of the threads test. */
+    size_t thread_count;
+    uint64_t seed;
+};
+
+static double
+now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t
+next_rand(uint64_t *state)
+{
+    /* xorshift64. */
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static void
+print_result(const char *name, size_t ops, size_t bytes, double elapsed)
+{
+    printf("%-16s %10zu %10.3f %12.0f", name, ops, elapsed, ops / elapsed);
+    if (bytes > 0)
+        printf(" %10.1f\n", bytes / elapsed / 1e6);
+    else
+        printf(" %10s\n", "-");
+}
+
+static int
+fill_file(const char *name, size_t size)
+{
+    int fd = ufs_open(name, UFS_CREATE);
+    char *buf = malloc(1 << 20);
+    for (size_t i = 0; i < (1 << 20); ++i)
+        buf[i] = 'a' + i % 26;
+    for (size_t done = 0; done < size;) {
+        size_t chunk = size - done < (1 << 20) ? size - done : (1 << 20);
+        if (ufs_write(fd, buf, chunk) != (ssize_t)chunk) {
+            printf("write failed: %d\n", ufs_errno());
+            exit(EXIT_FAILURE);
+        }
+        done += chunk;
+    }
+    free(buf);
+    return fd;
+}
+
+/** pread and pwrite at random offsets of a big file. */
+static void
+bench_random(const struct bench_opts *opts)
+{
+    size_t size = opts->file_mb << 20;
+    int fd = fill_file("random", size);
+    char *buf = malloc(opts->io_size);
+    memset(buf, 'x', opts->io_size);
+    uint64_t rand_state = opts->seed | 1;
+    size_t max_offset = size - opts->io_size;
+
+    double start = now_sec();
+    for (size_t i = 0; i < opts->op_count; ++i) {
+        size_t offset = next_rand(&rand_state) % max_offset;
+        if (ufs_pread(fd, buf, opts->io_size, offset) != (ssize_t)opts->io_size)
+            exit(EXIT_FAILURE);
+    }
+    print_result("random pread", opts->op_count, opts->op_count * opts->io_size,
+                 now_sec() - start);
+
+    start = now_sec();
+    for (size_t i = 0; i < opts->op_count; ++i) {
+        size_t offset = next_rand(&rand_state) % max_offset;
+        if (ufs_pwrite(fd, buf, opts->io_size, offset) != (ssize_t)opts->io_size)
+            exit(EXIT_FAILURE);
+    }
+    print_result("random pwrite", opts->op_count, opts->op_count * opts->io_size,
+                 now_sec() - start);
+
+    start = now_sec();
+    for (size_t i = 0; i < opts->op_count; ++i) {
+        size_t offset = next_rand(&rand_state) % max_offset;
+        ufs_seek(fd, offset, UFS_SEEK_SET);
+        if (ufs_read(fd, buf, opts->io_size) != (ssize_t)opts->io_size)
+            exit(EXIT_FAILURE);
+    }
+    print_result("seek+read", opts->op_count, opts->op_count * opts->io_size,
+                 now_sec() - start);
+
+    free(buf);
+    ufs_close(fd);
+    ufs_delete("random");
+}
+
+/** Write a big file front to back, then read it the same way. */
+static void
+bench_seq(const struct bench_opts *opts)
+{
+    size_t size = opts->file_mb << 20;
+    char *buf = malloc(opts->io_size);
+    memset(buf, 'x', opts->io_size);
+    size_t ops = size / opts->io_size;
+
+    int fd = ufs_open("seq", UFS_CREATE);
+    double start = now_sec();
+    for (size_t i = 0; i < ops; ++i) {
+        if (ufs_write(fd, buf, opts->io_size) != (ssize_t)opts->io_size)
+            exit(EXIT_FAILURE);
+    }
+    print_result("seq write", ops, ops * opts->io_size, now_sec() - start);
+
+    /* The blocks exist now, it is the copying only. */
+    ufs_seek(fd, 0, UFS_SEEK_SET);
+    start = now_sec();
+    for (size_t i = 0; i < ops; ++i) {
+        if (ufs_write(fd, buf, opts->io_size) != (ssize_t)opts->io_size)
+            exit(EXIT_FAILURE);
+    }
+    print_result("seq overwrite", ops, ops * opts->io_size, now_sec() - start);
+
+    ufs_seek(fd, 0, UFS_SEEK_SET);
+    start = now_sec();
+    for (size_t i = 0; i < ops; ++i) {
+        if (ufs_read(fd, buf, opts->io_size) != (ssize_t)opts->io_size)
+            exit(EXIT_FAILURE);
+    }
+    print_result("seq read", ops, ops * opts->io_size, now_sec() - start);
+
+    free(buf);
+    ufs_close(fd);
+    ufs_delete("seq");
+}
+
+/** Create, open and delete op_count files by name. */
+static void
+bench_names(const struct bench_opts *opts)
+{
+    char name[32];
+    uint64_t rand_state = opts->seed | 1;
+
+    double start = now_sec();
+    for (size_t i = 0; i < opts->op_count; ++i) {
+        snprintf(name, sizeof(name), "file%zu", i);
+        int fd = ufs_open(name, UFS_CREATE);
+        if (fd == -1)
+            exit(EXIT_FAILURE);
+        ufs_close(fd);
+    }
+    print_result("create", opts->op_count, 0, now_sec() - start);
+
+    start = now_sec();
+    for (size_t i = 0; i < opts->op_count; ++i) {
+        snprintf(name, sizeof(name), "file%zu", (size_t)(next_rand(&rand_state) % opts->op_count));
+        int fd = ufs_open(name, 0);
+        if (fd == -1)
+            exit(EXIT_FAILURE);
+        ufs_close(fd);
+    }
+    print_result("open", opts->op_count, 0, now_sec() - start);
+
+    start = now_sec();
+    for (size_t i = 0; i < opts->op_count; ++i) {
+        snprintf(name, sizeof(name), "file%zu", i);
+        if (ufs_delete(name) != 0)
+            exit(EXIT_FAILURE);
+    }
+    print_result("delete", opts->op_count, 0, now_sec() - start);
+}
+
+/**
+ * Keep fd_count descriptors open and churn them: close a random one
+ * and open a new one, which takes the lowest free fd.
+ */
+static void
+bench_fds(const struct bench_opts *opts)
+{
+    size_t fd_count = opts->fd_count;
+    int *fds = malloc(fd_count * sizeof(*fds));
+    uint64_t rand_state = opts->seed | 1;
+
+    double start = now_sec();
+    for (size_t i = 0; i < fd_count; ++i) {
+        fds[i] = ufs_open("fds", UFS_CREATE);
+        if (fds[i] == -1)
+            exit(EXIT_FAILURE);
+    }
+    print_result("open", fd_count, 0, now_sec() - start);
+
+    start = now_sec();
+    for (size_t i = 0; i < opts->op_count; ++i) {
+        size_t k = next_rand(&rand_state) % fd_count;
+        ufs_close(fds[k]);
+        fds[k] = ufs_open("fds", 0);
+        if (fds[k] == -1)
+            exit(EXIT_FAILURE);
+    }
+    print_result("close+open", opts->op_count, 0, now_sec() - start);
+
+    for (size_t i = 0; i < fd_count; ++i)
+        ufs_close(fds[i]);
+    ufs_delete("fds");
+    free(fds);
+}
+
+static size_t
+rss_bytes(void)
+{
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f == NULL)
+        return 0;
+    size_t total = 0, rss = 0;
+    if (fscanf(f, "%zu %zu", &total, &rss) != 2)
+        rss = 0;
+    fclose(f);
+    return rss * sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * Heap allocations and the memory above the data size for a big
+ * file, and how much of it is given back when it is deleted.
+ */
+static void
+bench_alloc(const struct bench_opts *opts)
+{
+    size_t size = opts->file_mb << 20;
+    size_t rss_start = rss_bytes();
+    uint64_t allocs_start = alloc_stat.count;
+    double start = now_sec();
+    int fd = fill_file("alloc", size);
+    double elapsed = now_sec() - start;
+    uint64_t allocs = alloc_stat.count - allocs_start;
+    size_t rss_full = rss_bytes();
+    ufs_close(fd);
+    ufs_delete("alloc");
+    size_t rss_end = rss_bytes();
+
+    print_result("fill", 1, size, elapsed);
+    printf("%-16s %10llu\n", "allocations", (unsigned long long)allocs);
+    printf("%-16s %10.1f%%\n", "rss overhead",
+           ((double)rss_full - rss_start - size) * 100.0 / size);
+    printf("%-16s %10.1f MB\n", "rss after delete", ((double)rss_end - rss_start) / (1 << 20));
+}
+
+/**
+ * Clone a big file: the time and the memory of the clone itself,
+ * then of the random writes into it, which copy the shared blocks
+ * on the first touch.
+ */
+static void
+bench_clone(const struct bench_opts *opts)
+{
+    size_t size = opts->file_mb << 20;
+    ufs_close(fill_file("clone_src", size));
+    size_t rss_start = rss_bytes();
+    double start = now_sec();
+    if (ufs_clone("clone_src", "clone") != 0)
+        exit(EXIT_FAILURE);
+    print_result("clone", 1, size, now_sec() - start);
+    printf("%-16s %10.1f MB\n", "clone rss", ((double)rss_bytes() - rss_start) / (1 << 20));
+
+    int fd = ufs_open("clone", 0);
+    char *buf = malloc(opts->io_size);
+    memset(buf, 'x', opts->io_size);
+    uint64_t rand_state = opts->seed | 1;
+    size_t max_offset = size - opts->io_size;
+    for (int pass = 0; pass < 2; ++pass) {
+        start = now_sec();
+        for (size_t i = 0; i < opts->op_count; ++i) {
+            size_t offset = next_rand(&rand_state) % max_offset;
+            if (ufs_pwrite(fd, buf, opts->io_size, offset) != (ssize_t)opts->io_size)
+                exit(EXIT_FAILURE);
+        }
+        print_result(pass == 0 ? "cow pwrite" : "pwrite", opts->op_count,
+                     opts->op_count * opts->io_size, now_sec() - start);
+    }
+    printf("%-16s %10.1f MB\n", "rss after", ((double)rss_bytes() - rss_start) / (1 << 20));
+    free(buf);
+    ufs_close(fd);
+    ufs_delete("clone");
+    ufs_delete("clone_src");
+}
+
+/**
+ * A file of file_mb with io_size bytes of data per megabyte, the
+ * rest are holes: the memory it takes, and a shrink which frees
+ * all of it.
+ */
+static void
+bench_sparse(const struct bench_opts *opts)
+{
+    size_t size = opts->file_mb << 20;
+    char *buf = malloc(opts->io_size);
+    memset(buf, 'x', opts->io_size);
+    size_t rss_start = rss_bytes();
+    int fd = ufs_open("sparse", UFS_CREATE);
+    size_t ops = 0;
+    double start = now_sec();
+    for (size_t offset = 0; offset + opts->io_size <= size; offset += 1 << 20, ++ops) {
+        if (ufs_pwrite(fd, buf, opts->io_size, offset) != (ssize_t)opts->io_size)
+            exit(EXIT_FAILURE);
+    }
+    print_result("sparse pwrite", ops, ops * opts->io_size, now_sec() - start);
+    printf("%-16s %10.1f MB of %zu MB\n", "rss", ((double)rss_bytes() - rss_start) / (1 << 20),
+           opts->file_mb);
+
+    start = now_sec();
+    if (ufs_resize(fd, 0) != 0)
+        exit(EXIT_FAILURE);
+    print_result("shrink", 1, 0, now_sec() - start);
+    printf("%-16s %10.1f MB\n", "rss after", ((double)rss_bytes() - rss_start) / (1 << 20));
+    free(buf);
+    ufs_close(fd);
+    ufs_delete("sparse");
+}
+
+struct thread_arg {
+    const struct bench_opts *opts;
+    /** A file system shared by all the threads, or the thread's own one. */
+    struct ufs *fs;
+    size_t id;
+    size_t op_count;
+};
+
+static void
+fill_file_ctx(struct ufs *fs, const char *name, size_t size)
+{
+    int fd = ufs_open_ctx(fs, name, UFS_CREATE);
+    char buf[4096];
+    memset(buf, 'a', sizeof(buf));
+    for (size_t done = 0; done < size; done += sizeof(buf)) {
+        if (ufs_write_ctx(fs, fd, buf, sizeof(buf)) != (ssize_t)sizeof(buf)) {
+            printf("write failed: %d\n", ufs_errno());
+            exit(EXIT_FAILURE);
+        }
+    }
+    ufs_close_ctx(fs, fd);
+}
+
+static void *
+thread_worker(void *data)
+{
+    const struct thread_arg *arg = data;
+    const struct bench_opts *opts = arg->opts;
+    struct ufs *fs = arg->fs;
+    char name[32];
+    snprintf(name, sizeof(name), "thread%zu", arg->id);
+    /* The files are filled before the start, it is the I/O only. */
+    int fd = ufs_open_ctx(fs, name, 0);
+    size_t max_offset = (opts->file_mb << 20) - opts->io_size;
+    char *buf = malloc(opts->io_size);
+    memset(buf, 'x', opts->io_size);
+    uint64_t rand_state = (opts->seed + arg->id) | 1;
+    for (size_t i = 0; i < arg->op_count; ++i) {
+        size_t offset = next_rand(&rand_state) % max_offset;
+        ssize_t rc = i % 2 == 0 ? ufs_pread_ctx(fs, fd, buf, opts->io_size, offset) :
+                     ufs_pwrite_ctx(fs, fd, buf, opts->io_size, offset);
+        if (rc != (ssize_t)opts->io_size)
+            exit(EXIT_FAILURE);
+        /* Some namespace and descriptor table traffic as well. */
+        if (i % 16 == 0) {
+            int other = ufs_open_ctx(fs, name, 0);
+            if (other == -1)
+                exit(EXIT_FAILURE);
+            ufs_close_ctx(fs, other);
+        }
+    }
+    free(buf);
+    ufs_close_ctx(fs, fd);
+    return NULL;
+}
+
+/**
+ * Random pread and pwrite by 1, 2, 4 ... thread_count threads, each
+ * on its own file, with the same total number of operations. The
+ * files are either in one file system with the locking on, or each
+ * in a file system of its own thread, without locks.
+ */
+static void
+bench_threads(const struct bench_opts *opts)
+{
+    size_t size = opts->file_mb << 20;
+    pthread_t *threads = malloc(opts->thread_count * sizeof(*threads));
+    struct thread_arg *args = malloc(opts->thread_count * sizeof(*args));
+    struct ufs *shared = ufs_new();
+    ufs_enable_concurrency_ctx(shared);
+    ufs_set_default_block_size_ctx(shared, opts->block_size);
+    struct ufs **own = malloc(opts->thread_count * sizeof(*own));
+    char name[32];
+    for (size_t i = 0; i < opts->thread_count; ++i) {
+        snprintf(name, sizeof(name), "thread%zu", i);
+        fill_file_ctx(shared, name, size);
+        own[i] = ufs_new();
+        ufs_set_default_block_size_ctx(own[i], opts->block_size);
+        fill_file_ctx(own[i], name, size);
+    }
+    for (int is_shared = 1; is_shared >= 0; --is_shared) {
+        for (size_t count = 1; count <= opts->thread_count; count *= 2) {
+            double start = now_sec();
+            for (size_t i = 0; i < count; ++i) {
+                struct ufs *fs = is_shared ? shared : own[i];
+                args[i] = (struct thread_arg){opts, fs, i, opts->op_count / count};
+                pthread_create(&threads[i], NULL, thread_worker, &args[i]);
+            }
+            for (size_t i = 0; i < count; ++i)
+                pthread_join(threads[i], NULL);
+            size_t ops = opts->op_count / count * count;
+            snprintf(name, sizeof(name), "%zu %s", count, is_shared ? "shared" : "own");
+            print_result(name, ops, ops * opts->io_size, now_sec() - start);
+        }
+    }
+    for (size_t i = 0; i < opts->thread_count; ++i)
+        ufs_free(own[i]);
+    ufs_free(shared);
+    free(own);
+    free(args);
+    free(threads);
+}
+
+/**
+ * Save a big file into an image and load it back. The load maps the
+ * data, so it is quick, and the data is read from the image on the
+ * first touch. Compared with writing the file anew.
+ */
+static void
+bench_image(const struct bench_opts *opts)
+{
+    const char *path = "ufs_bench.img";
+    size_t size = opts->file_mb << 20;
+    struct ufs *fs = ufs_new();
+    ufs_set_default_block_size_ctx(fs, opts->block_size);
+    double start = now_sec();
+    fill_file_ctx(fs, "image", size);
+    print_result("write", 1, size, now_sec() - start);
+
+    start = now_sec();
+    if (ufs_save_ctx(fs, path) != 0)
+        exit(EXIT_FAILURE);
+    print_result("save", 1, size, now_sec() - start);
+    ufs_free(fs);
+
+    fs = ufs_new();
+    start = now_sec();
+    if (ufs_load_ctx(fs, path) != 0)
+        exit(EXIT_FAILURE);
+    print_result("load", 1, 0, now_sec() - start);
+
+    int fd = ufs_open_ctx(fs, "image", 0);
+    char *buf = malloc(1 << 20);
+    start = now_sec();
+    while (ufs_read_ctx(fs, fd, buf, 1 << 20) > 0)
+        ;
+    print_result("first read", 1, size, now_sec() - start);
+    ufs_seek_ctx(fs, fd, 0, UFS_SEEK_SET);
+    start = now_sec();
+    while (ufs_read_ctx(fs, fd, buf, 1 << 20) > 0)
+        ;
+    print_result("second read", 1, size, now_sec() - start);
+    free(buf);
+    ufs_free(fs);
+    unlink(path);
+}
+
+struct bench {
+    const char *name;
+    void (*f)(const struct bench_opts *opts);
+};
+
+static const struct bench benches[] = {
+    {"random", bench_random},
+    {"seq", bench_seq},
+    {"names", bench_names},
+    {"fds", bench_fds},
+    {"alloc", bench_alloc},
+    {"clone", bench_clone},
+    {"sparse", bench_sparse},
+    {"threads", bench_threads},
+    {"image", bench_image},
+};
+
+int
+main(int argc, char **argv)
+{
+    struct bench_opts opts = {
+        .file_mb = 100,
+        .io_size = 4096,
+        .block_size = UFS_MIN_BLOCK_SIZE,
+        .fd_count = 100000,
+        .op_count = 1000000,
+        .thread_count = 8,
+        .seed = 42,
+    };
+    const char *kind = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:m:b:B:f:n:s:j:")) != -1) {
+        switch (opt) {
+        case 't':
+            kind = optarg;
+            break;
+        case 'm':
+            opts.file_mb = atol(optarg);
+            break;
+        case 'b':
+            opts.io_size = atol(optarg);
+            break;
+        case 'B':
+            opts.block_size = atol(optarg);
+            break;
+        case 'f':
+            opts.fd_count = atol(optarg);
+            break;
+        case 'n':
+            opts.op_count = atol(optarg);
+            break;
+        case 's':
+            opts.seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'j':
+            opts.thread_count = atol(optarg);
+            break;
+        default:
+            printf("Usage: %s [-t <test>] [-m <file MB>] [-b <bytes per op>] "
+                   "[-B <block size>] [-f <open fds>] [-n <ops>] "
+                   "[-s <seed>] [-j <max threads>]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (opts.file_mb == 0 || (opts.file_mb << 20) <= opts.io_size) {
+        printf("The file must be bigger than one operation\n");
+        return EXIT_FAILURE;
+    }
+
+    if (ufs_set_default_block_size(opts.block_size) != 0) {
+        printf("Bad block size\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%-16s %10s %10s %12s %10s\n", "test", "ops", "seconds", "ops/sec", "MB/s");
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); ++i) {
+        if (kind == NULL || strcmp(kind, benches[i].name) == 0)
+            benches[i].f(&opts);
+    }
+    ufs_destroy();
+    return EXIT_SUCCESS;
+}
@@ -1,77 +1,290 @@
 #include "userfs.h"
 #include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 enum {
-    BLOCK_SIZE = 512,
     MAX_FILE_SIZE = 1024 * 1024 * 100,
+    /** Initial capacity of the name table, a power of 2. */
+    NAME_TABLE_MIN_CAPACITY = 64,
+    /** Old table slots moved to the new one per namespace operation. */
+    NAME_TABLE_MIGRATE_STEP = 64,
+    /** The name table is split into 2^NAME_SHARD_SHIFT shards by hash. */
+    NAME_SHARD_SHIFT = 4,
+    NAME_SHARD_COUNT = 1 << NAME_SHARD_SHIFT,
+    /** Descriptors allocated at once for the descriptor pool. */
+    FILEDESC_CHUNK_SIZE = 64,
+    /** The descriptor table is up to FD_CHUNK_COUNT chunks of 2^FD_CHUNK_SHIFT slots. */
+    FD_CHUNK_SHIFT = 10,
+    FD_CHUNK_SIZE = 1 << FD_CHUNK_SHIFT,
+    FD_CHUNK_COUNT = 4096,
+    /** Each level of the block index resolves this many bits. */
+    INDEX_SHIFT = 6,
+    INDEX_FANOUT = 1 << INDEX_SHIFT,
+    /** log2 of UFS_MIN_BLOCK_SIZE and UFS_MAX_BLOCK_SIZE. */
+    BLOCK_SHIFT_MIN = 9,
+    BLOCK_SHIFT_MAX = 21,
+    /** Data bytes in a slab of blocks, unless one block is bigger. */
+    SLAB_DATA_SIZE = 2 * 1024 * 1024,
+    IMAGE_VERSION = 1,
+    /**
+     * File data in an image starts at a multiple of this, or of
+     * the block size if it is bigger. It is a multiple of the page
+     * size on the known architectures, so the data can be mapped.
+     */
+    IMAGE_DATA_ALIGN = 64 * 1024,
+    /** Blocks written by one pwritev() at most. */
+    IMAGE_IOV_COUNT = 512,
 };
 
-/** Global error code. Set from any function on any error. */
-static enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
+/** "UFSIMAGE" in a little endian number. */
+#define IMAGE_MAGIC 0x4547414d49534655ull
+
+/** Error code of the thread. Set from any function on any error. */
+static __thread enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
+
+struct slab;
 
+/**
+ * Header of a block. The headers and the data of the blocks are
+ * in two parallel arrays of a slab, the data is found by the
+ * index of the header.
+ */
 struct block {
-    /** Block memory. */
-    char *memory;
-    /** How many bytes are occupied. */
-    int occupied;
-    /** Next block in the file. */
-    struct block *next;
-    /** Previous block in the file. */
-    struct block *prev;
+    struct slab *slab;
+    union {
+        /** Next free block of the slab, while the block is free. */
+        struct block *next_free;
+        /**
+         * Files holding the block, while it is used. Clones and
+         * snapshots share the blocks, a shared block is copied
+         * before a write.
+         */
+        uint32_t refs;
+    };
+};
 
-    /* PUT HERE OTHER MEMBERS */
-    int index;
+/**
+ * A chunk of blocks of one size, mmap'ed at once. The data of the
+ * blocks goes first, so it keeps the page alignment, then this
+ * header with the block headers.
+ *
+ * The blocks of a file loaded from an image are in a slab of their
+ * own, without a cache. Its data is a private mapping of the file
+ * data in the image, and the header is malloc'ed. Its blocks are
+ * not reused, the slab goes away with the last of them.
+ */
+struct slab {
+    /** Slabs of the cache which have free blocks. */
+    struct slab *next;
+    struct slab *prev;
+    /** NULL for a slab of an image. */
+    struct block_cache *cache;
+    char *data;
+    /** log2 of the block size, a copy of the cache one. */
+    int shift;
+    size_t map_size;
+    /** Blocks freed after use. Their data must be zeroed again. */
+    struct block *free_list;
+    /** Blocks from this one on were never used and are zero. */
+    uint32_t fresh_pos;
+    uint32_t used;
+    uint32_t capacity;
+    struct block blocks[];
+};
+
+/** Slabs of one block size. */
+struct block_cache {
+    pthread_mutex_t lock;
+    int shift;
+    /** Slabs with free blocks. The full ones are not linked anywhere. */
+    struct slab *partial;
+};
+
+/**
+ * A node of the block index. The slots of the lowest level point
+ * at blocks, the slots of the others at the nodes below.
+ */
+struct index_node {
+    void *slots[INDEX_FANOUT];
 };
 
+struct ufs;
+struct snapshot;
+
 // This is actually struct inode
 struct file {
-    /** Double-linked list of file blocks. */
-    struct block *block_list;
+    /** The file system of the file. */
+    struct ufs *fs;
+    /**
+     * Radix tree from a block number to the block. A file offset
+     * is found in index_height steps, no matter how big the file
+     * is.
+     */
+    struct index_node *index_root;
+    /** The tree covers INDEX_FANOUT^index_height blocks. */
+    int index_height;
+    /**
+     * File size in bytes. The blocks of holes are missing and read
+     * as zeros. The bytes of the last block past the end are zero.
+     */
+    size_t size;
+    /** log2 of the block size. Fixed once the file has data. */
+    int block_shift;
+    /** Taken for reading by reads, for writing by anything changing the data. */
+    pthread_rwlock_t lock;
     /**
-     * Last block in the list above for fast access to the end
-     * of file.
+     * How many file descriptors are opened on the file. Changed
+     * under the lock of the name shard, like is_deleted.
      */
-    struct block *last_block;
-    /** How many file descriptors are opened on the file. */
     int refs;
     /** File name. */
     char *name;
-    /** Files are stored in a double-linked list. */
-    struct file *next;
-    struct file *prev;
+    /** Hash of the name, for the name table. */
+    uint32_t name_hash;
 
     /* PUT HERE OTHER MEMBERS */
     bool is_deleted;
-    /*size_t size;*/
-    /*size_t num_blocks;*/
+    /** Open descriptors of the file, to move them on a shrink. Under the lock. */
+    struct filedesc *descs;
+};
+
+/**
+ * A slot of the name table. The hash is stored inline, so probing
+ * touches only the slot array and compares the names only on a
+ * hash match.
+ */
+struct name_slot {
+    uint32_t hash;
+    /** NULL if the slot is free, NAME_TOMBSTONE if it was freed. */
+    struct file *file;
+};
+
+/** Marks a slot of a deleted name, so probing goes on past it. */
+#define NAME_TOMBSTONE ((struct file *)(uintptr_t)1)
+
+/**
+ * Open addressing hash table of the files by name, with linear
+ * probing. When it gets full a new table for twice the files is allocated,
+ * and the old one is moved into it a few slots per operation, so
+ * no single operation pays for rehashing all the files.
+ */
+struct name_table {
+    struct name_slot *slots;
+    /** Power of 2. */
+    uint32_t capacity;
+    /** Slots taken by files and tombstones. */
+    uint32_t used;
+    /** Files in both tables. */
+    uint32_t count;
+    /** The table being moved into the new one, or NULL. */
+    struct name_slot *old_slots;
+    uint32_t old_capacity;
+    /** Old slots before this one are moved already. */
+    uint32_t old_pos;
 };
 
-/** List of all files. */
-static struct file *file_list = NULL;
+/** A part of the namespace, for the names with the same top hash bits. */
+struct name_shard {
+    pthread_mutex_t lock;
+    struct name_table table;
+};
 
 // This is actually struct file
 struct filedesc {
     struct file *file;
 
     /* PUT HERE OTHER MEMBERS */
-    struct block *block;
-    int offset;
+    /**
+     * Position of the next read or write. Can be beyond the end.
+     * Not guarded: threads sharing a descriptor should use
+     * ufs_pread() and ufs_pwrite().
+     */
+    size_t pos;
     int access_mode;
+    /** Next descriptor in the pool free list. */
+    struct filedesc *next_free;
+    /** Descriptors of the same file. */
+    struct filedesc *next_in_file;
+    struct filedesc *prev_in_file;
+};
+
+/** Descriptors are allocated in chunks and recycled via a free list. */
+struct filedesc_chunk {
+    struct filedesc_chunk *next;
+    struct filedesc descs[FILEDESC_CHUNK_SIZE];
+};
+
+/** The files of a namespace at some moment. */
+struct snapshot {
+    struct snapshot *next;
+    int id;
+    uint32_t file_count;
+    /** Copies of the files, out of the namespace. They share the blocks. */
+    struct file **files;
 };
 
 /**
- * An array of file descriptors. When a file descriptor is
- * created, its pointer drops here. When a file descriptor is
- * closed, its place in this array is set to NULL and can be
- * taken by next ufs_open() call.
+ * A file system. Instances share nothing, so each one can be used
+ * by its own thread without locking. It is cache line aligned, so
+ * the instances don't share the lines either.
  */
-static struct filedesc **file_descriptors = NULL;
-static int file_descriptor_count = 0;
-static int file_descriptor_capacity = 0;
+struct ufs {
+    /** Set by ufs_enable_concurrency(). Without it no locks are taken. */
+    _Alignas(64) bool is_concurrent;
+    /** log2 of the block size of new files. */
+    int default_block_shift;
+    struct block_cache block_caches[BLOCK_SHIFT_MAX - BLOCK_SHIFT_MIN + 1];
+    /** All files which are not deleted. */
+    struct name_shard name_shards[NAME_SHARD_COUNT];
+
+    struct filedesc *filedesc_free_list;
+    struct filedesc_chunk *filedesc_chunks;
+    /**
+     * An array of file descriptors, in chunks. When a file
+     * descriptor is created, its pointer drops here. When a file
+     * descriptor is closed, its place in this array is set to
+     * NULL and can be taken by next ufs_open() call. The chunks
+     * never move, so a lookup needs no lock even while another
+     * thread grows the table: the chunk pointers, the slots and
+     * the capacity are published with release stores.
+     */
+    struct filedesc **fd_chunks[FD_CHUNK_COUNT];
+    int file_descriptor_capacity;
+    /** Guards the free descriptor bitmap and the descriptor pool. */
+    pthread_mutex_t fd_lock;
+    /**
+     * Free descriptors: a bit per slot of the array above, and a
+     * summary bit per 64-bit word of them, set while the word has
+     * a free bit. The lowest free fd is the first non-zero summary
+     * word and two find-first-set instructions. Summary words
+     * before the hint are known to be zero, so the scan doesn't
+     * start over each time.
+     */
+    uint64_t *fd_free_bits;
+    uint64_t *fd_free_summary;
+    int fd_summary_hint;
+    /** Snapshots of the namespace, the latest first. */
+    struct snapshot *snapshots;
+    int next_snapshot_id;
+    /** Guards the snapshot list. */
+    pthread_mutex_t snapshot_lock;
+};
+
+/** The file system of the functions without a context. */
+static struct ufs default_ufs = {
+    .default_block_shift = BLOCK_SHIFT_MIN,
+};
 
 enum ufs_error_code
 ufs_errno()
@@ -79,284 +292,1755 @@ ufs_errno()
     return ufs_error_code;
 }
 
-static struct file *
-create_file(const char *filename)
+static void
+mutex_lock(struct ufs *fs, pthread_mutex_t *lock)
 {
-    struct file *last_file = file_list;
-    while (last_file && last_file->next) {
-        last_file = last_file->next;
+    if (fs->is_concurrent) {
+        pthread_mutex_lock(lock);
     }
+}
 
-    struct file *new_file = calloc(1, sizeof(*new_file));
+static void
+mutex_unlock(struct ufs *fs, pthread_mutex_t *lock)
+{
+    if (fs->is_concurrent) {
+        pthread_mutex_unlock(lock);
+    }
+}
 
-    size_t len = strlen(filename);
-    new_file->name = malloc((len + 1) * sizeof(char));
-    strncpy(new_file->name, filename, len + 1);
+static void
+file_lock_read(struct file *file)
+{
+    if (file->fs->is_concurrent) {
+        pthread_rwlock_rdlock(&file->lock);
+    }
+}
 
-    new_file->prev = last_file;
+static void
+file_lock_write(struct file *file)
+{
+    if (file->fs->is_concurrent) {
+        pthread_rwlock_wrlock(&file->lock);
+    }
+}
 
-    if (last_file) {
-        last_file->next = new_file;
-    } else {
-        file_list = new_file;
+static void
+file_unlock(struct file *file)
+{
+    if (file->fs->is_concurrent) {
+        pthread_rwlock_unlock(&file->lock);
     }
+}
 
-    return new_file;
+static struct name_shard *
+name_shard(struct ufs *fs, uint32_t hash)
+{
+    return &fs->name_shards[hash >> (32 - NAME_SHARD_SHIFT)];
 }
 
-int
-ufs_open(const char *filename, int flags)
+static uint32_t
+name_hash(const char *name)
 {
-    struct file *current_file = file_list;
-    while (current_file) {
-        if (strcmp(current_file->name, filename) == 0) {
-            break;
-        }
-        current_file = current_file->next;
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (; *name != 0; ++name) {
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
     }
+    return hash;
+}
 
-    // File with the given filename doesn't exist
-    if (current_file == NULL) {
-        if ((flags & UFS_CREATE) == 0) {
-            ufs_error_code = UFS_ERR_NO_FILE;
-            return -1;
+/** Slot of the name in the slot array, or NULL. */
+static struct name_slot *
+name_slots_find(struct name_slot *slots, uint32_t capacity, const char *name, uint32_t hash)
+{
+    if (slots == NULL) {
+        return NULL;
+    }
+    for (uint32_t i = hash & (capacity - 1);; i = (i + 1) & (capacity - 1)) {
+        struct name_slot *slot = &slots[i];
+        if (slot->file == NULL) {
+            return NULL;
         }
-        if ((flags & UFS_READ_ONLY) != 0) {
-            ufs_error_code = UFS_ERR_NO_PERMISSION;
-            return -1;
+        if (slot->hash == hash && slot->file != NAME_TOMBSTONE &&
+            strcmp(slot->file->name, name) == 0) {
+            return slot;
         }
-        current_file = create_file(filename);
     }
+}
 
-    struct filedesc *new_file_descriptor = calloc(1, sizeof(*new_file_descriptor));
-    new_file_descriptor->file = current_file;
-    new_file_descriptor->block = current_file->block_list;
-
-    if ((flags & UFS_READ_ONLY) != 0) {
-        new_file_descriptor->access_mode = UFS_READ_ONLY;
-    } else if ((flags & UFS_WRITE_ONLY) != 0) {
-        new_file_descriptor->access_mode = UFS_WRITE_ONLY;
-    } else {
-        new_file_descriptor->access_mode = UFS_READ_WRITE;
+/** Put a file, which is known to be absent, into the slot array. */
+static void
+name_slots_insert(struct name_slot *slots, uint32_t capacity, struct file *file)
+{
+    uint32_t i = file->name_hash & (capacity - 1);
+    while (slots[i].file != NULL && slots[i].file != NAME_TOMBSTONE) {
+        i = (i + 1) & (capacity - 1);
     }
+    slots[i].hash = file->name_hash;
+    slots[i].file = file;
+}
 
-    current_file->refs++;
-
-    // Search for available file descriptors
-    int fd = file_descriptor_count;
-    for (int i = 0; i < file_descriptor_count; ++i) {
-        if (file_descriptors[i] == NULL) {
-            fd = i;
-            break;
-        }
+/** Move up to @a count slots of the old table into the new one. */
+static void
+name_table_migrate(struct name_table *t, uint32_t count)
+{
+    if (t->old_slots == NULL) {
+        return;
     }
-
-    // No available file descriptors, so allocate more
-    if (fd == file_descriptor_count) {
-        if (file_descriptor_count >= file_descriptor_capacity) {
-            file_descriptor_capacity = (file_descriptor_capacity + 1) * 2;
-            file_descriptors = realloc(file_descriptors, file_descriptor_capacity * sizeof(*file_descriptors));
+    for (; count > 0 && t->old_pos < t->old_capacity; --count, ++t->old_pos) {
+        struct name_slot *slot = &t->old_slots[t->old_pos];
+        if (slot->file != NULL && slot->file != NAME_TOMBSTONE) {
+            name_slots_insert(t->slots, t->capacity, slot->file);
+            t->used++;
         }
-        file_descriptor_count++;
     }
-
-    file_descriptors[fd] = new_file_descriptor;
-    return fd;
+    if (t->old_pos == t->old_capacity) {
+        free(t->old_slots);
+        t->old_slots = NULL;
+        t->old_capacity = 0;
+    }
 }
 
-static struct block *
-create_block(struct file *file)
+static struct file *
+name_table_find(struct name_table *t, const char *name, uint32_t hash, struct name_slot **out_slot)
 {
-    struct block *new_block = calloc(1, sizeof(*new_block));
-    new_block->memory = malloc(BLOCK_SIZE * sizeof(char));
-    new_block->prev = file->last_block;
-    new_block->index = file->last_block ? file->last_block->index + 1 : 0;
-    if (file->last_block) {
-        file->last_block->next = new_block;
+    name_table_migrate(t, NAME_TABLE_MIGRATE_STEP);
+    struct name_slot *slot = name_slots_find(t->slots, t->capacity, name, hash);
+    if (slot == NULL) {
+        slot = name_slots_find(t->old_slots, t->old_capacity, name, hash);
+    }
+    if (out_slot != NULL) {
+        *out_slot = slot;
     }
-    file->last_block = new_block;
-    /*file->num_blocks++;*/
-    return new_block;
+    return slot != NULL ? slot->file : NULL;
 }
 
-ssize_t
-ufs_write(int fd, const char *buf, size_t size)
+static void
+name_table_insert(struct name_table *t, struct file *file)
 {
-    if (fd < 0 || fd >= file_descriptor_count || file_descriptors[fd] == NULL) {
-        ufs_error_code = UFS_ERR_NO_FILE;
-        return -1;
+    // Keep the load under 3/4, counting the tombstones - they lengthen the probes too
+    if ((t->used + 1) * 4 > t->capacity * 3) {
+        // Only one old table at a time
+        name_table_migrate(t, UINT32_MAX);
+        // Sized by the live files, so create/delete churn doesn't grow it
+        uint32_t capacity = NAME_TABLE_MIN_CAPACITY;
+        while (capacity < (t->count + 1) * 2) {
+            capacity *= 2;
+        }
+        t->old_slots = t->slots;
+        t->old_capacity = t->capacity;
+        t->old_pos = 0;
+        t->slots = calloc(capacity, sizeof(*t->slots));
+        t->capacity = capacity;
+        t->used = 0;
     }
+    name_slots_insert(t->slots, t->capacity, file);
+    t->used++;
+    t->count++;
+}
 
-    struct filedesc *filedesc = file_descriptors[fd];
-    struct file *file = filedesc->file;
+static void
+name_table_destroy(struct name_table *t)
+{
+    name_table_migrate(t, UINT32_MAX);
+    free(t->slots);
+    memset(t, 0, sizeof(*t));
+}
 
-    if (filedesc->access_mode == UFS_READ_ONLY) {
-        ufs_error_code = UFS_ERR_NO_PERMISSION;
-        return -1;
+static int
+fd_summary_count(int capacity)
+{
+    return (capacity / 64 + 63) / 64;
+}
+
+static void
+fd_mark_free(struct ufs *fs, int fd)
+{
+    int word = fd / 64;
+    fs->fd_free_bits[word] |= (uint64_t)1 << (fd % 64);
+    fs->fd_free_summary[word / 64] |= (uint64_t)1 << (word % 64);
+    if (word / 64 < fs->fd_summary_hint) {
+        fs->fd_summary_hint = word / 64;
     }
+}
 
-    if (file->block_list == NULL) {
-        file->block_list = create_block(file);
-        filedesc->block = file->block_list;
+static void
+fd_mark_used(struct ufs *fs, int fd)
+{
+    int word = fd / 64;
+    fs->fd_free_bits[word] &= ~((uint64_t)1 << (fd % 64));
+    if (fs->fd_free_bits[word] == 0) {
+        fs->fd_free_summary[word / 64] &= ~((uint64_t)1 << (word % 64));
     }
+}
 
-    int fd_position = filedesc->block->index * BLOCK_SIZE + filedesc->offset;
-    if (fd_position + size > MAX_FILE_SIZE) {
-        ufs_error_code = UFS_ERR_NO_MEM;
+/** Double the descriptor table. The new slots are free. Returns -1 at the limit. */
+static int
+fd_table_grow(struct ufs *fs)
+{
+    int old_capacity = fs->file_descriptor_capacity;
+    int capacity = old_capacity == 0 ? FD_CHUNK_SIZE : old_capacity * 2;
+    if (capacity > FD_CHUNK_SIZE * FD_CHUNK_COUNT) {
         return -1;
     }
+    for (int i = old_capacity >> FD_CHUNK_SHIFT; i < capacity >> FD_CHUNK_SHIFT; ++i) {
+        struct filedesc **chunk = calloc(FD_CHUNK_SIZE, sizeof(*chunk));
+        __atomic_store_n(&fs->fd_chunks[i], chunk, __ATOMIC_RELEASE);
+    }
+    fs->fd_free_bits = realloc(fs->fd_free_bits, capacity / 64 * sizeof(*fs->fd_free_bits));
+    int old_summary_count = fd_summary_count(old_capacity);
+    int summary_count = fd_summary_count(capacity);
+    fs->fd_free_summary = realloc(fs->fd_free_summary, summary_count * sizeof(*fs->fd_free_summary));
+    memset(fs->fd_free_summary + old_summary_count, 0,
+           (summary_count - old_summary_count) * sizeof(*fs->fd_free_summary));
+    for (int word = old_capacity / 64; word < capacity / 64; ++word) {
+        fs->fd_free_bits[word] = UINT64_MAX;
+        fs->fd_free_summary[word / 64] |= (uint64_t)1 << (word % 64);
+    }
+    if (old_capacity / 64 / 64 < fs->fd_summary_hint) {
+        fs->fd_summary_hint = old_capacity / 64 / 64;
+    }
+    __atomic_store_n(&fs->file_descriptor_capacity, capacity, __ATOMIC_RELEASE);
+    return 0;
+}
 
-    size_t written = 0;
-    while (written < size) {
-        if (filedesc->offset == BLOCK_SIZE) {
-            if (!filedesc->block->next) {
-                filedesc->block->next = create_block(file);
+/** Take the lowest free descriptor number, or -1 if there are too many. */
+static int
+fd_alloc(struct ufs *fs)
+{
+    while (true) {
+        int summary_count = fd_summary_count(fs->file_descriptor_capacity);
+        for (; fs->fd_summary_hint < summary_count; ++fs->fd_summary_hint) {
+            uint64_t summary = fs->fd_free_summary[fs->fd_summary_hint];
+            if (summary == 0) {
+                continue;
             }
-            filedesc->block = filedesc->block->next;
-            filedesc->offset = 0;
+            int word = fs->fd_summary_hint * 64 + __builtin_ctzll(summary);
+            int fd = word * 64 + __builtin_ctzll(fs->fd_free_bits[word]);
+            fd_mark_used(fs, fd);
+            return fd;
         }
-        filedesc->block->memory[filedesc->offset++] = buf[written++];
-        if (filedesc->offset > filedesc->block->occupied) {
-            filedesc->block->occupied++;
-            /*if (filedesc->block == file->last_block) {*/
-                /*file->size++;*/
-            /*}*/
+        if (fd_table_grow(fs) != 0) {
+            return -1;
         }
     }
+}
 
-    return written;
+static struct filedesc **
+fd_slot(struct ufs *fs, int fd)
+{
+    struct filedesc **chunk = __atomic_load_n(&fs->fd_chunks[fd >> FD_CHUNK_SHIFT], __ATOMIC_ACQUIRE);
+    return &chunk[fd & (FD_CHUNK_SIZE - 1)];
 }
 
-ssize_t
-ufs_read(int fd, char *buf, size_t size)
+static struct filedesc *
+filedesc_new(struct ufs *fs)
 {
-    if (fd < 0 || fd >= file_descriptor_count || file_descriptors[fd] == NULL) {
-        ufs_error_code = UFS_ERR_NO_FILE;
-        return -1;
+    if (fs->filedesc_free_list == NULL) {
+        struct filedesc_chunk *chunk = malloc(sizeof(*chunk));
+        chunk->next = fs->filedesc_chunks;
+        fs->filedesc_chunks = chunk;
+        for (int i = 0; i < FILEDESC_CHUNK_SIZE; ++i) {
+            chunk->descs[i].next_free = fs->filedesc_free_list;
+            fs->filedesc_free_list = &chunk->descs[i];
+        }
     }
+    struct filedesc *filedesc = fs->filedesc_free_list;
+    fs->filedesc_free_list = filedesc->next_free;
+    memset(filedesc, 0, sizeof(*filedesc));
+    return filedesc;
+}
 
-    struct filedesc *filedesc = file_descriptors[fd];
+static void
+filedesc_delete(struct ufs *fs, struct filedesc *filedesc)
+{
+    filedesc->next_free = fs->filedesc_free_list;
+    fs->filedesc_free_list = filedesc;
+}
 
-    if (filedesc->access_mode == UFS_WRITE_ONLY) {
-        ufs_error_code = UFS_ERR_NO_PERMISSION;
-        return -1;
+static void
+slab_link(struct slab *slab)
+{
+    struct block_cache *cache = slab->cache;
+    slab->prev = NULL;
+    slab->next = cache->partial;
+    if (cache->partial != NULL) {
+        cache->partial->prev = slab;
     }
+    cache->partial = slab;
+}
 
-    if (!filedesc->block) {
-        // Maybe someone wrote into the file after this
-        // descriptor was opened with an empty file
-        filedesc->block = filedesc->file->block_list;
+static void
+slab_unlink(struct slab *slab)
+{
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        slab->cache->partial = slab->next;
+    }
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
     }
+}
 
-    // New file
-    if (!filedesc->block) {
-        // EOF
-        return 0;
+static struct slab *
+slab_new(struct block_cache *cache)
+{
+    uint32_t capacity = SLAB_DATA_SIZE >> cache->shift;
+    if (capacity == 0) {
+        capacity = 1;
     }
+    size_t data_size = (size_t)capacity << cache->shift;
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t header_size = sizeof(struct slab) + capacity * sizeof(struct block);
+    size_t map_size = data_size + (header_size + page_size - 1) / page_size * page_size;
+    char *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        // Like malloc(), it is assumed to never fail
+        abort();
+    }
+    // Fresh anonymous memory is zero, the fields and the blocks included
+    struct slab *slab = (struct slab *)(map + data_size);
+    slab->cache = cache;
+    slab->data = map;
+    slab->shift = cache->shift;
+    slab->map_size = map_size;
+    slab->capacity = capacity;
+    slab_link(slab);
+    return slab;
+}
 
-    struct block *current_block = filedesc->block;
+static void
+slab_delete(struct slab *slab)
+{
+    slab_unlink(slab);
+    munmap(slab->data, slab->map_size);
+}
 
-    size_t read = 0;
-    while (read < size) {
-        if (filedesc->offset == BLOCK_SIZE) {
-            current_block = current_block->next;
-            filedesc->block = current_block;
-            filedesc->offset = 0;
-        } else if (filedesc->offset == filedesc->block->occupied) {
-            break;
-        }
-        if (current_block == NULL) {
-            break;
+static char *
+block_memory(const struct block *block)
+{
+    const struct slab *slab = block->slab;
+    return slab->data + ((size_t)(block - slab->blocks) << slab->shift);
+}
+
+/** A block of 2^shift bytes, zeroed if @a need_zero. */
+static struct block *
+block_new(struct ufs *fs, int shift, bool need_zero)
+{
+    struct block_cache *cache = &fs->block_caches[shift - BLOCK_SHIFT_MIN];
+    mutex_lock(fs, &cache->lock);
+    cache->shift = shift;
+    struct slab *slab = cache->partial;
+    if (slab == NULL) {
+        slab = slab_new(cache);
+    }
+    struct block *block;
+    // Zeroed out of the lock. Fresh blocks are zero already
+    bool is_zeroing_needed = need_zero && slab->free_list != NULL;
+    if (slab->free_list != NULL) {
+        block = slab->free_list;
+        slab->free_list = block->next_free;
+    } else {
+        block = &slab->blocks[slab->fresh_pos++];
+        block->slab = slab;
+    }
+    if (++slab->used == slab->capacity) {
+        slab_unlink(slab);
+    }
+    mutex_unlock(fs, &cache->lock);
+    if (is_zeroing_needed) {
+        memset(block_memory(block), 0, (size_t)1 << shift);
+    }
+    block->refs = 1;
+    return block;
+}
+
+static void
+block_delete(struct ufs *fs, struct block *block)
+{
+    struct slab *slab = block->slab;
+    struct block_cache *cache = slab->cache;
+    if (cache == NULL) {
+        // The blocks of an image slab can be shared by files of
+        // different threads
+        if (__atomic_sub_fetch(&slab->used, 1, __ATOMIC_ACQ_REL) == 0) {
+            munmap(slab->data, slab->map_size);
+            free(slab);
         }
-        buf[read++] = current_block->memory[filedesc->offset++];
+        return;
+    }
+    mutex_lock(fs, &cache->lock);
+    if (slab->used-- == slab->capacity) {
+        slab_link(slab);
     }
+    block->next_free = slab->free_list;
+    slab->free_list = block;
+    // An empty slab is given back, except the last one - otherwise
+    // a create/delete churn would mmap and munmap each time
+    if (slab->used == 0 && (slab->prev != NULL || slab->next != NULL)) {
+        slab_delete(slab);
+    }
+    mutex_unlock(fs, &cache->lock);
+}
 
-    return read;
+static void
+block_ref(struct block *block)
+{
+    __atomic_add_fetch(&block->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void
+block_unref(struct ufs *fs, struct block *block)
+{
+    if (__atomic_sub_fetch(&block->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        block_delete(fs, block);
+    }
+}
+
+static void
+index_node_delete(struct ufs *fs, struct index_node *node, int level);
+
+/** A file out of the namespace. */
+static struct file *
+file_new(struct ufs *fs, const char *filename)
+{
+    struct file *new_file = calloc(1, sizeof(*new_file));
+
+    size_t len = strlen(filename);
+    new_file->name = malloc((len + 1) * sizeof(char));
+    strncpy(new_file->name, filename, len + 1);
+    new_file->fs = fs;
+    new_file->name_hash = name_hash(filename);
+    new_file->block_shift = __atomic_load_n(&fs->default_block_shift, __ATOMIC_RELAXED);
+    pthread_rwlock_init(&new_file->lock, NULL);
+    return new_file;
+}
+
+static struct file *
+create_file(struct ufs *fs, const char *filename)
+{
+    struct file *new_file = file_new(fs, filename);
+    name_table_insert(&name_shard(fs, new_file->name_hash)->table, new_file);
+    return new_file;
 }
 
 static void
 deallocate_file(struct file *file)
 {
-    struct block *current_block = file->block_list;
-    while (current_block) {
-        struct block *next = current_block->next;
-        free(current_block->memory);
-        free(current_block);
-        current_block = next;
+    if (file->index_root != NULL) {
+        index_node_delete(file->fs, file->index_root, file->index_height - 1);
     }
+    pthread_rwlock_destroy(&file->lock);
     free(file->name);
     free(file);
 }
 
-int
-ufs_close(int fd)
+/** Drop a reference taken by ufs_open(). */
+static void
+file_unref(struct file *file)
 {
-    if (fd < 0 || fd >= file_descriptor_count || file_descriptors[fd] == NULL) {
-        ufs_error_code = UFS_ERR_NO_FILE;
-        return -1;
-    }
-
-    struct file *file = file_descriptors[fd]->file;
-    if (--file->refs == 0 && file->is_deleted) {
+    struct ufs *fs = file->fs;
+    struct name_shard *shard = name_shard(fs, file->name_hash);
+    mutex_lock(fs, &shard->lock);
+    bool need_free = --file->refs == 0 && file->is_deleted;
+    mutex_unlock(fs, &shard->lock);
+    if (need_free) {
         deallocate_file(file);
     }
-
-    free(file_descriptors[fd]);
-    file_descriptors[fd] = NULL;
-
-    return 0;
 }
 
 int
-ufs_delete(const char *filename)
+ufs_open_ctx(struct ufs *fs, const char *filename, int flags)
 {
-    struct file *current_file = file_list;
-    while (current_file) {
-        if (strcmp(current_file->name, filename) == 0) {
-            break;
+    uint32_t hash = name_hash(filename);
+    struct name_shard *shard = name_shard(fs, hash);
+    mutex_lock(fs, &shard->lock);
+    struct file *current_file = name_table_find(&shard->table, filename, hash, NULL);
+
+    // File with the given filename doesn't exist
+    if (current_file == NULL) {
+        if ((flags & UFS_CREATE) == 0) {
+            mutex_unlock(fs, &shard->lock);
+            ufs_error_code = UFS_ERR_NO_FILE;
+            return -1;
+        }
+        if ((flags & UFS_READ_ONLY) != 0) {
+            mutex_unlock(fs, &shard->lock);
+            ufs_error_code = UFS_ERR_NO_PERMISSION;
+            return -1;
         }
-        current_file = current_file->next;
+        current_file = create_file(fs, filename);
     }
+    current_file->refs++;
+    mutex_unlock(fs, &shard->lock);
 
-    if (current_file == NULL) {
-        ufs_error_code = UFS_ERR_NO_FILE;
+    mutex_lock(fs, &fs->fd_lock);
+    int fd = fd_alloc(fs);
+    struct filedesc *new_file_descriptor = fd != -1 ? filedesc_new(fs) : NULL;
+    mutex_unlock(fs, &fs->fd_lock);
+    if (fd == -1) {
+        file_unref(current_file);
+        ufs_error_code = UFS_ERR_NO_MEM;
         return -1;
     }
+    new_file_descriptor->file = current_file;
 
-    // Delete the file from the file_list
-    if (current_file->next) {
-        current_file->next->prev = current_file->prev;
-    }
-    if (current_file->prev) {
-        current_file->prev->next = current_file->next;
+    if ((flags & UFS_READ_ONLY) != 0) {
+        new_file_descriptor->access_mode = UFS_READ_ONLY;
+    } else if ((flags & UFS_WRITE_ONLY) != 0) {
+        new_file_descriptor->access_mode = UFS_WRITE_ONLY;
     } else {
-        file_list = current_file->next;
+        new_file_descriptor->access_mode = UFS_READ_WRITE;
     }
 
-    // Set is_deleted flag if there is an open file descriptor
-    // on the file
-    if (current_file->refs == 0) {
-        deallocate_file(current_file);
+    file_lock_write(current_file);
+    new_file_descriptor->next_in_file = current_file->descs;
+    if (current_file->descs != NULL) {
+        current_file->descs->prev_in_file = new_file_descriptor;
+    }
+    current_file->descs = new_file_descriptor;
+    file_unlock(current_file);
+
+    __atomic_store_n(fd_slot(fs, fd), new_file_descriptor, __ATOMIC_RELEASE);
+    return fd;
+}
+
+static struct filedesc *
+get_filedesc(struct ufs *fs, int fd)
+{
+    struct filedesc *filedesc = NULL;
+    if (fd >= 0 && fd < __atomic_load_n(&fs->file_descriptor_capacity, __ATOMIC_ACQUIRE)) {
+        filedesc = __atomic_load_n(fd_slot(fs, fd), __ATOMIC_ACQUIRE);
+    }
+    if (filedesc == NULL) {
+        ufs_error_code = UFS_ERR_NO_FILE;
+    }
+    return filedesc;
+}
+
+/** How many blocks an index of the given height can hold. */
+static size_t
+index_capacity(int height)
+{
+    return height == 0 ? 0 : (size_t)1 << (INDEX_SHIFT * height);
+}
+
+/** Block number @a n of the file, or NULL if there is no such block. */
+static struct block *
+file_find_block(struct file *file, size_t n)
+{
+    if (n >= index_capacity(file->index_height)) {
+        return NULL;
+    }
+    struct index_node *node = file->index_root;
+    for (int level = file->index_height - 1; level > 0 && node != NULL; --level) {
+        node = node->slots[(n >> (INDEX_SHIFT * level)) & (INDEX_FANOUT - 1)];
+    }
+    return node != NULL ? node->slots[n & (INDEX_FANOUT - 1)] : NULL;
+}
+
+/** Index slot of block number @a n of the file. The index path to it is created if missing. */
+static void **
+file_index_slot(struct file *file, size_t n)
+{
+    while (n >= index_capacity(file->index_height)) {
+        // Grow the tree from the top: the old root becomes the first child
+        struct index_node *root = calloc(1, sizeof(*root));
+        root->slots[0] = file->index_root;
+        file->index_root = root;
+        file->index_height++;
+    }
+    struct index_node *node = file->index_root;
+    for (int level = file->index_height - 1; level > 0; --level) {
+        void **slot = &node->slots[(n >> (INDEX_SHIFT * level)) & (INDEX_FANOUT - 1)];
+        if (*slot == NULL) {
+            *slot = calloc(1, sizeof(struct index_node));
+        }
+        node = *slot;
+    }
+    return &node->slots[n & (INDEX_FANOUT - 1)];
+}
+
+/**
+ * Block number @a n of the file, to write into. It and the index
+ * path to it are created if missing, and a block shared with other
+ * files is copied. Unless @a is_overwritten - the caller writes all
+ * of the block, so its old data isn't needed.
+ */
+static struct block *
+file_get_block(struct file *file, size_t n, bool is_overwritten)
+{
+    void **slot = file_index_slot(file, n);
+    struct block *block = *slot;
+    if (block == NULL) {
+        *slot = block_new(file->fs, file->block_shift, !is_overwritten);
+    } else if (__atomic_load_n(&block->refs, __ATOMIC_ACQUIRE) > 1) {
+        // No one can share it meanwhile: the sharing takes the file read lock
+        struct block *copy = block_new(file->fs, file->block_shift, false);
+        if (!is_overwritten) {
+            memcpy(block_memory(copy), block_memory(block), (size_t)1 << file->block_shift);
+        }
+        block_unref(file->fs, block);
+        *slot = copy;
+    }
+    return *slot;
+}
+
+/** How many blocks the file data takes. */
+static size_t
+file_block_count(const struct file *file)
+{
+    return (file->size + ((size_t)1 << file->block_shift) - 1) >> file->block_shift;
+}
+
+static void
+index_node_delete(struct ufs *fs, struct index_node *node, int level)
+{
+    for (int i = 0; i < INDEX_FANOUT; ++i) {
+        if (node->slots[i] == NULL) {
+            continue;
+        }
+        if (level > 0) {
+            index_node_delete(fs, node->slots[i], level - 1);
+        } else {
+            block_unref(fs, node->slots[i]);
+        }
+    }
+    free(node);
+}
+
+/**
+ * Free the blocks from number @a first on, counted from the start
+ * of the subtree, and the nodes left empty. Returns true if the
+ * node itself is freed.
+ */
+static bool
+index_node_truncate(struct ufs *fs, struct index_node *node, int level, size_t first)
+{
+    size_t span = (size_t)1 << (INDEX_SHIFT * level);
+    bool is_empty = true;
+    for (int i = 0; i < INDEX_FANOUT; ++i) {
+        void *slot = node->slots[i];
+        size_t start = i * span;
+        if (slot == NULL) {
+            continue;
+        }
+        if (start + span <= first) {
+            is_empty = false;
+        } else if (start >= first) {
+            if (level > 0) {
+                index_node_delete(fs, slot, level - 1);
+            } else {
+                block_unref(fs, slot);
+            }
+            node->slots[i] = NULL;
+        } else if (index_node_truncate(fs, slot, level - 1, first - start)) {
+            node->slots[i] = NULL;
+        } else {
+            is_empty = false;
+        }
+    }
+    if (is_empty) {
+        free(node);
+    }
+    return is_empty;
+}
+
+/** Cut the file data to @a new_size bytes. The blocks past it are freed at once. */
+static void
+file_truncate(struct file *file, size_t new_size)
+{
+    size_t block_size = (size_t)1 << file->block_shift;
+    size_t tail = new_size & (block_size - 1);
+    size_t last = new_size >> file->block_shift;
+    if (tail != 0 && file_find_block(file, last) != NULL) {
+        // The bytes past the end must be zero, for a later growth
+        struct block *block = file_get_block(file, last, false);
+        memset(block_memory(block) + tail, 0, block_size - tail);
+    }
+    size_t block_count = (new_size + block_size - 1) >> file->block_shift;
+    if (file->index_root != NULL &&
+        index_node_truncate(file->fs, file->index_root, file->index_height - 1, block_count)) {
+        file->index_root = NULL;
+        file->index_height = 0;
+    }
+    // Lower the tree while the first subtree is enough
+    while (file->index_height > 1 && block_count <= index_capacity(file->index_height - 1)) {
+        struct index_node *root = file->index_root;
+        file->index_root = root->slots[0];
+        file->index_height--;
+        free(root);
+        if (file->index_root == NULL) {
+            file->index_height = 0;
+        }
+    }
+    file->size = new_size;
+}
+
+static ssize_t
+file_write_locked(struct file *file, const char *buf, size_t size, size_t pos)
+{
+    // Not pos + size, it can wrap around
+    if (pos > MAX_FILE_SIZE || size > MAX_FILE_SIZE - pos) {
+        ufs_error_code = UFS_ERR_NO_MEM;
+        return -1;
+    }
+    // A write beyond the end leaves a hole before it
+    size_t block_size = (size_t)1 << file->block_shift;
+    size_t written = 0;
+    while (written < size) {
+        size_t offset = pos & (block_size - 1);
+        size_t chunk = block_size - offset;
+        if (chunk > size - written) {
+            chunk = size - written;
+        }
+        struct block *block = file_get_block(file, pos >> file->block_shift, chunk == block_size);
+        memcpy(block_memory(block) + offset, buf + written, chunk);
+        written += chunk;
+        pos += chunk;
+    }
+    if (pos > file->size) {
+        file->size = pos;
+    }
+    return written;
+}
+
+static ssize_t
+file_read_locked(struct file *file, char *buf, size_t size, size_t pos)
+{
+    if (pos >= file->size) {
+        // EOF
+        return 0;
+    }
+    if (size > file->size - pos) {
+        size = file->size - pos;
+    }
+    size_t block_size = (size_t)1 << file->block_shift;
+    size_t read = 0;
+    while (read < size) {
+        struct block *block = file_find_block(file, pos >> file->block_shift);
+        size_t offset = pos & (block_size - 1);
+        size_t chunk = block_size - offset;
+        if (chunk > size - read) {
+            chunk = size - read;
+        }
+        if (block != NULL) {
+            memcpy(buf + read, block_memory(block) + offset, chunk);
+        } else {
+            // A hole
+            memset(buf + read, 0, chunk);
+        }
+        read += chunk;
+        pos += chunk;
+    }
+    return read;
+}
+
+static ssize_t
+file_write(struct file *file, const char *buf, size_t size, size_t pos)
+{
+    file_lock_write(file);
+    ssize_t rc = file_write_locked(file, buf, size, pos);
+    file_unlock(file);
+    return rc;
+}
+
+static ssize_t
+file_read(struct file *file, char *buf, size_t size, size_t pos)
+{
+    file_lock_read(file);
+    ssize_t rc = file_read_locked(file, buf, size, pos);
+    file_unlock(file);
+    return rc;
+}
+
+ssize_t
+ufs_write_ctx(struct ufs *fs, int fd, const char *buf, size_t size)
+{
+    struct filedesc *filedesc = get_filedesc(fs, fd);
+    if (filedesc == NULL) {
+        return -1;
+    }
+    if (filedesc->access_mode == UFS_READ_ONLY) {
+        ufs_error_code = UFS_ERR_NO_PERMISSION;
+        return -1;
+    }
+    ssize_t rc = file_write(filedesc->file, buf, size, filedesc->pos);
+    if (rc > 0) {
+        filedesc->pos += rc;
+    }
+    return rc;
+}
+
+ssize_t
+ufs_read_ctx(struct ufs *fs, int fd, char *buf, size_t size)
+{
+    struct filedesc *filedesc = get_filedesc(fs, fd);
+    if (filedesc == NULL) {
+        return -1;
+    }
+    if (filedesc->access_mode == UFS_WRITE_ONLY) {
+        ufs_error_code = UFS_ERR_NO_PERMISSION;
+        return -1;
+    }
+    ssize_t rc = file_read(filedesc->file, buf, size, filedesc->pos);
+    if (rc > 0) {
+        filedesc->pos += rc;
+    }
+    return rc;
+}
+
+ssize_t
+ufs_pwrite_ctx(struct ufs *fs, int fd, const char *buf, size_t size, size_t offset)
+{
+    struct filedesc *filedesc = get_filedesc(fs, fd);
+    if (filedesc == NULL) {
+        return -1;
+    }
+    if (filedesc->access_mode == UFS_READ_ONLY) {
+        ufs_error_code = UFS_ERR_NO_PERMISSION;
+        return -1;
+    }
+    return file_write(filedesc->file, buf, size, offset);
+}
+
+ssize_t
+ufs_pread_ctx(struct ufs *fs, int fd, char *buf, size_t size, size_t offset)
+{
+    struct filedesc *filedesc = get_filedesc(fs, fd);
+    if (filedesc == NULL) {
+        return -1;
+    }
+    if (filedesc->access_mode == UFS_WRITE_ONLY) {
+        ufs_error_code = UFS_ERR_NO_PERMISSION;
+        return -1;
+    }
+    return file_read(filedesc->file, buf, size, offset);
+}
+
+/** log2 of a valid block size, or -1. */
+static int
+block_size_shift(size_t block_size)
+{
+    if (block_size < UFS_MIN_BLOCK_SIZE || block_size > UFS_MAX_BLOCK_SIZE ||
+        (block_size & (block_size - 1)) != 0) {
+        return -1;
+    }
+    return __builtin_ctzl(block_size);
+}
+
+int
+ufs_set_block_size_ctx(struct ufs *fs, int fd, size_t block_size)
+{
+    struct filedesc *filedesc = get_filedesc(fs, fd);
+    if (filedesc == NULL) {
+        return -1;
+    }
+    struct file *file = filedesc->file;
+    int shift = block_size_shift(block_size);
+    file_lock_write(file);
+    if (shift < 0 || file->index_root != NULL) {
+        file_unlock(file);
+        ufs_error_code = UFS_ERR_INVALID_ARG;
+        return -1;
+    }
+    file->block_shift = shift;
+    file_unlock(file);
+    return 0;
+}
+
+int
+ufs_set_default_block_size_ctx(struct ufs *fs, size_t block_size)
+{
+    int shift = block_size_shift(block_size);
+    if (shift < 0) {
+        ufs_error_code = UFS_ERR_INVALID_ARG;
+        return -1;
+    }
+    __atomic_store_n(&fs->default_block_shift, shift, __ATOMIC_RELAXED);
+    return 0;
+}
+
+ssize_t
+ufs_seek_ctx(struct ufs *fs, int fd, ssize_t offset, int whence)
+{
+    struct filedesc *filedesc = get_filedesc(fs, fd);
+    if (filedesc == NULL) {
+        return -1;
+    }
+    ssize_t base;
+    switch (whence) {
+    case UFS_SEEK_SET:
+        base = 0;
+        break;
+    case UFS_SEEK_CUR:
+        base = filedesc->pos;
+        break;
+    case UFS_SEEK_END:
+        file_lock_read(filedesc->file);
+        base = filedesc->file->size;
+        file_unlock(filedesc->file);
+        break;
+    default:
+        ufs_error_code = UFS_ERR_INVALID_ARG;
+        return -1;
+    }
+    // The base is within the maximal file size, so neither can overflow
+    if (offset < -base || offset > (ssize_t)MAX_FILE_SIZE - base) {
+        ufs_error_code = UFS_ERR_INVALID_ARG;
+        return -1;
+    }
+    filedesc->pos = base + offset;
+    return filedesc->pos;
+}
+
+int
+ufs_resize_ctx(struct ufs *fs, int fd, size_t new_size)
+{
+    struct filedesc *filedesc = get_filedesc(fs, fd);
+    if (filedesc == NULL) {
+        return -1;
+    }
+    if (filedesc->access_mode == UFS_READ_ONLY) {
+        ufs_error_code = UFS_ERR_NO_PERMISSION;
+        return -1;
+    }
+    if (new_size > MAX_FILE_SIZE) {
+        ufs_error_code = UFS_ERR_NO_MEM;
+        return -1;
+    }
+    struct file *file = filedesc->file;
+    file_lock_write(file);
+    if (new_size < file->size) {
+        file_truncate(file, new_size);
+        // The descriptors past the end go on from the new end
+        for (struct filedesc *desc = file->descs; desc != NULL; desc = desc->next_in_file) {
+            if (desc->pos > new_size) {
+                desc->pos = new_size;
+            }
+        }
+    } else {
+        // The growth is a hole
+        file->size = new_size;
+    }
+    file_unlock(file);
+    return 0;
+}
+
+int
+ufs_close_ctx(struct ufs *fs, int fd)
+{
+    struct filedesc *filedesc = get_filedesc(fs, fd);
+    if (filedesc == NULL) {
+        return -1;
+    }
+    mutex_lock(fs, &fs->fd_lock);
+    // Another thread could close it meanwhile
+    if (*fd_slot(fs, fd) != filedesc) {
+        mutex_unlock(fs, &fs->fd_lock);
+        ufs_error_code = UFS_ERR_NO_FILE;
+        return -1;
+    }
+    struct file *file = filedesc->file;
+    __atomic_store_n(fd_slot(fs, fd), NULL, __ATOMIC_RELEASE);
+    fd_mark_free(fs, fd);
+    mutex_unlock(fs, &fs->fd_lock);
+
+    // Not under the descriptor lock, a file lock can wait for long
+    file_lock_write(file);
+    if (filedesc->prev_in_file != NULL) {
+        filedesc->prev_in_file->next_in_file = filedesc->next_in_file;
     } else {
+        file->descs = filedesc->next_in_file;
+    }
+    if (filedesc->next_in_file != NULL) {
+        filedesc->next_in_file->prev_in_file = filedesc->prev_in_file;
+    }
+    file_unlock(file);
+
+    mutex_lock(fs, &fs->fd_lock);
+    filedesc_delete(fs, filedesc);
+    mutex_unlock(fs, &fs->fd_lock);
+    file_unref(file);
+    return 0;
+}
+
+int
+ufs_delete_ctx(struct ufs *fs, const char *filename)
+{
+    uint32_t hash = name_hash(filename);
+    struct name_shard *shard = name_shard(fs, hash);
+    mutex_lock(fs, &shard->lock);
+    struct name_slot *slot;
+    struct file *current_file = name_table_find(&shard->table, filename, hash, &slot);
+    if (current_file == NULL) {
+        mutex_unlock(fs, &shard->lock);
+        ufs_error_code = UFS_ERR_NO_FILE;
+        return -1;
+    }
+
+    // Delete the file from the name table. The slot stays taken
+    // until the next resize
+    slot->file = NAME_TOMBSTONE;
+    shard->table.count--;
+
+    // Set is_deleted flag if there is an open file descriptor
+    // on the file
+    bool need_free = current_file->refs == 0;
+    if (!need_free) {
         current_file->is_deleted = true;
     }
+    mutex_unlock(fs, &shard->lock);
+    if (need_free) {
+        deallocate_file(current_file);
+    }
+    return 0;
+}
 
+/** A copy of the index subtree, sharing the blocks. */
+static struct index_node *
+index_node_clone(const struct index_node *node, int level)
+{
+    struct index_node *copy = malloc(sizeof(*copy));
+    for (int i = 0; i < INDEX_FANOUT; ++i) {
+        if (node->slots[i] == NULL || level == 0) {
+            copy->slots[i] = node->slots[i];
+            if (copy->slots[i] != NULL) {
+                block_ref(copy->slots[i]);
+            }
+        } else {
+            copy->slots[i] = index_node_clone(node->slots[i], level - 1);
+        }
+    }
+    return copy;
+}
+
+/**
+ * Make the data of @a dst, which has none, the same as of @a src.
+ * The blocks are shared, only the index is copied. @a src must be
+ * locked for reading.
+ */
+static void
+file_share_data(struct file *dst, const struct file *src)
+{
+    dst->size = src->size;
+    dst->block_shift = src->block_shift;
+    dst->index_height = src->index_height;
+    if (src->index_root != NULL) {
+        dst->index_root = index_node_clone(src->index_root, src->index_height - 1);
+    }
+}
+
+/** Swap the data of the files, the names stay. */
+static void
+file_swap_data(struct file *a, struct file *b)
+{
+    struct index_node *index_root = a->index_root;
+    int index_height = a->index_height;
+    size_t size = a->size;
+    int block_shift = a->block_shift;
+    a->index_root = b->index_root;
+    a->index_height = b->index_height;
+    a->size = b->size;
+    a->block_shift = b->block_shift;
+    b->index_root = index_root;
+    b->index_height = index_height;
+    b->size = size;
+    b->block_shift = block_shift;
+}
+
+int
+ufs_clone_ctx(struct ufs *fs, const char *src_name, const char *dst_name)
+{
+    uint32_t hash = name_hash(src_name);
+    struct name_shard *shard = name_shard(fs, hash);
+    mutex_lock(fs, &shard->lock);
+    struct file *src = name_table_find(&shard->table, src_name, hash, NULL);
+    if (src == NULL) {
+        mutex_unlock(fs, &shard->lock);
+        ufs_error_code = UFS_ERR_NO_FILE;
+        return -1;
+    }
+    // Keeps it from being freed by a delete meanwhile
+    src->refs++;
+    mutex_unlock(fs, &shard->lock);
+
+    // The data is shared into a file aside, so the locks of the
+    // two files are never held together
+    struct file *copy = file_new(fs, dst_name);
+    file_lock_read(src);
+    file_share_data(copy, src);
+    file_unlock(src);
+    file_unref(src);
+
+    shard = name_shard(fs, copy->name_hash);
+    mutex_lock(fs, &shard->lock);
+    struct file *dst = name_table_find(&shard->table, dst_name, copy->name_hash, NULL);
+    if (dst == NULL) {
+        name_table_insert(&shard->table, copy);
+        mutex_unlock(fs, &shard->lock);
+        return 0;
+    }
+    // The descriptors of the existing file see the new data
+    dst->refs++;
+    mutex_unlock(fs, &shard->lock);
+    file_lock_write(dst);
+    file_swap_data(dst, copy);
+    file_unlock(dst);
+    file_unref(dst);
+    deallocate_file(copy);
+    return 0;
+}
+
+static void
+snapshot_delete(struct snapshot *snapshot)
+{
+    for (uint32_t i = 0; i < snapshot->file_count; ++i) {
+        deallocate_file(snapshot->files[i]);
+    }
+    free(snapshot->files);
+    free(snapshot);
+}
+
+int
+ufs_snapshot_ctx(struct ufs *fs)
+{
+    struct snapshot *snapshot = calloc(1, sizeof(*snapshot));
+    uint32_t capacity = 0;
+    for (int i = 0; i < NAME_SHARD_COUNT; ++i) {
+        struct name_shard *shard = &fs->name_shards[i];
+        mutex_lock(fs, &shard->lock);
+        struct name_table *names = &shard->table;
+        name_table_migrate(names, UINT32_MAX);
+        for (uint32_t j = 0; j < names->capacity; ++j) {
+            struct file *file = names->slots[j].file;
+            if (file == NULL || file == NAME_TOMBSTONE) {
+                continue;
+            }
+            if (snapshot->file_count == capacity) {
+                capacity = capacity == 0 ? 16 : capacity * 2;
+                snapshot->files = realloc(snapshot->files, capacity * sizeof(*snapshot->files));
+            }
+            struct file *copy = file_new(fs, file->name);
+            file_lock_read(file);
+            file_share_data(copy, file);
+            file_unlock(file);
+            snapshot->files[snapshot->file_count++] = copy;
+        }
+        mutex_unlock(fs, &shard->lock);
+    }
+    mutex_lock(fs, &fs->snapshot_lock);
+    snapshot->id = fs->next_snapshot_id++;
+    snapshot->next = fs->snapshots;
+    fs->snapshots = snapshot;
+    mutex_unlock(fs, &fs->snapshot_lock);
+    return snapshot->id;
+}
+
+/** The snapshot with the id and the link to it. The snapshot lock must be held. */
+static struct snapshot **
+snapshot_find(struct ufs *fs, int id)
+{
+    struct snapshot **link = &fs->snapshots;
+    while (*link != NULL && (*link)->id != id) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+int
+ufs_snapshot_restore_ctx(struct ufs *fs, int id)
+{
+    mutex_lock(fs, &fs->snapshot_lock);
+    struct snapshot *snapshot = *snapshot_find(fs, id);
+    if (snapshot == NULL) {
+        mutex_unlock(fs, &fs->snapshot_lock);
+        ufs_error_code = UFS_ERR_INVALID_ARG;
+        return -1;
+    }
+    for (int i = 0; i < NAME_SHARD_COUNT; ++i) {
+        struct name_shard *shard = &fs->name_shards[i];
+        mutex_lock(fs, &shard->lock);
+        struct name_table *names = &shard->table;
+        name_table_migrate(names, UINT32_MAX);
+        // Like ufs_delete() of each file
+        for (uint32_t j = 0; j < names->capacity; ++j) {
+            struct file *file = names->slots[j].file;
+            if (file == NULL || file == NAME_TOMBSTONE) {
+                continue;
+            }
+            names->slots[j].file = NAME_TOMBSTONE;
+            names->count--;
+            if (file->refs == 0) {
+                deallocate_file(file);
+            } else {
+                file->is_deleted = true;
+            }
+        }
+        for (uint32_t j = 0; j < snapshot->file_count; ++j) {
+            const struct file *saved = snapshot->files[j];
+            if (name_shard(fs, saved->name_hash) == shard) {
+                // Nothing changes the snapshot files, they need no lock
+                struct file *copy = file_new(fs, saved->name);
+                file_share_data(copy, saved);
+                name_table_insert(names, copy);
+            }
+        }
+        mutex_unlock(fs, &shard->lock);
+    }
+    mutex_unlock(fs, &fs->snapshot_lock);
+    return 0;
+}
+
+int
+ufs_snapshot_delete_ctx(struct ufs *fs, int id)
+{
+    mutex_lock(fs, &fs->snapshot_lock);
+    struct snapshot **link = snapshot_find(fs, id);
+    struct snapshot *snapshot = *link;
+    if (snapshot == NULL) {
+        mutex_unlock(fs, &fs->snapshot_lock);
+        ufs_error_code = UFS_ERR_INVALID_ARG;
+        return -1;
+    }
+    *link = snapshot->next;
+    mutex_unlock(fs, &fs->snapshot_lock);
+    snapshot_delete(snapshot);
+    return 0;
+}
+
+/**
+ * Image of a file system, as ufs_save() writes it, in the native
+ * byte order: this superblock, the file table, the names, the
+ * allocation bitmap, and then the data of each file. Block n of a
+ * file is at data_offset + n * block size. Its bit in the bitmap
+ * is set if the block is in the image, the space of the others is
+ * a hole of the image file.
+ */
+struct image_super {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t file_count;
+    /** Bytes of the names after the file table, a multiple of 8. */
+    uint64_t names_size;
+    /** Bits of the bitmap after the names, in 64-bit words. */
+    uint64_t bitmap_bits;
+    uint64_t image_size;
+};
+
+struct image_file {
+    uint64_t size;
+    /** Where the data of the file starts in the image. */
+    uint64_t data_offset;
+    /** The bit of the block 0 in the bitmap. */
+    uint64_t bitmap_pos;
+    /** The name without the terminating zero, in the names. */
+    uint64_t name_offset;
+    uint32_t name_len;
+    uint32_t block_shift;
+};
+
+static uint64_t
+round_up(uint64_t value, uint64_t align)
+{
+    return (value + align - 1) / align * align;
+}
+
+/** Offset of the file data in an image, after the data of the previous files. */
+static uint64_t
+image_data_offset(uint64_t offset, int block_shift)
+{
+    uint64_t align = (uint64_t)1 << block_shift;
+    return round_up(offset, align > IMAGE_DATA_ALIGN ? align : IMAGE_DATA_ALIGN);
+}
+
+/** Files of the namespace, in no particular order. */
+static struct file **
+ufs_list_files(struct ufs *fs, uint32_t *count)
+{
+    *count = 0;
+    for (int i = 0; i < NAME_SHARD_COUNT; ++i) {
+        *count += fs->name_shards[i].table.count;
+    }
+    struct file **files = malloc((*count + 1) * sizeof(*files));
+    uint32_t pos = 0;
+    for (int i = 0; i < NAME_SHARD_COUNT; ++i) {
+        struct name_table *names = &fs->name_shards[i].table;
+        name_table_migrate(names, UINT32_MAX);
+        for (uint32_t j = 0; j < names->capacity; ++j) {
+            struct file *file = names->slots[j].file;
+            if (file != NULL && file != NAME_TOMBSTONE) {
+                files[pos++] = file;
+            }
+        }
+    }
+    return files;
+}
+
+/** Write the file data, a pwritev() per run of consecutive blocks. */
+static int
+image_write_data(int fd, struct file *file, uint64_t data_offset)
+{
+    struct iovec iov[IMAGE_IOV_COUNT];
+    size_t block_size = (size_t)1 << file->block_shift;
+    size_t block_count = file_block_count(file);
+    // The run is blocks [first, n)
+    size_t first = 0;
+    for (size_t n = 0; n <= block_count; ++n) {
+        struct block *block = n < block_count ? file_find_block(file, n) : NULL;
+        size_t run = n - first;
+        if (run > 0 && (block == NULL || run == IMAGE_IOV_COUNT)) {
+            ssize_t rc = pwritev(fd, iov, run, data_offset + (first << file->block_shift));
+            if (rc != (ssize_t)(run << file->block_shift)) {
+                return -1;
+            }
+            first = n;
+            run = 0;
+        }
+        if (block == NULL) {
+            first = n + 1;
+            continue;
+        }
+        iov[run].iov_base = block_memory(block);
+        iov[run].iov_len = block_size;
+    }
     return 0;
 }
 
+int
+ufs_save_ctx(struct ufs *fs, const char *path)
+{
+    uint32_t file_count;
+    struct file **files = ufs_list_files(fs, &file_count);
+    struct image_file *entries = calloc(file_count + 1, sizeof(*entries));
+    struct image_super super = {
+        .magic = IMAGE_MAGIC,
+        .version = IMAGE_VERSION,
+        .file_count = file_count,
+    };
+    for (uint32_t i = 0; i < file_count; ++i) {
+        struct image_file *entry = &entries[i];
+        entry->size = files[i]->size;
+        entry->block_shift = files[i]->block_shift;
+        entry->name_offset = super.names_size;
+        entry->name_len = strlen(files[i]->name);
+        entry->bitmap_pos = super.bitmap_bits;
+        super.names_size += entry->name_len;
+        super.bitmap_bits += file_block_count(files[i]);
+    }
+    super.names_size = round_up(super.names_size, sizeof(uint64_t));
+    size_t names_pos = sizeof(super) + file_count * sizeof(*entries);
+    size_t bitmap_pos = names_pos + super.names_size;
+    size_t meta_size = bitmap_pos + round_up(super.bitmap_bits, 64) / 8;
+    uint64_t offset = meta_size;
+    for (uint32_t i = 0; i < file_count; ++i) {
+        entries[i].data_offset = image_data_offset(offset, files[i]->block_shift);
+        offset = entries[i].data_offset + (file_block_count(files[i]) << files[i]->block_shift);
+    }
+    super.image_size = offset;
+
+    char *meta = calloc(1, meta_size);
+    memcpy(meta, &super, sizeof(super));
+    memcpy(meta + sizeof(super), entries, file_count * sizeof(*entries));
+    uint64_t *bitmap = (uint64_t *)(meta + bitmap_pos);
+    for (uint32_t i = 0; i < file_count; ++i) {
+        memcpy(meta + names_pos + entries[i].name_offset, files[i]->name, entries[i].name_len);
+        size_t block_count = file_block_count(files[i]);
+        for (size_t n = 0; n < block_count; ++n) {
+            if (file_find_block(files[i], n) != NULL) {
+                uint64_t bit = entries[i].bitmap_pos + n;
+                bitmap[bit / 64] |= (uint64_t)1 << (bit % 64);
+            }
+        }
+    }
+
+    // Written aside and renamed, so a failure leaves the old image
+    size_t path_len = strlen(path);
+    char *tmp_path = malloc(path_len + sizeof(".tmp"));
+    memcpy(tmp_path, path, path_len);
+    memcpy(tmp_path + path_len, ".tmp", sizeof(".tmp"));
+    int rc = -1;
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd != -1) {
+        rc = pwrite(fd, meta, meta_size, 0) == (ssize_t)meta_size ? 0 : -1;
+        for (uint32_t i = 0; i < file_count && rc == 0; ++i) {
+            rc = image_write_data(fd, files[i], entries[i].data_offset);
+        }
+        if (rc == 0) {
+            // The trailing holes are a part of the image too
+            rc = ftruncate(fd, super.image_size);
+        }
+        if (close(fd) != 0) {
+            rc = -1;
+        }
+        if (rc == 0) {
+            rc = rename(tmp_path, path);
+        }
+        if (rc != 0) {
+            unlink(tmp_path);
+        }
+    }
+    if (rc != 0) {
+        ufs_error_code = UFS_ERR_IO;
+    }
+    free(tmp_path);
+    free(meta);
+    free(entries);
+    free(files);
+    return rc;
+}
+
+/** Check the superblock and the file table against the image size. */
+static bool
+image_is_valid(const char *meta, size_t image_size)
+{
+    const struct image_super *super = (const struct image_super *)meta;
+    if (image_size < sizeof(*super) || super->magic != IMAGE_MAGIC ||
+        super->version != IMAGE_VERSION || super->image_size > image_size ||
+        super->names_size % sizeof(uint64_t) != 0 || super->names_size > image_size ||
+        super->bitmap_bits / 8 > image_size) {
+        return false;
+    }
+    size_t names_pos = sizeof(*super) + (size_t)super->file_count * sizeof(struct image_file);
+    size_t meta_size = names_pos + super->names_size + round_up(super->bitmap_bits, 64) / 8;
+    if (meta_size > image_size) {
+        return false;
+    }
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    const struct image_file *entries = (const struct image_file *)(meta + sizeof(*super));
+    for (uint32_t i = 0; i < super->file_count; ++i) {
+        const struct image_file *entry = &entries[i];
+        if (entry->block_shift < BLOCK_SHIFT_MIN || entry->block_shift > BLOCK_SHIFT_MAX ||
+            entry->size > MAX_FILE_SIZE || entry->name_offset > super->names_size ||
+            entry->name_len > super->names_size - entry->name_offset ||
+            memchr(meta + names_pos + entry->name_offset, 0, entry->name_len) != NULL) {
+            return false;
+        }
+        size_t block_count = (entry->size + ((size_t)1 << entry->block_shift) - 1) >> entry->block_shift;
+        size_t data_size = block_count << entry->block_shift;
+        if (entry->bitmap_pos > super->bitmap_bits ||
+            block_count > super->bitmap_bits - entry->bitmap_pos ||
+            entry->data_offset % page_size != 0 || entry->data_offset < meta_size ||
+            entry->data_offset > super->image_size ||
+            data_size > super->image_size - entry->data_offset) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Create a file of the image entry. Its blocks are in a slab of the
+ * private mapping of its data, so they are paged in when touched.
+ */
+static int
+image_load_file(struct ufs *fs, int fd, const char *meta, const struct image_file *entry)
+{
+    const struct image_super *super = (const struct image_super *)meta;
+    const char *name = meta + sizeof(*super) + super->file_count * sizeof(*entry) + entry->name_offset;
+    char *filename = strndup(name, entry->name_len);
+    uint32_t hash = name_hash(filename);
+    if (name_table_find(&name_shard(fs, hash)->table, filename, hash, NULL) != NULL) {
+        // A duplicate name
+        free(filename);
+        return -1;
+    }
+    struct file *file = create_file(fs, filename);
+    free(filename);
+    file->size = entry->size;
+    file->block_shift = entry->block_shift;
+    size_t block_count = file_block_count(file);
+    if (block_count == 0) {
+        return 0;
+    }
+
+    size_t map_size = round_up(block_count << file->block_shift, sysconf(_SC_PAGESIZE));
+    char *data = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, entry->data_offset);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+    struct slab *slab = calloc(1, sizeof(*slab) + block_count * sizeof(struct block));
+    slab->data = data;
+    slab->shift = file->block_shift;
+    slab->map_size = map_size;
+    slab->capacity = block_count;
+    const uint64_t *bitmap = (const uint64_t *)(meta + sizeof(*super) +
+                                                super->file_count * sizeof(*entry) + super->names_size);
+    for (size_t n = 0; n < block_count; ++n) {
+        uint64_t bit = entry->bitmap_pos + n;
+        if ((bitmap[bit / 64] & ((uint64_t)1 << (bit % 64))) == 0) {
+            // A hole
+            continue;
+        }
+        struct block *block = &slab->blocks[n];
+        block->slab = slab;
+        block->refs = 1;
+        slab->used++;
+        *file_index_slot(file, n) = block;
+    }
+    if (slab->used == 0) {
+        munmap(data, map_size);
+        free(slab);
+    }
+    return 0;
+}
+
+int
+ufs_load_ctx(struct ufs *fs, const char *path)
+{
+    for (int i = 0; i < NAME_SHARD_COUNT; ++i) {
+        if (fs->name_shards[i].table.count != 0) {
+            ufs_error_code = UFS_ERR_INVALID_ARG;
+            return -1;
+        }
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        ufs_error_code = UFS_ERR_IO;
+        return -1;
+    }
+    struct stat st;
+    char *meta = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        // Only the metadata pages are touched here
+        meta = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    int rc = -1;
+    if (meta != MAP_FAILED && image_is_valid(meta, st.st_size)) {
+        const struct image_super *super = (const struct image_super *)meta;
+        const struct image_file *entries = (const struct image_file *)(meta + sizeof(*super));
+        rc = 0;
+        uint32_t loaded = 0;
+        for (; loaded < super->file_count && rc == 0; ++loaded) {
+            rc = image_load_file(fs, fd, meta, &entries[loaded]);
+        }
+        if (rc != 0) {
+            // Nothing is loaded on a failure
+            uint32_t count;
+            struct file **files = ufs_list_files(fs, &count);
+            for (uint32_t i = 0; i < count; ++i) {
+                ufs_delete_ctx(fs, files[i]->name);
+            }
+            free(files);
+        }
+    }
+    if (meta != MAP_FAILED) {
+        munmap(meta, st.st_size);
+    }
+    // The mappings of the data stay valid without the descriptor
+    close(fd);
+    if (rc != 0) {
+        ufs_error_code = UFS_ERR_IO;
+    }
+    return rc;
+}
+
 void
-ufs_destroy(void)
+ufs_enable_concurrency_ctx(struct ufs *fs)
+{
+    if (fs->is_concurrent) {
+        return;
+    }
+    pthread_mutex_init(&fs->fd_lock, NULL);
+    pthread_mutex_init(&fs->snapshot_lock, NULL);
+    for (int i = 0; i < NAME_SHARD_COUNT; ++i) {
+        pthread_mutex_init(&fs->name_shards[i].lock, NULL);
+    }
+    for (int i = 0; i <= BLOCK_SHIFT_MAX - BLOCK_SHIFT_MIN; ++i) {
+        pthread_mutex_init(&fs->block_caches[i].lock, NULL);
+    }
+    fs->is_concurrent = true;
+}
+
+struct ufs *
+ufs_new(void)
+{
+    struct ufs *fs = aligned_alloc(_Alignof(struct ufs), sizeof(*fs));
+    memset(fs, 0, sizeof(*fs));
+    fs->default_block_shift = BLOCK_SHIFT_MIN;
+    return fs;
+}
+
+/** Free everything of the file system and make it empty again. */
+static void
+ufs_clear(struct ufs *fs)
 {
-    for (int i = 0; i < file_descriptor_count; ++i) {
-        if (file_descriptors[i] != NULL) {
-            ufs_close(i);
+    for (int i = 0; i < fs->file_descriptor_capacity; ++i) {
+        if (*fd_slot(fs, i) != NULL) {
+            ufs_close_ctx(fs, i);
         }
     }
-    free(file_descriptors);
-    struct file *current_file = file_list;
-    while (current_file != NULL) {
-        struct file *next = current_file->next;
-        deallocate_file(current_file);
-        current_file = next;
+    for (int i = 0; i < fs->file_descriptor_capacity >> FD_CHUNK_SHIFT; ++i) {
+        free(fs->fd_chunks[i]);
+        fs->fd_chunks[i] = NULL;
     }
+    fs->file_descriptor_capacity = 0;
+    free(fs->fd_free_bits);
+    fs->fd_free_bits = NULL;
+    free(fs->fd_free_summary);
+    fs->fd_free_summary = NULL;
+    fs->fd_summary_hint = 0;
+    while (fs->filedesc_chunks != NULL) {
+        struct filedesc_chunk *next = fs->filedesc_chunks->next;
+        free(fs->filedesc_chunks);
+        fs->filedesc_chunks = next;
+    }
+    fs->filedesc_free_list = NULL;
+    for (int i = 0; i < NAME_SHARD_COUNT; ++i) {
+        struct name_table *names = &fs->name_shards[i].table;
+        name_table_migrate(names, UINT32_MAX);
+        for (uint32_t j = 0; j < names->capacity; ++j) {
+            struct file *file = names->slots[j].file;
+            if (file != NULL && file != NAME_TOMBSTONE) {
+                deallocate_file(file);
+            }
+        }
+        name_table_destroy(names);
+    }
+    while (fs->snapshots != NULL) {
+        struct snapshot *next = fs->snapshots->next;
+        snapshot_delete(fs->snapshots);
+        fs->snapshots = next;
+    }
+    fs->next_snapshot_id = 0;
+    // All the blocks are freed, only the kept empty slabs are left
+    for (int i = 0; i <= BLOCK_SHIFT_MAX - BLOCK_SHIFT_MIN; ++i) {
+        while (fs->block_caches[i].partial != NULL) {
+            slab_delete(fs->block_caches[i].partial);
+        }
+    }
+    fs->default_block_shift = BLOCK_SHIFT_MIN;
+    if (fs->is_concurrent) {
+        fs->is_concurrent = false;
+        pthread_mutex_destroy(&fs->fd_lock);
+        pthread_mutex_destroy(&fs->snapshot_lock);
+        for (int i = 0; i < NAME_SHARD_COUNT; ++i) {
+            pthread_mutex_destroy(&fs->name_shards[i].lock);
+        }
+        for (int i = 0; i <= BLOCK_SHIFT_MAX - BLOCK_SHIFT_MIN; ++i) {
+            pthread_mutex_destroy(&fs->block_caches[i].lock);
+        }
+    }
+}
+
+void
+ufs_free(struct ufs *fs)
+{
+    ufs_clear(fs);
+    free(fs);
+}
+
+int
+ufs_open(const char *filename, int flags)
+{
+    return ufs_open_ctx(&default_ufs, filename, flags);
+}
+
+ssize_t
+ufs_write(int fd, const char *buf, size_t size)
+{
+    return ufs_write_ctx(&default_ufs, fd, buf, size);
+}
+
+ssize_t
+ufs_read(int fd, char *buf, size_t size)
+{
+    return ufs_read_ctx(&default_ufs, fd, buf, size);
+}
+
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, size_t offset)
+{
+    return ufs_pwrite_ctx(&default_ufs, fd, buf, size, offset);
+}
+
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, size_t offset)
+{
+    return ufs_pread_ctx(&default_ufs, fd, buf, size, offset);
+}
+
+ssize_t
+ufs_seek(int fd, ssize_t offset, int whence)
+{
+    return ufs_seek_ctx(&default_ufs, fd, offset, whence);
+}
+
+int
+ufs_set_block_size(int fd, size_t block_size)
+{
+    return ufs_set_block_size_ctx(&default_ufs, fd, block_size);
+}
+
+int
+ufs_set_default_block_size(size_t block_size)
+{
+    return ufs_set_default_block_size_ctx(&default_ufs, block_size);
+}
+
+int
+ufs_close(int fd)
+{
+    return ufs_close_ctx(&default_ufs, fd);
+}
+
+int
+ufs_delete(const char *filename)
+{
+    return ufs_delete_ctx(&default_ufs, filename);
+}
+
+void
+ufs_enable_concurrency(void)
+{
+    ufs_enable_concurrency_ctx(&default_ufs);
+}
+
+void
+ufs_destroy(void)
+{
+    ufs_clear(&default_ufs);
+}
+
+int
+ufs_save(const char *path)
+{
+    return ufs_save_ctx(&default_ufs, path);
+}
+
+int
+ufs_load(const char *path)
+{
+    return ufs_load_ctx(&default_ufs, path);
+}
+
+int
+ufs_clone(const char *src, const char *dst)
+{
+    return ufs_clone_ctx(&default_ufs, src, dst);
+}
+
+int
+ufs_snapshot(void)
+{
+    return ufs_snapshot_ctx(&default_ufs);
+}
+
+int
+ufs_snapshot_restore(int id)
+{
+    return ufs_snapshot_restore_ctx(&default_ufs, id);
+}
+
+int
+ufs_snapshot_delete(int id)
+{
+    return ufs_snapshot_delete_ctx(&default_ufs, id);
+}
+
+int
+ufs_resize(int fd, size_t new_size)
+{
+    return ufs_resize_ctx(&default_ufs, fd, new_size);
 }
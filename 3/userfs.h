@@ -25,6 +25,7 @@
  */
 
 #define NEED_OPEN_FLAGS
+#define NEED_RESIZE
 
 /**
  * Flags for ufs_open call.
@@ -67,6 +68,21 @@ enum ufs_error_code {
 
 	UFS_ERR_NO_PERMISSION,
 #endif
+	UFS_ERR_INVALID_ARG,
+	UFS_ERR_IO,
+};
+
+/** Allowed block sizes, powers of 2. The default is the minimal one. */
+enum {
+	UFS_MIN_BLOCK_SIZE = 512,
+	UFS_MAX_BLOCK_SIZE = 2 * 1024 * 1024,
+};
+
+/** Origin of the offset in ufs_seek(), like in lseek(). */
+enum ufs_seek_whence {
+	UFS_SEEK_SET = 0,
+	UFS_SEEK_CUR,
+	UFS_SEEK_END,
 };
 
 /** Get code of the last error. */
@@ -114,6 +130,83 @@ ufs_write(int fd, const char *buf, size_t size);
 ssize_t
 ufs_read(int fd, char *buf, size_t size);
 
+/**
+ * Write data at the given offset. The descriptor position is not
+ * changed. Writing beyond the end fills the gap with zeros.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to write.
+ * @param size Size of @a buf.
+ * @param offset Offset in the file.
+ *
+ * @retval >= 0 How many bytes were written.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, size_t offset);
+
+/**
+ * Read data from the given offset. The descriptor position is not
+ * changed.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to read into.
+ * @param size Maximum bytes to read.
+ * @param offset Offset in the file.
+ *
+ * @retval > 0 How many bytes were read.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, size_t offset);
+
+/**
+ * Move the position of a descriptor. The position can be set
+ * beyond the end of the file, but not beyond the maximal file
+ * size.
+ * @param fd File descriptor from ufs_open().
+ * @param offset Offset relative to @a whence.
+ * @param whence One of ufs_seek_whence.
+ *
+ * @retval >= 0 The new position.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_INVALID_ARG - bad @a whence, or the position
+ *       would be negative or beyond the maximal file size.
+ */
+ssize_t
+ufs_seek(int fd, ssize_t offset, int whence);
+
+/**
+ * Set the block size of a file. Bigger blocks mean fewer
+ * allocations and longer memcpy() runs for big files, and more
+ * waste for small ones. Can only be done until the file gets
+ * data.
+ * @param fd File descriptor from ufs_open().
+ * @param block_size A power of 2 from UFS_MIN_BLOCK_SIZE to
+ *     UFS_MAX_BLOCK_SIZE.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_INVALID_ARG - bad size, or the file has data.
+ */
+int
+ufs_set_block_size(int fd, size_t block_size);
+
+/**
+ * Set the block size of the files created after the call.
+ * @param block_size Same as in ufs_set_block_size().
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_INVALID_ARG - bad size.
+ */
+int
+ufs_set_default_block_size(size_t block_size);
+
 /**
  * Close a file.
  * @param fd File descriptor from ufs_open().
@@ -143,11 +236,12 @@ ufs_delete(const char *filename);
 
 /**
  * Resize a file opened by the file descriptor @a fd. If current
- * file size is less than @a new_size, then new empty blocks are
- * created and positions of opened file descriptors are not
- * changed. If the current size is bigger than @a new_size, then
- * the blocks are truncated. Opened file descriptors behind the
- * new file size should proceed from the new file end.
+ * file size is less than @a new_size, then the file grows by a
+ * hole, which reads as zeros and takes no memory, and positions
+ * of opened file descriptors are not changed. If the current size
+ * is bigger than @a new_size, then the blocks past the new end are
+ * freed at once. Opened file descriptors behind the new file size
+ * proceed from the new file end.
  *
  * @param fd File descriptor from ufs_open().
  * @param new_size New file size.
@@ -164,6 +258,107 @@ ufs_resize(int fd, size_t new_size);
 
 #endif
 
+/**
+ * Make @a dst a copy of @a src. No data is copied: the files share
+ * the blocks, and a shared block is copied when one of the files
+ * writes into it. If @a dst exists, its data is replaced, and its
+ * open descriptors see the new data.
+ * @param src Name of the file to copy.
+ * @param dst Name of the copy. Created if missing.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no file @a src.
+ */
+int
+ufs_clone(const char *src, const char *dst);
+
+/**
+ * Take a snapshot of all the files: their names and data as of now.
+ * Like with ufs_clone(), the data is not copied. The files changed
+ * by other threads during the call can be taken before or after
+ * the change.
+ *
+ * @retval >= 0 Snapshot id.
+ */
+int
+ufs_snapshot(void);
+
+/**
+ * Replace all the files with the ones of a snapshot. The files
+ * not in the snapshot are deleted, as with ufs_delete(), so their
+ * open descriptors still work. The snapshot stays and can be
+ * restored again.
+ * @param id Snapshot id from ufs_snapshot().
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_INVALID_ARG - no such snapshot.
+ */
+int
+ufs_snapshot_restore(int id);
+
+/**
+ * Delete a snapshot. The blocks only it holds are freed.
+ * @param id Snapshot id from ufs_snapshot().
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_INVALID_ARG - no such snapshot.
+ */
+int
+ufs_snapshot_delete(int id);
+
+/**
+ * Save all the files into an image file at @a path, to be loaded
+ * with ufs_load(). The image is written aside and renamed, so a
+ * failure keeps the old one. The deleted files which are still
+ * open are not saved, nor the descriptors and the snapshots. The
+ * blocks shared by clones are saved for each file. No other thread can
+ * use the file system during the call.
+ * @param path Path of the image in the real file system.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_IO - could not write the image.
+ */
+int
+ufs_save(const char *path);
+
+/**
+ * Load the files of an image saved by ufs_save(). The file system
+ * must have no files. Only the metadata is read, the data of the
+ * files is mapped and read from the image when it is touched. The
+ * changes of the files are not written back. After the call the
+ * image can be removed or replaced by ufs_save(), but must not be
+ * changed in place. No other thread can use the file system
+ * during the call.
+ * @param path Path of the image in the real file system.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_INVALID_ARG - the file system has files.
+ *     - UFS_ERR_IO - could not read the image, or it is not
+ *       valid. Nothing is loaded then.
+ */
+int
+ufs_load(const char *path);
+
+/**
+ * Make the functions safe to call from several threads. Before
+ * the call only one thread can use the file system, and the call
+ * itself has to be done by that thread. Without it no locks are
+ * taken. ufs_destroy() turns it off.
+ *
+ * Each thread has its own ufs_errno(). Descriptors can be shared
+ * by the threads, but their position is not synchronized: use
+ * ufs_pread() and ufs_pwrite() on a shared descriptor. As with
+ * the POSIX descriptors, closing a descriptor which another
+ * thread is still using is a race of the caller.
+ */
+void
+ufs_enable_concurrency(void);
+
 /**
  * Destroy all the global variables, free all the memory, close and delete all
  * the files. After the destruction neither of the ufs functions are supposed to
@@ -171,3 +366,79 @@ ufs_resize(int fd, size_t new_size);
  */
 void
 ufs_destroy(void);
+
+/**
+ * A file system instance. The functions above work on a default
+ * one, the _ctx ones below on an explicit one. The instances share
+ * nothing but the thread's ufs_errno(): descriptors and file names
+ * of one are unknown to the others. An instance used by one
+ * thread only needs no ufs_enable_concurrency_ctx() and takes no
+ * locks, so a service can give each worker its own file system.
+ */
+struct ufs;
+
+/** Create an empty file system. Never fails, like malloc() here. */
+struct ufs *
+ufs_new(void);
+
+/** Close and delete all the files of @a fs and free it. */
+void
+ufs_free(struct ufs *fs);
+
+int
+ufs_open_ctx(struct ufs *fs, const char *filename, int flags);
+
+ssize_t
+ufs_write_ctx(struct ufs *fs, int fd, const char *buf, size_t size);
+
+ssize_t
+ufs_read_ctx(struct ufs *fs, int fd, char *buf, size_t size);
+
+ssize_t
+ufs_pwrite_ctx(struct ufs *fs, int fd, const char *buf, size_t size, size_t offset);
+
+ssize_t
+ufs_pread_ctx(struct ufs *fs, int fd, char *buf, size_t size, size_t offset);
+
+ssize_t
+ufs_seek_ctx(struct ufs *fs, int fd, ssize_t offset, int whence);
+
+int
+ufs_set_block_size_ctx(struct ufs *fs, int fd, size_t block_size);
+
+int
+ufs_set_default_block_size_ctx(struct ufs *fs, size_t block_size);
+
+int
+ufs_close_ctx(struct ufs *fs, int fd);
+
+int
+ufs_delete_ctx(struct ufs *fs, const char *filename);
+
+#ifdef NEED_RESIZE
+
+int
+ufs_resize_ctx(struct ufs *fs, int fd, size_t new_size);
+
+#endif
+
+int
+ufs_clone_ctx(struct ufs *fs, const char *src, const char *dst);
+
+int
+ufs_snapshot_ctx(struct ufs *fs);
+
+int
+ufs_snapshot_restore_ctx(struct ufs *fs, int id);
+
+int
+ufs_snapshot_delete_ctx(struct ufs *fs, int id);
+
+int
+ufs_save_ctx(struct ufs *fs, const char *path);
+
+int
+ufs_load_ctx(struct ufs *fs, const char *path);
+
+void
+ufs_enable_concurrency_ctx(struct ufs *fs);